@@ -0,0 +1,65 @@
+// Parallel binned-SAH BVH build throughput.
+//
+// Builds a bvh over a million random spheres with pools of 1 to N threads
+// (N = hardware threads) and reports build rate in Mprims/s and the speedup
+// over one thread. Every build must give the same tree.
+//
+// g++ -O3 -std=c++17 -pthread build.cpp -o build
+
+#include "../library/utility.h"
+
+#include "../library/arena.h"
+#include "../library/bvh.h"
+#include "../library/material.h"
+#include "../library/parallel.h"
+#include "../library/sphere.h"
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+int main()
+{
+	scene_arena arena;
+	std::vector<shared_ptr<hittable>> objects;
+	auto mat = arena.make<lambertian>(color(.5, .5, .5));
+
+	const int sphere_count = 1000000;
+	seed_random(11);
+	for (int i = 0; i < sphere_count; i++)
+		objects.push_back(arena.make<sphere>(vec3::random(-100, 100), random_double(.05, .5), mat));
+
+	int max_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	std::cout << "Primitives: " << sphere_count << ", hardware threads: " << max_threads << "\n";
+
+	double single = 0;
+	size_t reference_nodes = 0;
+	for (int threads = 1; threads <= max_threads; threads *= 2)
+	{
+		thread_pool pool(threads);
+
+		// Best of three, the first run also warms the pool and the page cache.
+		double best = infinity;
+		size_t nodes = 0;
+		for (int run = 0; run < 3; run++)
+		{
+			auto begin = std::chrono::steady_clock::now();
+			bvh tree(objects, pool);
+			best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count());
+			nodes = tree.node_count();
+		}
+
+		if (threads == 1)
+		{
+			single = best;
+			reference_nodes = nodes;
+		}
+
+		std::cout << threads << " thread(s): " << best << " ms, " << sphere_count / best / 1000 << " Mprims/s, "
+			<< single / best << "x" << (nodes == reference_nodes ? "" : " (TREE DIFFERS)") << "\n";
+
+		if (threads < max_threads && threads * 2 > max_threads)
+			threads = max_threads / 2;
+	}
+}
@@ -0,0 +1,87 @@
+// Virtual vs. statically dispatched scene traversal.
+//
+// Renders the same random-sphere scene twice: once through hittable_list
+// (virtual hittable::hit / material::scatter) and once through
+// static_scene<sphere, quad>, where camera::render is instantiated for the
+// concrete container and every primitive and material call can be inlined.
+//
+// g++ -O3 -std=c++17 dispatch.cpp -o dispatch
+
+#include "../library/utility.h"
+
+#include "../library/arena.h"
+#include "../library/camera.h"
+#include "../library/hittableList.h"
+#include "../library/material.h"
+#include "../library/quad.h"
+#include "../library/sphere.h"
+#include "../library/staticScene.h"
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+template <typename World>
+double time_render(camera& cam, const World& world)
+{
+	// Discard the image and the progress output.
+	std::ostringstream sink;
+	auto* out = std::cout.rdbuf(sink.rdbuf());
+	auto* log = std::clog.rdbuf(sink.rdbuf());
+
+	seed_random(1);
+	auto begin = std::chrono::steady_clock::now();
+	cam.render(world);
+	auto end = std::chrono::steady_clock::now();
+
+	std::cout.rdbuf(out);
+	std::clog.rdbuf(log);
+	return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+int main()
+{
+	scene_arena arena;
+	hittable_list list;
+	static_scene<sphere, quad> fixed;
+
+	shared_ptr<material> materials[] = {
+		arena.make<lambertian>(color(.7, .3, .3)),
+		arena.make<metal>(color(.8, .8, .8), .2),
+		arena.make<dielectric>(1.5),
+	};
+
+	auto ground = arena.make<lambertian>(color(.5, .5, .5));
+	sphere ground_sphere(vec3(0, -1000, 0), 1000, ground);
+	list.add(arena.make<sphere>(ground_sphere));
+	fixed.add(ground_sphere);
+
+	for (int a = -6; a < 6; a++)
+	{
+		for (int b = -6; b < 6; b++)
+		{
+			sphere s(vec3(a + .9 * random_double(), .2, b + .9 * random_double()), .2, materials[(a + b + 12) % 3]);
+			list.add(arena.make<sphere>(s));
+			fixed.add(s);
+		}
+	}
+
+	camera cam;
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.image_width = 320;
+	cam.samples_per_pixel = 16;
+	cam.max_depth = 10;
+	cam.background = color(.7, .8, 1);
+	cam.fov = 20;
+	cam.look_from = vec3(13, 2, 3);
+	cam.look_at = vec3(0, 0, 0);
+
+	std::cout << "Primitives: " << fixed.size() << "\n";
+
+	double t_virtual = time_render(cam, list);
+	double t_static = time_render(cam, fixed);
+
+	std::cout << "hittable_list (virtual):  " << t_virtual << " ms\n";
+	std::cout << "static_scene (inlined):   " << t_static << " ms\n";
+	std::cout << "Speedup: " << t_virtual / t_static << "x\n";
+}
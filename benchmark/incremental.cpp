@@ -0,0 +1,98 @@
+// Incremental re-rendering after single-object edits.
+//
+// Renders a scene1-style frame with a field of small spheres into a
+// render_cache, then nudges one small sphere at a time, invalidates the tiles
+// it can have changed and re-renders only those. Reports the share of tiles
+// re-rendered and the time against a full render.
+//
+// g++ -O3 -std=c++17 -pthread incremental.cpp -o incremental
+
+#include "../library/utility.h"
+
+#include "../library/arena.h"
+#include "../library/bvh.h"
+#include "../library/camera.h"
+#include "../library/hittableList.h"
+#include "../library/material.h"
+#include "../library/renderCache.h"
+#include "../library/sphere.h"
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+template <typename F>
+double time_quiet(F&& f)
+{
+	// Discard the image and the progress output.
+	std::ostringstream sink;
+	auto* out = std::cout.rdbuf(sink.rdbuf());
+	auto* log = std::clog.rdbuf(sink.rdbuf());
+
+	auto begin = std::chrono::steady_clock::now();
+	f();
+	auto end = std::chrono::steady_clock::now();
+
+	std::cout.rdbuf(out);
+	std::clog.rdbuf(log);
+	return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+int main()
+{
+	scene_arena arena;
+	hittable_list world;
+	std::vector<shared_ptr<sphere>> small;
+
+	auto ground = arena.make<lambertian>(color(.1, .15, .2));
+	world.add(arena.make<sphere>(vec3(0, -100.5, -1), 100, ground));
+	world.add(arena.make<sphere>(vec3(0, 0, -1), .5, arena.make<lambertian>(color(.1, .2, .5))));
+	world.add(arena.make<sphere>(vec3(-1, 0, -1), .5, arena.make<dielectric>(1.5)));
+	world.add(arena.make<sphere>(vec3(1, 0, -1), .5, arena.make<metal>(color(.8, .6, .2), 0)));
+
+	seed_random(7);
+	for (int a = -4; a < 4; a++)
+	{
+		for (int b = -4; b < 2; b++)
+		{
+			auto mat = arena.make<lambertian>(color::random() * color::random());
+			auto s = arena.make<sphere>(vec3(.5 * a + .3 * random_double(), -.4, .5 * b - 1 + .3 * random_double()), .1, mat);
+			world.add(s);
+			small.push_back(s);
+		}
+	}
+
+	camera cam;
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.image_width = 320;
+	cam.samples_per_pixel = 16;
+	cam.max_depth = 10;
+	cam.background = color(.7, .8, 1);
+	cam.fov = 40;
+	cam.look_from = vec3(-2, 2, 1);
+	cam.look_at = vec3(0, 0, -1);
+
+	render_cache cache;
+	double t_full = time_quiet([&] { cam.render_incremental(bvh(world), cache); });
+	int tile_count = static_cast<int>(cache.tiles.size());
+
+	const int edits = 8;
+	double t_edit = 0;
+	int rerendered = 0;
+	for (int k = 0; k < edits; k++)
+	{
+		auto& s = small[(k * 7) % small.size()];
+		aabb old_box = s->bounding_box();
+		s->set_center(s->get_center() + vec3(.1, 0, .05));
+
+		cam.invalidate(cache, *s, old_box);
+		rerendered += cache.invalid_count();
+		t_edit += time_quiet([&] { cam.render_incremental(bvh(world), cache); });
+	}
+
+	std::cout << "Objects: " << world.objects.size() << ", tiles: " << tile_count << "\n";
+	std::cout << "Full render:        " << t_full << " ms\n";
+	std::cout << "Single-object edit: " << t_edit / edits << " ms, "
+		<< 100.0 * rerendered / (edits * tile_count) << "% of tiles re-rendered\n";
+	std::cout << "Speedup: " << t_full / (t_edit / edits) << "x\n";
+}
@@ -0,0 +1,69 @@
+// Any-hit occlusion queries vs. closest-hit queries.
+//
+// Builds a BVH over a field of random spheres and quads and answers the same
+// batch of point-to-point visibility queries twice: with bvh::occluded, which
+// stops at the first hit, and with bvh::hit, which finds the closest hit and
+// fills a hit record. Checks that both agree.
+//
+// g++ -O3 -std=c++17 occlusion.cpp -o occlusion
+
+#include "../library/utility.h"
+
+#include "../library/arena.h"
+#include "../library/bvh.h"
+#include "../library/hittableList.h"
+#include "../library/material.h"
+#include "../library/quad.h"
+#include "../library/sphere.h"
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+int main()
+{
+	scene_arena arena;
+	hittable_list list;
+	auto mat = arena.make<lambertian>(color(.5, .5, .5));
+
+	seed_random(3);
+	for (int i = 0; i < 20000; i++)
+		list.add(arena.make<sphere>(vec3::random(-50, 50), random_double(.2, 1), mat));
+	for (int i = 0; i < 2000; i++)
+		list.add(arena.make<quad>(vec3::random(-50, 50), vec3::random(-2, 2), vec3::random(-2, 2), mat));
+
+	bvh accel(list);
+
+	const int query_count = 1000000;
+	std::vector<ray> queries;
+	queries.reserve(query_count);
+	for (int i = 0; i < query_count; i++)
+	{
+		vec3 from = vec3::random(-50, 50), to = vec3::random(-50, 50);
+		queries.push_back(ray(from, to - from));
+	}
+
+	// Shadow-ray convention: the segment between the two points, ends excluded.
+	interval segment(ray_epsilon, 1 - ray_epsilon);
+
+	auto begin = std::chrono::steady_clock::now();
+	int blocked_any = 0;
+	for (const auto& r : queries)
+		blocked_any += accel.occluded(r, segment);
+	double t_any = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+	begin = std::chrono::steady_clock::now();
+	int blocked_closest = 0;
+	for (const auto& r : queries)
+	{
+		hit_record rec;
+		blocked_closest += accel.hit(r, segment, rec);
+	}
+	double t_closest = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+	std::cout << "Primitives: " << accel.primitive_count() << ", queries: " << query_count
+		<< ", occluded: " << blocked_any << (blocked_any == blocked_closest ? " (agree)" : " (MISMATCH)") << "\n";
+	std::cout << "occluded (any hit):   " << t_any << " ms, " << query_count / t_any / 1000 << " M queries/s\n";
+	std::cout << "hit (closest hit):    " << t_closest << " ms, " << query_count / t_closest / 1000 << " M queries/s\n";
+	std::cout << "Speedup: " << t_closest / t_any << "x\n";
+}
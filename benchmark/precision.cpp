@@ -0,0 +1,101 @@
+// Float vs. double vec3 throughput.
+//
+// Runs the sphere intersection and shading arithmetic of the renderer over
+// vec3_t<float> and vec3_t<double> and reports millions of ray-sphere tests per
+// second for each. To compare whole renders, build inOneWeekend.cpp with and
+// without -DRT_FLOAT.
+//
+// g++ -O3 -march=native -std=c++17 precision.cpp -o precision
+
+#include "../library/utility.h"
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+template <typename T>
+struct test_sphere
+{
+	vec3_t<T> center;
+	T radius;
+};
+
+// Closest hit over all spheres, same robust formulation as sphere::hit, plus
+// the normal and a reflection so the result depends on every operator.
+template <typename T>
+T trace(const vec3_t<T>& origin, const vec3_t<T>& dir, const std::vector<test_sphere<T>>& spheres)
+{
+	T closest = std::numeric_limits<T>::max();
+	int hit = -1;
+
+	for (size_t s = 0; s < spheres.size(); s++)
+	{
+		vec3_t<T> oc = origin - spheres[s].center;
+		T a = dot(dir, dir);
+		T half_b = dot(oc, dir);
+		T c = dot(oc, oc) - spheres[s].radius * spheres[s].radius;
+		vec3_t<T> l = oc - (half_b / a) * dir;
+		T disc = a * (spheres[s].radius * spheres[s].radius - dot(l, l));
+		if (disc < 0)
+			continue;
+
+		T q = half_b > 0 ? -half_b - sqrt(disc) : -half_b + sqrt(disc);
+		T t = std::min(q / a, c / q);
+		if (t > T(1e-3) && t < closest)
+		{
+			closest = t;
+			hit = static_cast<int>(s);
+		}
+	}
+
+	if (hit < 0)
+		return 0;
+
+	vec3_t<T> p = origin + closest * dir;
+	vec3_t<T> n = normalize(p - spheres[hit].center);
+	vec3_t<T> r = dir - 2 * dot(dir, n) * n;
+	return dot(cross(r, n), vec3_t<T>(1, 1, 1)) + closest;
+}
+
+// checksum receives the sum of the traced values, printed so the timed loop
+// can't be optimised away.
+template <typename T>
+double rays_per_second(int rays, int sphere_count, double& checksum)
+{
+	seed_random(7);
+
+	std::vector<test_sphere<T>> spheres;
+	for (int i = 0; i < sphere_count; i++)
+		spheres.push_back({ vec3_t<T>(random_double(-10, 10), random_double(-10, 10), random_double(-30, -10)),
+			static_cast<T>(random_double(.2, 1.5)) });
+
+	std::vector<vec3_t<T>> dirs;
+	for (int i = 0; i < rays; i++)
+		dirs.push_back(vec3_t<T>(random_double(-.5, .5), random_double(-.5, .5), -1));
+
+	vec3_t<T> origin(0, 0, 0);
+
+	auto begin = std::chrono::steady_clock::now();
+	T sum = 0;
+	for (const auto& d : dirs)
+		sum += trace(origin, d, spheres);
+	auto end = std::chrono::steady_clock::now();
+	checksum = sum;
+
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	return static_cast<double>(rays) * sphere_count / seconds;
+}
+
+int main()
+{
+	const int rays = 200000, spheres = 64;
+
+	double f_checksum, d_checksum;
+	double f = rays_per_second<float>(rays, spheres, f_checksum);
+	double d = rays_per_second<double>(rays, spheres, d_checksum);
+
+	std::cout << "vec3_t<float>:  " << f / 1e6 << " M ray-sphere tests/s\n";
+	std::cout << "vec3_t<double>: " << d / 1e6 << " M ray-sphere tests/s\n";
+	std::cout << "float / double: " << f / d << "x\n";
+	std::cout << "checksums: " << f_checksum << ", " << d_checksum << '\n';
+}
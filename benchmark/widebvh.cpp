@@ -0,0 +1,87 @@
+// Binary bvh vs. compressed 8-wide wide_bvh.
+//
+// Builds both over the same cloud of random spheres and traces the same batch
+// of closest-hit rays through each. Reports memory per primitive (nodes, and
+// nodes plus primitive references) and rays per second, and checks that the
+// two agree on every hit distance.
+//
+// g++ -O3 -std=c++17 widebvh.cpp -o widebvh
+// g++ -O3 -std=c++17 -mavx2 widebvh.cpp -o widebvh   (8-lane child test)
+
+#include "../library/utility.h"
+
+#include "../library/arena.h"
+#include "../library/bvh.h"
+#include "../library/hittableList.h"
+#include "../library/material.h"
+#include "../library/sphere.h"
+#include "../library/wideBvh.h"
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+template <typename Tree>
+double trace(const Tree& tree, const std::vector<ray>& rays, std::vector<double>& t)
+{
+	auto begin = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < rays.size(); i++)
+	{
+		hit_record rec;
+		t[i] = tree.hit(rays[i], interval(ray_epsilon, infinity), rec) ? rec.t : -1;
+	}
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+}
+
+int main()
+{
+	scene_arena arena;
+	hittable_list list;
+	auto mat = arena.make<lambertian>(color(.5, .5, .5));
+
+	const int sphere_count = 500000;
+	seed_random(5);
+	for (int i = 0; i < sphere_count; i++)
+		list.add(arena.make<sphere>(vec3::random(-100, 100), random_double(.05, .5), mat));
+
+	auto begin = std::chrono::steady_clock::now();
+	bvh binary(list);
+	double t_build = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+	begin = std::chrono::steady_clock::now();
+	wide_bvh wide(binary);
+	double t_collapse = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+	// Rays from a sphere around the cloud towards random points inside it.
+	const int ray_count = 200000;
+	std::vector<ray> rays;
+	rays.reserve(ray_count);
+	for (int i = 0; i < ray_count; i++)
+	{
+		vec3 from = 250 * random_unit_vector();
+		rays.push_back(ray(from, vec3::random(-100, 100) - from));
+	}
+
+	std::vector<double> t_binary(ray_count), t_wide(ray_count);
+	double ms_binary = trace(binary, rays, t_binary);
+	double ms_wide = trace(wide, rays, t_wide);
+
+	int mismatches = 0;
+	for (int i = 0; i < ray_count; i++)
+		if (std::fabs(t_binary[i] - t_wide[i]) > 1e-6 * std::fabs(t_binary[i]))
+			mismatches++;
+
+	double n = sphere_count;
+	size_t binary_nodes = binary.node_count() * sizeof(bvh_node);
+	size_t wide_nodes = wide.node_count() * sizeof(wide_node);
+
+	std::cout << "Primitives: " << sphere_count << ", rays: " << ray_count << ", mismatches: " << mismatches << "\n";
+	std::cout << "bvh:      " << binary.node_count() << " nodes of " << sizeof(bvh_node) << " B, "
+		<< binary_nodes / n << " B/prim in nodes, " << binary.memory_bytes() / n << " B/prim total, built in " << t_build << " ms\n";
+	std::cout << "wide_bvh: " << wide.node_count() << " nodes of " << sizeof(wide_node) << " B, "
+		<< wide_nodes / n << " B/prim in nodes, " << wide.memory_bytes() / n << " B/prim total, collapsed in " << t_collapse << " ms\n";
+	std::cout << "bvh:      " << ms_binary << " ms, " << ray_count / ms_binary / 1000 << " M rays/s\n";
+	std::cout << "wide_bvh: " << ms_wide << " ms, " << ray_count / ms_wide / 1000 << " M rays/s\n";
+	std::cout << "Speedup: " << ms_binary / ms_wide << "x\n";
+}
@@ -3,24 +3,42 @@
 
 #include "library/utility.h"
 
+#include "library/animation.h"
+#include "library/arena.h"
+#include "library/bidirectional.h"
+#include "library/bvh.h"
+#include "library/bvhCache.h"
 #include "library/camera.h"
 #include "library/color.h"
+#include "library/environment.h"
 #include "library/hittableList.h"
 #include "library/material.h"
+#include "library/metropolis.h"
+#include "library/perfCounters.h"
 #include "library/sphere.h"
 #include "library/quad.h"
+#include "library/restir.h"
+#include "library/texture.h"
+#include "library/trace.h"
+#include "library/wavefront.h"
 
-void scene1(camera& cam, hittable_list& world)
+// Shared by every image texture in the scene; its budget bounds texel memory.
+shared_ptr<texture_cache> textures;
+
+// Set by animated scenes; main renders it as an image sequence when non-empty.
+animation anim;
+
+void scene1(camera& cam, hittable_list& world, scene_arena& arena)
 {
-	auto material_ground = make_shared<lambertian>(color(0.1, 0.15, 0.2));
-	auto material_center = make_shared<lambertian>(color(0.1, 0.2, 0.5));
-	auto material_left = make_shared<dielectric>(3);
-	auto material_right = make_shared<metal>(color(0.8, 0.6, 0.2), 0.0);
+	auto material_ground = arena.make<lambertian>(color(0.1, 0.15, 0.2));
+	auto material_center = arena.make<lambertian>(color(0.1, 0.2, 0.5));
+	auto material_left = arena.make<dielectric>(3);
+	auto material_right = arena.make<metal>(color(0.8, 0.6, 0.2), 0.0);
 
-	world.add(make_shared<sphere>(vec3(0.0, -100.5, -1.0), 100.0, material_ground));
-	world.add(make_shared<sphere>(vec3(0.0, 0.0, -1.0), 0.5, material_center));
-	world.add(make_shared<sphere>(vec3(-1.0, 0.0, -1.0), 0.5, material_left));
-	world.add(make_shared<sphere>(vec3(1.0, 0.0, -1.0), 0.5, material_right));
+	world.add(arena.make<sphere>(vec3(0.0, -100.5, -1.0), 100.0, material_ground));
+	world.add(arena.make<sphere>(vec3(0.0, 0.0, -1.0), 0.5, material_center));
+	world.add(arena.make<sphere>(vec3(-1.0, 0.0, -1.0), 0.5, material_left));
+	world.add(arena.make<sphere>(vec3(1.0, 0.0, -1.0), 0.5, material_right));
 
 	cam.aspect_ratio = 16.0 / 9.0;
 	cam.image_width = 400;
@@ -36,21 +54,21 @@ void scene1(camera& cam, hittable_list& world)
 	cam.defocus_angle = 0;
 }
 
-void scene_quads(camera& cam, hittable_list& world)
+void scene_quads(camera& cam, hittable_list& world, scene_arena& arena)
 {
 	// Materials
-	auto left_red = make_shared<lambertian>(color(1.0, 0.2, 0.2));
-	auto back_green = make_shared<lambertian>(color(0.2, 1.0, 0.2));
-	auto right_blue = make_shared<lambertian>(color(0.2, 0.2, 1.0));
-	auto upper_orange = make_shared<lambertian>(color(1.0, 0.5, 0.0));
-	auto lower_teal = make_shared<lambertian>(color(0.2, 0.8, 0.8));
+	auto left_red = arena.make<lambertian>(color(1.0, 0.2, 0.2));
+	auto back_green = arena.make<lambertian>(color(0.2, 1.0, 0.2));
+	auto right_blue = arena.make<lambertian>(color(0.2, 0.2, 1.0));
+	auto upper_orange = arena.make<lambertian>(color(1.0, 0.5, 0.0));
+	auto lower_teal = arena.make<lambertian>(color(0.2, 0.8, 0.8));
 
 	// Quads
-	world.add(make_shared<quad>(vec3(-3, -2, 5), vec3(0, 0, -4), vec3(0, 4, 0), left_red));
-	world.add(make_shared<quad>(vec3(-2, -2, 0), vec3(4, 0, 0), vec3(0, 4, 0), back_green));
-	world.add(make_shared<quad>(vec3(3, -2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
-	world.add(make_shared<quad>(vec3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
-	world.add(make_shared<quad>(vec3(-2, -3, 5), vec3(4, 0, 0), vec3(0, 0, -4), lower_teal));
+	world.add(arena.make<quad>(vec3(-3, -2, 5), vec3(0, 0, -4), vec3(0, 4, 0), left_red));
+	world.add(arena.make<quad>(vec3(-2, -2, 0), vec3(4, 0, 0), vec3(0, 4, 0), back_green));
+	world.add(arena.make<quad>(vec3(3, -2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
+	world.add(arena.make<quad>(vec3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
+	world.add(arena.make<quad>(vec3(-2, -3, 5), vec3(4, 0, 0), vec3(0, 0, -4), lower_teal));
 
 	cam.aspect_ratio = 1.0;
 	cam.image_width = 400;
@@ -67,19 +85,19 @@ void scene_quads(camera& cam, hittable_list& world)
 	cam.defocus_angle = 0;
 }
 
-void cornell_box(camera& cam, hittable_list& world)
+void cornell_box(camera& cam, hittable_list& world, scene_arena& arena)
 {
-	auto red = make_shared<lambertian>(color(.65, .05, .05));
-	auto white = make_shared<lambertian>(color(.73, .73, .73));
-	auto green = make_shared<lambertian>(color(.12, .45, .15));
-	auto light = make_shared<diffuse_light>(color(15, 15, 15));
-
-	world.add(make_shared<quad>(vec3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
-	world.add(make_shared<quad>(vec3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
-	world.add(make_shared<quad>(vec3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
-	world.add(make_shared<quad>(vec3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
-	world.add(make_shared<quad>(vec3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
-	world.add(make_shared<quad>(vec3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
+	auto red = arena.make<lambertian>(color(.65, .05, .05));
+	auto white = arena.make<lambertian>(color(.73, .73, .73));
+	auto green = arena.make<lambertian>(color(.12, .45, .15));
+	auto light = arena.make<diffuse_light>(color(15, 15, 15));
+
+	world.add(arena.make<quad>(vec3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
+	world.add(arena.make<quad>(vec3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
+	world.add(arena.make<quad>(vec3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
+	world.add(arena.make<quad>(vec3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+	world.add(arena.make<quad>(vec3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
+	world.add(arena.make<quad>(vec3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
 
 	cam.aspect_ratio = 1.0;
 	cam.image_width = 600;
@@ -96,24 +114,329 @@ void cornell_box(camera& cam, hittable_list& world)
 	cam.defocus_angle = 0;
 }
 
+// Stand-in for an HDR capture: blue gradient sky with a small, very bright sun.
+image_data procedural_sky(int width, int height)
+{
+	image_data img;
+	img.resize(width, height);
+
+	vec3 sun_dir = normalize(vec3(1, 1.2, .4));
+	for (int y = 0; y < height; y++)
+	{
+		double theta = pi * (y + .5) / height;
+		for (int x = 0; x < width; x++)
+		{
+			double phi = 2 * pi * (x + .5) / width;
+			vec3 d(sin(theta) * cos(phi), cos(theta), -sin(theta) * sin(phi));
+
+			auto t = .5 * (d.y() + 1.0);
+			color c = vec3::lerp(color(.3, .3, .35), color(.4, .6, 1.0), t);
+			if (dot(d, sun_dir) > .998)
+				c = color(500, 450, 380);
+			img.set(x, y, c);
+		}
+	}
+
+	return img;
+}
+
+void scene_environment(camera& cam, hittable_list& world, scene_arena& arena)
+{
+	auto material_ground = arena.make<lambertian>(color(.5, .5, .5));
+	auto material_center = arena.make<lambertian>(color(.7, .3, .3));
+	auto material_right = arena.make<metal>(color(.8, .8, .8), .1);
+
+	world.add(arena.make<sphere>(vec3(0.0, -100.5, -1.0), 100.0, material_ground));
+	world.add(arena.make<sphere>(vec3(0.0, 0.0, -1.0), 0.5, material_center));
+	world.add(arena.make<sphere>(vec3(1.0, 0.0, -1.0), 0.5, material_right));
+
+	image_data env;
+	if (!load_pfm("environment.pfm", env))
+	{
+		std::clog << "environment.pfm not found, using procedural sky.\n";
+		env = procedural_sky(512, 256);
+	}
+	cam.environment = make_shared<environment_light>(std::move(env));
+
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.image_width = 400;
+	cam.samples_per_pixel = 64;
+	cam.max_depth = 20;
+	cam.gamma = 2.2;
+
+	cam.fov = 40;
+	cam.look_from = vec3(-2, 1, 2);
+	cam.look_at = vec3(0, 0, -1);
+
+	cam.defocus_angle = 0;
+}
+
+void scene_textures(camera& cam, hittable_list& world, scene_arena& arena)
+{
+	textures = make_shared<texture_cache>(size_t(8) << 20);
+
+	shared_ptr<texture> earth_texture = arena.make<image_texture>("earthmap.ppm", textures);
+
+	// Stand-in for a large texture set: a 4K procedural grid stored in the same cache.
+	image_data grid;
+	grid.resize(4096, 4096);
+	for (int y = 0; y < grid.height; y++)
+		for (int x = 0; x < grid.width; x++)
+			grid.set(x, y, (x % 256 < 8 || y % 256 < 8) ? color(.9, .9, .9) : color(.2, .3, .6));
+	auto grid_texture = arena.make<image_texture>(std::move(grid), textures);
+
+	auto checker = arena.make<checker_texture>(.32, color(.2, .3, .1), color(.9, .9, .9));
+
+	world.add(arena.make<sphere>(vec3(0, -1000, 0), 1000, arena.make<lambertian>(checker)));
+	world.add(arena.make<sphere>(vec3(0, 2, 0), 2, arena.make<lambertian>(earth_texture)));
+	world.add(arena.make<quad>(vec3(-6, 0, -3), vec3(12, 0, 0), vec3(0, 6, 0), arena.make<lambertian>(grid_texture)));
+
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.image_width = 400;
+	cam.samples_per_pixel = 64;
+	cam.max_depth = 20;
+	cam.background = color(0.70, 0.80, 1.00);
+	cam.gamma = 2.2;
+
+	cam.fov = 30;
+	cam.look_from = vec3(0, 3, 13);
+	cam.look_at = vec3(0, 2, 0);
+	cam.vup = vec3(0, 1, 0);
+
+	cam.defocus_angle = 0;
+}
+
+// Large scene for the acceleration structure: a field of small random spheres.
+void scene_many_spheres(camera& cam, hittable_list& world, scene_arena& arena)
+{
+	const int n = 300;
+
+	shared_ptr<material> materials[] = {
+		arena.make<lambertian>(color(.7, .3, .3)),
+		arena.make<lambertian>(color(.3, .5, .7)),
+		arena.make<metal>(color(.8, .8, .8), .1),
+		arena.make<dielectric>(1.5),
+	};
+
+	world.add(arena.make<sphere>(vec3(0, -1000, 0), 1000, arena.make<lambertian>(color(.5, .5, .5))));
+	for (int a = 0; a < n; a++)
+	{
+		for (int b = 0; b < n; b++)
+		{
+			vec3 center((a - n / 2) * .5 + .3 * random_double(), .1, (b - n / 2) * .5 + .3 * random_double());
+			world.add(arena.make<sphere>(center, .1, materials[static_cast<int>(4 * random_double())]));
+		}
+	}
+
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.image_width = 400;
+	cam.samples_per_pixel = 16;
+	cam.max_depth = 10;
+	cam.background = color(0.70, 0.80, 1.00);
+	cam.gamma = 2.2;
+
+	cam.fov = 30;
+	cam.look_from = vec3(0, 6, 20);
+	cam.look_at = vec3(0, 0, 0);
+	cam.vup = vec3(0, 1, 0);
+
+	cam.defocus_angle = 0;
+}
+
+// scene1 on a turntable: the camera circles the spheres while the centre one
+// bounces, two seconds at 24 fps.
+void scene_turntable(camera& cam, hittable_list& world, scene_arena& arena)
+{
+	scene1(cam, world, arena);
+	cam.samples_per_pixel = 16;
+
+	auto ball = arena.make<sphere>(vec3(0, 0, -1), .25, arena.make<metal>(color(.9, .9, .9), .05));
+	world.add(ball);
+
+	keyframe_track<vec3> bounce;
+	for (int k = 0; k <= 4; k++)
+		bounce.add(k * .5, vec3(0, k % 2 ? 1.2 : .75, -1));
+	anim.animate(ball, bounce);
+
+	for (int k = 0; k <= 8; k++)
+	{
+		double angle = k * pi / 4;
+		anim.look_from.add(k * .25, vec3(-1 + 3 * sin(angle), 2, -1 + 3 * cos(angle)));
+	}
+	anim.look_at.add(0, vec3(0, 0, -1));
+
+	anim.frame_count = 48;
+}
+
+// Night scene lit only by hundreds of small coloured emitters, quads and
+// spheres, for direct lighting that has to choose among many lights.
+void scene_many_lights(camera& cam, hittable_list& world, scene_arena& arena)
+{
+	auto ground = arena.make<lambertian>(color(.5, .5, .5));
+	world.add(arena.make<quad>(vec3(-20, 0, -20), vec3(40, 0, 0), vec3(0, 0, 40), ground));
+	world.add(arena.make<sphere>(vec3(-2.2, 1, 0), 1, arena.make<lambertian>(color(.7, .3, .3))));
+	world.add(arena.make<sphere>(vec3(0, 1, 0), 1, arena.make<dielectric>(1.5)));
+	world.add(arena.make<sphere>(vec3(2.2, 1, 0), 1, arena.make<metal>(color(.8, .8, .8), .2)));
+	world.add(arena.make<quad>(vec3(-6, 0, -4), vec3(12, 0, 0), vec3(0, 4, 0), arena.make<lambertian>(color(.4, .5, .6))));
+
+	for (int k = 0; k < 400; k++)
+	{
+		vec3 pos(random_double(-10, 10), random_double(2.5, 6), random_double(-3.5, 8));
+		auto light = arena.make<diffuse_light>(3 * color(random_double(.2, 1), random_double(.2, 1), random_double(.2, 1)));
+		if (k % 2)
+			world.add(arena.make<sphere>(pos, .08, light));
+		else
+			world.add(arena.make<quad>(pos, vec3(.25, 0, 0), vec3(0, 0, .25), light));
+	}
+
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.image_width = 400;
+	cam.samples_per_pixel = 16;
+	cam.max_depth = 10;
+	cam.background = color(0, 0, 0);
+	cam.gamma = 2.2;
+
+	cam.fov = 40;
+	cam.look_from = vec3(0, 3, 12);
+	cam.look_at = vec3(0, 1, 0);
+	cam.vup = vec3(0, 1, 0);
+
+	cam.defocus_angle = 0;
+}
+
 int main()
 {
+	scene_arena arena; // Declared first so it outlives everything built from it.
 	camera cam;
 	hittable_list world;
 
-	switch (3)
+	// Chrome trace of scene build, BVH build, tiles and output, for
+	// about:tracing or ui.perfetto.dev.
+	const char* trace_path = nullptr; // e.g. "trace.json"
+	if (trace_path)
+		trace_recorder::instance().start();
+
+	// Linux hardware counters (cycles, instructions, cache and branch misses)
+	// per phase and thread, with IPC and misses per ray.
+	const bool count_events = false;
+	if (count_events)
+		perf_profile::instance().start();
+
+	auto build_begin = std::chrono::steady_clock::now();
+
+	{
+		TRACE_SCOPE("scene build");
+		perf_scope counted(perf_profile::scene_build);
+		switch (3)
+		{
+		case 1: scene1(cam, world, arena); break;
+		case 2: scene_quads(cam, world, arena); break;
+		case 3: cornell_box(cam, world, arena); break;
+		case 4: scene_environment(cam, world, arena); break;
+		case 5: scene_textures(cam, world, arena); break;
+		case 6: scene_many_spheres(cam, world, arena); break;
+		case 7: scene_turntable(cam, world, arena); break;
+		case 8: scene_many_lights(cam, world, arena); break;
+		}
+	}
+
+	auto build_end = std::chrono::steady_clock::now();
+	auto build_time = std::chrono::duration_cast<std::chrono::microseconds>(build_end - build_begin).count();
+	std::clog << "Scene build = " << build_time << " us" << std::endl;
+	arena.report(std::clog);
+
+	if (!anim.empty())
 	{
-	case 1: scene1(cam, world); break;
-	case 2: scene_quads(cam, world); break;
-	case 3: cornell_box(cam, world); break;
+		auto begin = std::chrono::steady_clock::now();
+		anim.render(cam, world, "frame_%04d.ppm");
+		auto time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+		std::clog << "Duration = " << time << " ms" << std::endl;
+		if (trace_path)
+			trace_recorder::instance().write(trace_path);
+		perf_profile::instance().report(std::clog);
+		return 0;
 	}
 
+	// Saves the built BVH and reuses it while the scene's object bounds match.
+	const char* bvh_cache_path = nullptr; // e.g. "scene.bvh"
+
+	auto bvh_begin = std::chrono::steady_clock::now();
+	bvh accel = bvh_cache_path ? bvh_cache::load_or_build(world, bvh_cache_path) : bvh(world);
+	auto bvh_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bvh_begin).count();
+	std::clog << "BVH build = " << bvh_time << " us, " << accel.node_count() << " nodes over "
+		<< accel.primitive_count() << " primitives" << std::endl;
 
 	auto begin = std::chrono::steady_clock::now(); // Time point.
 
-	cam.render(world);
+	// Seconds for the whole render; passes are added until the budget is spent.
+	const double time_budget = 0;
+	cam.time_budget = time_budget;
+
+	// Breadth-first integrator with material-sorted shading, same estimator.
+	const bool use_wavefront = false;
+	// Learns where light comes from over doubling passes and samples towards it.
+	const bool use_guiding = false;
+	// Caches diffuse interreflection in a prepass and ends paths on its records.
+	const bool use_radiance_cache = false;
+	// Also traces paths from the emitters and joins them to the camera's.
+	const bool use_bidirectional = false;
+	// Markov chains over the random numbers of paths, for caustics and other
+	// paths that are hard to find but bright once found.
+	const bool use_metropolis = false;
+	// Direct light only, from the emitters, by reservoir resampling shared
+	// between neighbouring pixels and passes; for scenes with many lights.
+	const bool use_restir = false;
+	// One sample per pixel per pass, each published to a mapped preview file.
+	const char* preview_path = nullptr; // e.g. "preview.bin"
+	// Streams tiles straight into a binary PPM instead of std::cout, for images
+	// too large to keep a framebuffer for.
+	const char* output_path = nullptr; // e.g. "image.ppm"
+	// Per-pixel cycles, intersection tests and path length written as heatmaps
+	// <prefix>_cycles.ppm, <prefix>_tests.ppm and <prefix>_depth.ppm (the last
+	// two with -DRT_RAY_STATS).
+	const char* cost_map_prefix = nullptr; // e.g. "cost"
+	if (cost_map_prefix)
+		cam.cost_map_prefix = cost_map_prefix;
+
+	if (use_wavefront)
+		wavefront_integrator(cam).render(accel);
+	else if (use_guiding)
+	{
+		path_guide guide(accel.bounding_box());
+		cam.render_guided(accel, guide);
+	}
+	else if (use_radiance_cache)
+	{
+		radiance_cache cache(accel.bounding_box());
+		cam.render_cached(accel, cache);
+	}
+	else if (use_bidirectional)
+	{
+		light_list lights(world);
+		bidirectional_integrator(cam, lights).render(accel);
+	}
+	else if (use_metropolis)
+		metropolis_integrator(cam).render(accel);
+	else if (use_restir)
+	{
+		light_list lights(world);
+		restir_integrator(cam, lights).render(accel);
+	}
+	else if (preview_path)
+		cam.render_progressive(accel, preview_path);
+	else if (output_path)
+		cam.render_to_file(accel, output_path);
+	else
+		cam.render(accel);
 
 	auto end = std::chrono::steady_clock::now();
 	auto time = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
 	std::clog << "Duration = " << time << " ms" << std::endl;
+
+	if (textures)
+		textures->report(std::clog);
+
+	if (trace_path)
+		trace_recorder::instance().write(trace_path);
+	perf_profile::instance().report(std::clog);
 }
\ No newline at end of file
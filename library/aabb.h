@@ -0,0 +1,94 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "utility.h"
+
+#include <utility>
+
+// Axis-aligned bounding box, one interval per axis.
+class aabb
+{
+public:
+	interval x, y, z;
+
+	aabb() : x(empty), y(empty), z(empty) {}
+
+	aabb(const interval& ix, const interval& iy, const interval& iz) : x(ix), y(iy), z(iz) {}
+
+	aabb(const vec3& a, const vec3& b)
+	{
+		// Treat the two points a and b as extrema for the bounding box, so we don't require a
+		// particular minimum/maximum coordinate order.
+		x = interval(fmin(a[0], b[0]), fmax(a[0], b[0]));
+		y = interval(fmin(a[1], b[1]), fmax(a[1], b[1]));
+		z = interval(fmin(a[2], b[2]), fmax(a[2], b[2]));
+	}
+
+	aabb(const aabb& box0, const aabb& box1)
+	{
+		x = interval(box0.x, box1.x);
+		y = interval(box0.y, box1.y);
+		z = interval(box0.z, box1.z);
+	}
+
+	const interval& axis(int n) const
+	{
+		if (n == 1) return y;
+		if (n == 2) return z;
+		return x;
+	}
+
+	aabb pad() const
+	{
+		// Return an AABB that has no side narrower than some delta, padding if necessary.
+		double delta = 0.0001;
+		interval new_x = (x.size() >= delta) ? x : x.expand(delta);
+		interval new_y = (y.size() >= delta) ? y : y.expand(delta);
+		interval new_z = (z.size() >= delta) ? z : z.expand(delta);
+
+		return aabb(new_x, new_y, new_z);
+	}
+
+	vec3 min() const { return vec3(x.min, y.min, z.min); }
+	vec3 max() const { return vec3(x.max, y.max, z.max); }
+	vec3 centroid() const { return .5 * (min() + max()); }
+
+	int longest_axis() const
+	{
+		if (x.size() > y.size())
+			return x.size() > z.size() ? 0 : 2;
+		return y.size() > z.size() ? 1 : 2;
+	}
+
+	double surface_area() const
+	{
+		if (x.size() < 0 || y.size() < 0 || z.size() < 0)
+			return 0;
+		return 2 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+	}
+
+	bool hit(const ray& r, interval ray_t) const
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			auto invD = 1 / r.direction()[a];
+			auto orig = r.origin()[a];
+
+			auto t0 = (axis(a).min - orig) * invD;
+			auto t1 = (axis(a).max - orig) * invD;
+
+			if (invD < 0)
+				std::swap(t0, t1);
+
+			if (t0 > ray_t.min) ray_t.min = t0;
+			if (t1 < ray_t.max) ray_t.max = t1;
+
+			if (ray_t.max <= ray_t.min)
+				return false;
+		}
+
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "utility.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "color.h"
+#include "hittableList.h"
+#include "quad.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Values at given times, linearly interpolated in between and held before the
+// first and after the last key.
+template <typename T>
+class keyframe_track
+{
+public:
+	void add(double time, const T& value)
+	{
+		auto it = std::upper_bound(keys.begin(), keys.end(), time,
+			[](double t, const std::pair<double, T>& k) { return t < k.first; });
+		keys.insert(it, { time, value });
+	}
+
+	bool empty() const { return keys.empty(); }
+
+	T at(double time) const
+	{
+		if (time <= keys.front().first)
+			return keys.front().second;
+		if (time >= keys.back().first)
+			return keys.back().second;
+
+		auto next = std::upper_bound(keys.begin(), keys.end(), time,
+			[](double t, const std::pair<double, T>& k) { return t < k.first; });
+		auto prev = next - 1;
+		double s = (time - prev->first) / (next->first - prev->first);
+		return prev->second + (next->second - prev->second) * s;
+	}
+
+private:
+	std::vector<std::pair<double, T>> keys;
+};
+
+// Keyframed camera and object motion rendered as a numbered image sequence in
+// one process, so the scene, its materials and textures are built once. Objects
+// only move, never appear or disappear, so the BVH is refitted between frames
+// and only rebuilt once refitting has made it rebuild_threshold times costlier
+// than when built. Each frame is written from a separate thread while the next
+// one renders.
+class animation
+{
+public:
+	keyframe_track<vec3> look_from, look_at;
+	keyframe_track<double> fov;
+
+	int frame_count = 0;
+	double frames_per_second = 24;
+	double rebuild_threshold = 1.5;
+
+	void animate(shared_ptr<sphere> object, keyframe_track<vec3> centers)
+	{
+		objects.push_back([object, centers](double time) { object->set_center(centers.at(time)); });
+	}
+
+	void animate(shared_ptr<quad> object, keyframe_track<vec3> origins)
+	{
+		objects.push_back([object, origins](double time) { object->set_origin(origins.at(time)); });
+	}
+
+	bool empty() const { return frame_count == 0; }
+
+	// Poses the camera and the animated objects at the given time.
+	void apply(camera& cam, double time) const
+	{
+		if (!look_from.empty()) cam.look_from = look_from.at(time);
+		if (!look_at.empty()) cam.look_at = look_at.at(time);
+		if (!fov.empty()) cam.fov = fov.at(time);
+
+		for (const auto& apply_object : objects)
+			apply_object(time);
+	}
+
+	// Renders every frame of world to the printf pattern path (e.g.
+	// "frame_%04d.ppm") as binary PPM. Returns false if the camera was cancelled.
+	bool render(camera& cam, const hittable_list& world, const char* pattern) const
+	{
+		std::vector<color> framebuffers[2];
+		std::thread writer;
+		bool finished = true;
+
+		double refit_us = 0, rebuild_us = 0;
+		int rebuilds = 0;
+
+		apply(cam, 0);
+		auto begin = std::chrono::steady_clock::now();
+		bvh accel(world);
+		rebuild_us += elapsed_us(begin);
+		double built_cost = accel.sah_cost();
+
+		for (int frame = 0; frame < frame_count && finished; frame++)
+		{
+			if (frame > 0)
+			{
+				apply(cam, frame / frames_per_second);
+
+				begin = std::chrono::steady_clock::now();
+				accel.refit();
+				refit_us += elapsed_us(begin);
+
+				if (accel.sah_cost() > rebuild_threshold * built_cost)
+				{
+					begin = std::chrono::steady_clock::now();
+					accel = bvh(world);
+					rebuild_us += elapsed_us(begin);
+					built_cost = accel.sah_cost();
+					rebuilds++;
+				}
+			}
+
+			std::clog << "Frame " << frame + 1 << " / " << frame_count << ": ";
+			auto& framebuffer = framebuffers[frame & 1];
+			finished = cam.render_frame(accel, framebuffer);
+
+			// The writer of the previous frame uses the other buffer; wait for it
+			// before this one is handed over, then go on with the next frame.
+			if (writer.joinable())
+				writer.join();
+
+			char path[1024];
+			std::snprintf(path, sizeof(path), pattern, frame);
+			writer = std::thread(write_frame, std::string(path), std::cref(framebuffer),
+				cam.image_width, cam.get_image_height(), 1.0 / cam.samples_per_pixel, cam.gamma);
+		}
+
+		if (writer.joinable())
+			writer.join();
+
+		std::clog << "BVH: " << rebuilds + 1 << " builds in " << rebuild_us / 1000 << " ms, "
+			<< std::max(frame_count - 1, 0) << " refits in " << refit_us / 1000 << " ms\n";
+		return finished;
+	}
+
+private:
+	std::vector<std::function<void(double)>> objects;
+
+	static double elapsed_us(std::chrono::steady_clock::time_point begin)
+	{
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+	}
+
+	static void write_frame(std::string path, const std::vector<color>& framebuffer, int width, int height, double scale, double gamma)
+	{
+		TRACE_SCOPE("write frame");
+		std::vector<uint8_t> bytes(framebuffer.size() * 3);
+		for (size_t i = 0; i < framebuffer.size(); i++)
+			color_to_bytes(linear_to_gamma(framebuffer[i] * scale, gamma), &bytes[3 * i]);
+
+		std::FILE* file = std::fopen(path.c_str(), "wb");
+		if (!file)
+		{
+			std::cerr << "animation: could not write " << path << '\n';
+			return;
+		}
+
+		std::fprintf(file, "P6\n%d %d\n255\n", width, height);
+		std::fwrite(bytes.data(), 1, bytes.size(), file);
+		std::fclose(file);
+	}
+};
+
+#endif
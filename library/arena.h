@@ -0,0 +1,182 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "utility.h"
+
+#include "texture.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <typeinfo>
+#include <typeindex>
+#include <type_traits>
+#include <vector>
+
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+
+// Bump allocator handing out memory from large blocks. Objects are never freed
+// individually; destructors run in reverse order and the blocks go back to the
+// system in one sweep when the arena dies. Pointers stay valid for the arena's
+// lifetime since blocks never move.
+class arena
+{
+public:
+	arena(size_t _block_size = size_t(1) << 20) : block_size(_block_size) {}
+
+	~arena()
+	{
+		for (auto it = destructors.rbegin(); it != destructors.rend(); ++it)
+			it->destroy(it->object);
+	}
+
+	arena(const arena&) = delete;
+	arena& operator=(const arena&) = delete;
+
+	template <typename T, typename... Args>
+	T* create(Args&&... args)
+	{
+		void* mem = allocate(sizeof(T), alignof(T));
+		T* object = new (mem) T(std::forward<Args>(args)...);
+
+		if (!std::is_trivially_destructible<T>::value)
+			destructors.push_back({ object, [](void* p) { static_cast<T*>(p)->~T(); } });
+
+		objects++;
+		return object;
+	}
+
+	void* allocate(size_t size, size_t align)
+	{
+		// Align the address, not the offset: new only guarantees 16-byte alignment.
+		auto aligned_offset = [&](size_t from) {
+			auto base = reinterpret_cast<uintptr_t>(blocks.back().get());
+			return static_cast<size_t>(((base + from + align - 1) & ~(align - 1)) - base);
+		};
+
+		size_t offset = blocks.empty() ? 0 : aligned_offset(used);
+		if (blocks.empty() || offset + size > current_size)
+		{
+			current_size = size + align > block_size ? size + align : block_size;
+			blocks.emplace_back(new std::byte[current_size]);
+			reserved += current_size;
+			offset = aligned_offset(0);
+		}
+
+		used = offset + size;
+		payload += size;
+		return blocks.back().get() + offset;
+	}
+
+	size_t bytes_used() const { return payload; }
+	size_t bytes_reserved() const { return reserved; }
+	size_t block_count() const { return blocks.size(); }
+	size_t object_count() const { return objects; }
+
+private:
+	struct destructor
+	{
+		void* object;
+		void (*destroy)(void*);
+	};
+
+	size_t block_size;
+	size_t current_size = 0;
+	size_t used = 0;
+	size_t payload = 0;
+	size_t reserved = 0;
+	size_t objects = 0;
+	std::vector<std::unique_ptr<std::byte[]>> blocks;
+	std::vector<destructor> destructors;
+};
+
+// Scene storage with one arena per concrete type, so all spheres sit next to each
+// other, all quads next to each other, and so on. make<T>() hands back a
+// non-owning shared_ptr (empty control block) so the rest of the code keeps its
+// shared_ptr API without a heap allocation or refcount traffic per object. The
+// scene_arena must outlive everything built from it. Materials given a plain
+// colour (lambertian, diffuse_light) get their solid_color from the arena too,
+// rather than from the make_shared in their colour constructors.
+class scene_arena
+{
+public:
+	scene_arena(size_t _block_size = size_t(64) << 10) : block_size(_block_size) {}
+
+	scene_arena(const scene_arena&) = delete;
+	scene_arena& operator=(const scene_arena&) = delete;
+
+	template <typename T, typename... Args>
+	shared_ptr<T> make(Args&&... args)
+	{
+		if constexpr (takes_colour_texture<T, Args...>())
+		{
+			shared_ptr<texture> albedo = make<solid_color>(std::forward<Args>(args)...);
+			return make<T>(albedo);
+		}
+		else
+		{
+			T* object = pool_for(typeid(T)).template create<T>(std::forward<Args>(args)...);
+			return shared_ptr<T>(shared_ptr<void>(), object);
+		}
+	}
+
+	void report(std::ostream& out) const
+	{
+		size_t used = 0, reserved = 0, blocks = 0, objects = 0;
+		for (const auto& entry : by_type)
+		{
+			const arena& a = *entry.second;
+			out << "  " << readable_name(entry.first) << ": " << a.object_count() << " objects, "
+				<< a.bytes_used() << " bytes in " << a.block_count() << " blocks\n";
+
+			used += a.bytes_used();
+			reserved += a.bytes_reserved();
+			blocks += a.block_count();
+			objects += a.object_count();
+		}
+
+		out << "Scene arena: " << objects << " objects, " << used / 1024 << " KB used, "
+			<< reserved / 1024 << " KB reserved, " << blocks << " block allocations\n";
+	}
+
+private:
+	size_t block_size;
+	std::map<std::type_index, std::unique_ptr<arena>> by_type;
+
+	// A single colour argument to a type that can also be built from a texture.
+	template <typename T, typename... Args>
+	static constexpr bool takes_colour_texture()
+	{
+		if constexpr (sizeof...(Args) == 1)
+			return std::is_constructible_v<T, shared_ptr<texture>> && (std::is_same_v<std::decay_t<Args>, color> && ...);
+		else
+			return false;
+	}
+
+	static std::string readable_name(std::type_index type)
+	{
+#ifdef __GNUG__
+		int status = 0;
+		std::unique_ptr<char, void (*)(void*)> name(
+			abi::__cxa_demangle(type.name(), nullptr, nullptr, &status), std::free);
+		if (status == 0)
+			return name.get();
+#endif
+		return type.name();
+	}
+
+	arena& pool_for(std::type_index type)
+	{
+		auto& a = by_type[type];
+		if (!a)
+			a = std::make_unique<arena>(block_size);
+		return *a;
+	}
+};
+
+#endif
@@ -0,0 +1,433 @@
+#ifndef BIDIRECTIONAL_H
+#define BIDIRECTIONAL_H
+
+#include "utility.h"
+
+#include "camera.h"
+#include "color.h"
+#include "hittable.h"
+#include "lightList.h"
+#include "material.h"
+#include "parallel.h"
+#include "rayStats.h"
+#include "splatBuffer.h"
+#include "trace.h"
+
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+// Bidirectional path tracer (Veach, ch. 10; the formulation follows pbrt-v3).
+// Every sample traces a subpath from the camera and one from a point on an
+// emitter, then joins them in every way their lengths allow: s light and t
+// camera vertices, s = 0 being the camera path hitting an emitter by itself and
+// t = 1 connecting a light vertex straight to the camera, which lands on
+// whatever pixel it projects to and goes into a splat_buffer. Each strategy is
+// weighted by the balance heuristic over all strategies that could have made
+// the same path, computed from the forward and reverse area densities stored
+// on the vertices.
+//
+// Vertices on specular materials (is_specular) can't be connected and only
+// extend subpaths. The camera is the pinhole camera::get_ray uses. Light
+// leaving the scene (background, environment) is only found by camera paths
+// and counts in full.
+class bidirectional_integrator
+{
+public:
+	bidirectional_integrator(camera& _cam, const light_list& _lights) : cam(_cam), lights(_lights) {}
+
+	// Writes the image to std::cout like camera::render; false if cancelled.
+	template <typename World>
+	bool render(const World& world)
+	{
+		cam.initialize();
+
+		int width = cam.image_width, height = cam.image_height;
+		int spp = cam.sqrt_spp * cam.sqrt_spp;
+		max_bounces = cam.max_depth - 1; // camera::ray_color follows max_depth rays.
+		film_area = width * cam.pixel_delta_u.length() * height * cam.pixel_delta_v.length()
+			/ (cam.focus_distance * cam.focus_distance);
+
+		std::vector<color> framebuffer(static_cast<size_t>(width) * height, color(0, 0, 0));
+		splat_buffer splats(width, height);
+		auto tiles = cam.tile_order();
+		std::atomic<int> tiles_done{ 0 };
+		int tile_count = static_cast<int>(tiles.size());
+
+		parallel_for(tiles.size(), [&](size_t b, size_t e)
+			{
+				std::vector<vertex> camera_path, light_path;
+				for (size_t k = b; k < e; k++)
+				{
+					if (cam.cancel.load(std::memory_order_relaxed))
+						return;
+
+					const auto& t = tiles[k];
+					TRACE_SCOPE("render tile", (t.y0 / cam.tile_size) * ((width + cam.tile_size - 1) / cam.tile_size) + t.x0 / cam.tile_size);
+					for (int j = t.y0; j < t.y1; j++)
+					{
+						for (int i = t.x0; i < t.x1; i++)
+						{
+							color pixel_color(0, 0, 0);
+							for (int s = 0; s < spp; s++)
+								pixel_color += sample(world, cam.get_ray(i, j, s % cam.sqrt_spp, s / cam.sqrt_spp), camera_path, light_path, splats);
+							framebuffer[static_cast<size_t>(j) * width + i] = pixel_color;
+						}
+					}
+
+					int done = ++tiles_done;
+					std::lock_guard<std::mutex> lock(cam.progress_mutex);
+					if (cam.progress)
+						cam.progress(done, tile_count);
+					else
+						std::clog << "\rTiles remaining: " << (tile_count - done) << ' ' << std::flush;
+				}
+			}, 1);
+
+		if (cam.cancel)
+		{
+			std::clog << "\rCancelled after " << tiles_done << " of " << tile_count << " tiles.\n";
+			return false;
+		}
+		std::clog << "\rDone.                 \n";
+
+		// There are as many light paths as camera samples, so splats share their scale.
+		splats.add_to(framebuffer, 1);
+		cam.write_image(std::cout, framebuffer, 1.0 / spp);
+		return true;
+	}
+
+private:
+	enum class vertex_kind { camera, light, surface };
+
+	struct vertex
+	{
+		vertex_kind kind = vertex_kind::surface;
+		hit_record rec;     // Light vertices: normal outward. Camera: pos only.
+		ray incoming;       // Surfaces: the ray that reached them.
+		color beta;         // Throughput of the subpath up to and including this vertex.
+		double pdf_fwd = 0; // Area density of this vertex from the one before on its subpath,
+		double pdf_rev = 0; // and from the one after, were the subpath traced the other way.
+		bool delta = false; // Scattered by a specular material, so it can't be connected.
+	};
+
+	camera& cam;
+	const light_list& lights;
+	int max_bounces = 0;
+	double film_area = 0; // Of the image plane at distance 1.
+
+	template <typename World>
+	color sample(const World& world, const ray& r, std::vector<vertex>& camera_path, std::vector<vertex>& light_path, splat_buffer& splats) const
+	{
+		vertex eye;
+		eye.kind = vertex_kind::camera;
+		eye.rec.pos = cam.center;
+		eye.beta = color(1, 1, 1);
+		eye.pdf_fwd = 1;
+		camera_path.assign(1, eye);
+
+		color escaped(0, 0, 0);
+		random_walk(world, r, color(1, 1, 1), camera_pdf(r.direction()), camera_path, max_bounces + 2, &escaped);
+
+		light_path.clear();
+		if (!lights.empty())
+		{
+			light_list::point p = lights.sample();
+
+			vertex source;
+			source.kind = vertex_kind::light;
+			source.rec = p.rec;
+			source.beta = p.emission / p.pdf;
+			source.pdf_fwd = p.pdf;
+			light_path.assign(1, source);
+
+			// Cosine-weighted about either side of the emitter.
+			vec3 n = random_double() < .5 ? p.rec.normal : -p.rec.normal;
+			vec3 dir = n + random_unit_vector();
+			if (dir.near_zero())
+				dir = n;
+			double pdf_dir = std::fabs(dot(p.rec.normal, normalize(dir))) / (2 * pi);
+			if (pdf_dir > 0)
+			{
+				color beta = source.beta * std::fabs(dot(p.rec.normal, normalize(dir))) / pdf_dir;
+				random_walk(world, ray(p.rec.pos, dir), beta, pdf_dir, light_path, max_bounces + 1, nullptr);
+			}
+		}
+
+		color sum = escaped;
+		int nc = static_cast<int>(camera_path.size()), nl = static_cast<int>(light_path.size());
+		for (int t = 1; t <= nc; t++)
+		{
+			for (int s = 0; s <= nl; s++)
+			{
+				int depth = s + t - 2;
+				if ((s == 1 && t == 1) || depth < 0 || depth > max_bounces)
+					continue;
+
+				int i = 0, j = 0;
+				color c = connect(world, light_path, camera_path, s, t, i, j);
+				if (c.near_zero())
+					continue;
+
+				c = c * mis_weight(light_path, camera_path, s, t);
+				if (t == 1)
+					splats.add(i, j, c);
+				else
+					sum += c;
+			}
+		}
+		return sum;
+	}
+
+	// Extends path from r, which leaves its last vertex with throughput beta and
+	// solid-angle density pdf_dir, until it has max_vertices, leaves the scene
+	// (adding what it sees to *escaped when given) or is absorbed.
+	template <typename World>
+	void random_walk(const World& world, ray r, color beta, double pdf_dir, std::vector<vertex>& path, int max_vertices, color* escaped) const
+	{
+		double pdf_fwd = pdf_dir;
+		while (static_cast<int>(path.size()) < max_vertices)
+		{
+			hit_record rec;
+			count_ray();
+			if (!world.hit(r, interval(ray_epsilon, infinity), rec))
+			{
+				if (escaped)
+					*escaped = beta * cam.miss_color(r);
+				return;
+			}
+
+			vertex v;
+			v.kind = vertex_kind::surface;
+			v.rec = rec;
+			v.incoming = r;
+			v.beta = beta;
+			v.pdf_fwd = convert_density(pdf_fwd, path.back(), v);
+			path.push_back(v);
+			if (static_cast<int>(path.size()) == max_vertices)
+				return;
+
+			ray scattered;
+			color attenuation;
+			if (!rec.mat->scatter(r, rec, attenuation, scattered))
+				return;
+
+			double pdf_rev;
+			if (rec.mat->is_specular())
+			{
+				// The scattered direction is one of at most a few, picked with the
+				// probability attenuation already divides out; densities are zero.
+				path.back().delta = true;
+				beta = beta * attenuation;
+				pdf_fwd = pdf_rev = 0;
+			}
+			else
+			{
+				pdf_fwd = rec.mat->scattering_pdf(r, rec, scattered);
+				if (pdf_fwd <= 0)
+					return;
+				beta = beta * rec.mat->eval(r, rec, scattered) / pdf_fwd;
+				pdf_rev = rec.mat->reverse_pdf(r, rec, scattered);
+			}
+
+			size_t n = path.size();
+			path[n - 2].pdf_rev = convert_density(pdf_rev, path[n - 1], path[n - 2]);
+			r = ray(rec.pos, scattered.direction());
+		}
+	}
+
+	// Unweighted contribution of the path made of light_path[0, s) and
+	// camera_path[0, t); for t == 1, (i, j) receives the pixel it lands on.
+	template <typename World>
+	color connect(const World& world, const std::vector<vertex>& light_path, const std::vector<vertex>& camera_path, int s, int t, int& i, int& j) const
+	{
+		const vertex& pt = camera_path[t - 1];
+		if (s == 0)
+		{
+			if (pt.kind != vertex_kind::surface)
+				return color(0, 0, 0);
+			return pt.beta * pt.rec.mat->emitted(pt.rec.u, pt.rec.v, pt.rec.pos);
+		}
+
+		const vertex& qs = light_path[s - 1];
+		if (qs.delta || pt.delta)
+			return color(0, 0, 0);
+
+		vec3 d = pt.rec.pos - qs.rec.pos;
+		double distance_squared = d.length_squared();
+		if (distance_squared <= 0)
+			return color(0, 0, 0);
+
+		color f_qs = scattering(qs, pt.rec.pos);
+		if (f_qs.near_zero())
+			return color(0, 0, 0);
+
+		color f_pt;
+		if (t == 1)
+		{
+			double importance = camera_importance(-d, i, j);
+			f_pt = color(1, 1, 1) * (importance * dot(normalize(-d), -cam.w));
+		}
+		else
+		{
+			f_pt = scattering(pt, qs.rec.pos);
+		}
+
+		color c = qs.beta * f_qs * pt.beta * f_pt / distance_squared;
+		if (c.near_zero() || !visible(world, qs.rec.pos, pt.rec.pos))
+			return color(0, 0, 0);
+		return c;
+	}
+
+	// What v passes on towards target: the BSDF times the cosine for surfaces,
+	// the cosine alone for a light vertex (its emission is in beta).
+	color scattering(const vertex& v, const vec3& target) const
+	{
+		ray out(v.rec.pos, target - v.rec.pos);
+		if (v.kind == vertex_kind::light)
+			return color(1, 1, 1) * std::fabs(dot(v.rec.normal, normalize(out.direction())));
+		return v.rec.mat->eval(v.incoming, v.rec, out);
+	}
+
+	template <typename World>
+	bool visible(const World& world, const vec3& a, const vec3& b) const
+	{
+		vec3 d = b - a;
+		double distance = d.length();
+		count_ray();
+		return !world.occluded(ray(a, d / distance), interval(ray_epsilon, distance - ray_epsilon));
+	}
+
+	// Balance heuristic weight of strategy (s, t): 1 over the sum, across all
+	// strategies, of their density divided by this one's. The ratios chain from
+	// the connection outwards, each step swapping one vertex's forward density
+	// for its reverse one; only the four vertices at the connection need reverse
+	// densities other than those the random walks stored, set here for the call.
+	double mis_weight(std::vector<vertex>& light_path, std::vector<vertex>& camera_path, int s, int t) const
+	{
+		if (s + t == 2)
+			return 1;
+
+		vertex* qs = s > 0 ? &light_path[s - 1] : nullptr;
+		vertex* pt = &camera_path[t - 1];
+		vertex* qs_minus = s > 1 ? &light_path[s - 2] : nullptr;
+		vertex* pt_minus = t > 1 ? &camera_path[t - 2] : nullptr;
+
+		double saved[4] = { pt->pdf_rev, pt_minus ? pt_minus->pdf_rev : 0, qs ? qs->pdf_rev : 0, qs_minus ? qs_minus->pdf_rev : 0 };
+
+		pt->pdf_rev = qs ? pdf(*qs, qs_minus, *pt) : lights.pdf(pt->rec.object);
+		if (pt_minus)
+			pt_minus->pdf_rev = qs ? pdf(*pt, qs, *pt_minus) : emission_pdf(*pt, *pt_minus);
+		if (qs)
+			qs->pdf_rev = pdf(*pt, pt_minus, *qs);
+		if (qs_minus)
+			qs_minus->pdf_rev = pdf(*qs, pt, *qs_minus);
+
+		auto remap = [](double p) { return p != 0 ? p : 1; };
+		double sum = 0, ratio = 1;
+		for (int i = t - 1; i > 0; i--)
+		{
+			ratio *= remap(camera_path[i].pdf_rev) / remap(camera_path[i].pdf_fwd);
+			if (!camera_path[i].delta && !camera_path[i - 1].delta)
+				sum += ratio;
+		}
+
+		ratio = 1;
+		for (int i = s - 1; i >= 0; i--)
+		{
+			ratio *= remap(light_path[i].pdf_rev) / remap(light_path[i].pdf_fwd);
+			if (!light_path[i].delta && (i == 0 || !light_path[i - 1].delta))
+				sum += ratio;
+		}
+
+		pt->pdf_rev = saved[0];
+		if (pt_minus)
+			pt_minus->pdf_rev = saved[1];
+		if (qs)
+			qs->pdf_rev = saved[2];
+		if (qs_minus)
+			qs_minus->pdf_rev = saved[3];
+
+		return 1 / (1 + sum);
+	}
+
+	// Area density at next of v scattering towards it, having been reached from prev.
+	double pdf(const vertex& v, const vertex* prev, const vertex& next) const
+	{
+		vec3 d = next.rec.pos - v.rec.pos;
+		switch (v.kind)
+		{
+		case vertex_kind::camera:
+			return convert_density(camera_pdf(d), v, next);
+		case vertex_kind::light:
+			return emission_pdf(v, next);
+		default:
+			return convert_density(v.rec.mat->scattering_pdf(ray(prev->rec.pos, v.rec.pos - prev->rec.pos), v.rec, ray(v.rec.pos, d)), v, next);
+		}
+	}
+
+	// Area density at next of the light path's first direction, were v its start.
+	double emission_pdf(const vertex& v, const vertex& next) const
+	{
+		vec3 d = normalize(next.rec.pos - v.rec.pos);
+		return convert_density(std::fabs(dot(v.rec.normal, d)) / (2 * pi), v, next);
+	}
+
+	// Solid-angle density at from to area density at to.
+	static double convert_density(double pdf, const vertex& from, const vertex& to)
+	{
+		vec3 d = to.rec.pos - from.rec.pos;
+		double distance_squared = d.length_squared();
+		if (distance_squared <= 0)
+			return 0;
+
+		pdf /= distance_squared;
+		if (to.kind != vertex_kind::camera)
+			pdf *= std::fabs(dot(to.rec.normal, d)) / std::sqrt(distance_squared);
+		return pdf;
+	}
+
+	// Importance of the camera ray along direction, 1 / (A cos^4) with A the
+	// image plane's area at distance 1, so a pixel's splats average to its
+	// radiance; (i, j) receives the pixel. 0 outside the image.
+	double camera_importance(const vec3& direction, int& i, int& j) const
+	{
+		double cos_theta;
+		if (!project(direction, i, j, cos_theta))
+			return 0;
+		double cos2 = cos_theta * cos_theta;
+		return 1 / (film_area * cos2 * cos2);
+	}
+
+	// Solid-angle density of get_ray's directions, 1 / (A cos^3).
+	double camera_pdf(const vec3& direction) const
+	{
+		int i, j;
+		double cos_theta;
+		if (!project(direction, i, j, cos_theta))
+			return 0;
+		return 1 / (film_area * cos_theta * cos_theta * cos_theta);
+	}
+
+	bool project(const vec3& direction, int& i, int& j, double& cos_theta) const
+	{
+		vec3 d = normalize(direction);
+		cos_theta = dot(d, -cam.w);
+		if (cos_theta <= 0)
+			return false;
+
+		vec3 on_plane = cam.center + d * (cam.focus_distance / cos_theta) - cam.pixel_start_loc;
+		double x = dot(on_plane, cam.pixel_delta_u) / cam.pixel_delta_u.length_squared() + .5;
+		double y = dot(on_plane, cam.pixel_delta_v) / cam.pixel_delta_v.length_squared() + .5;
+		if (x < 0 || y < 0 || x >= cam.image_width || y >= cam.image_height)
+			return false;
+
+		i = static_cast<int>(x);
+		j = static_cast<int>(y);
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,528 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "utility.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittableList.h"
+#include "parallel.h"
+#include "perfCounters.h"
+#include "rayStats.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Node of a flattened BVH. Nodes are stored depth first, so an interior node's
+// first child directly follows it and only the second child's index is kept.
+struct bvh_node
+{
+	aabb box;
+	uint32_t offset; // Leaf: first primitive. Interior: index of the second child.
+	uint16_t count;  // Primitives in a leaf, 0 for interior nodes.
+	uint16_t axis;   // Split axis of an interior node.
+};
+
+// Bounding volume hierarchy over a list of hittables, itself a hittable. Built
+// top down with the surface area heuristic, evaluated over sah_bins equal bins of
+// primitive centroids along the widest centroid axis. The top levels are split
+// one at a time with binning spread over the pool; the subtrees below them are
+// then built in parallel, one task each, and spliced into depth-first order.
+class bvh final : public hittable
+{
+	friend class bvh_cache;
+	friend class wide_bvh;
+
+public:
+	static constexpr int max_leaf_size = 4;
+	static constexpr int sah_bins = 16;
+	static constexpr int max_sah_depth = 32;
+
+	bvh(const hittable_list& list, thread_pool& pool = default_pool()) : bvh(list.objects, pool) {}
+
+	bvh(const std::vector<shared_ptr<hittable>>& objects, thread_pool& pool = default_pool())
+	{
+		perf_scope counted(perf_profile::bvh_build);
+		std::vector<build_item> items(objects.size());
+		pool.parallel_for(objects.size(), [&](size_t b, size_t e)
+			{
+				for (size_t i = b; i < e; i++)
+				{
+					items[i].box = objects[i]->bounding_box();
+					items[i].centroid = items[i].box.centroid();
+					items[i].index = static_cast<uint32_t>(i);
+				}
+			});
+
+		if (!items.empty())
+			build(items, pool);
+
+		prims.resize(objects.size());
+		pool.parallel_for(items.size(), [&](size_t b, size_t e)
+			{
+				for (size_t i = b; i < e; i++)
+					prims[i] = objects[items[i].index];
+			});
+	}
+
+	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+	{
+		if (nodes.empty())
+			return false;
+
+		vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z());
+		bool dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+		uint32_t stack[64];
+		int stack_size = 0;
+		uint32_t current = 0;
+		bool hit_anything = false;
+		test_tally tests;
+
+		while (true)
+		{
+			const bvh_node& node = nodes[current];
+			tests.add(1);
+			if (slab_test(node.box, r.origin(), inv_dir, ray_t))
+			{
+				if (node.count > 0)
+				{
+					tests.add(node.count);
+					for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+					{
+						if (prims[i]->hit(r, ray_t, rec))
+						{
+							hit_anything = true;
+							ray_t.max = rec.t;
+						}
+					}
+
+					if (stack_size == 0)
+						break;
+					current = stack[--stack_size];
+				}
+				else if (dir_is_neg[node.axis])
+				{
+					// Visit the child nearer to the ray origin first.
+					stack[stack_size++] = current + 1;
+					current = node.offset;
+				}
+				else
+				{
+					stack[stack_size++] = node.offset;
+					current = current + 1;
+				}
+			}
+			else
+			{
+				if (stack_size == 0)
+					break;
+				current = stack[--stack_size];
+			}
+		}
+
+		return hit_anything;
+	}
+
+	// Same walk as hit but in plain depth-first order, since any hit will do, and
+	// it stops at the first primitive that reports one.
+	bool occluded(const ray& r, interval ray_t) const override
+	{
+		if (nodes.empty())
+			return false;
+
+		vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z());
+
+		uint32_t stack[64];
+		int stack_size = 0;
+		uint32_t current = 0;
+		test_tally tests;
+
+		while (true)
+		{
+			const bvh_node& node = nodes[current];
+			tests.add(1);
+			if (slab_test(node.box, r.origin(), inv_dir, ray_t))
+			{
+				if (node.count > 0)
+				{
+					tests.add(node.count);
+					for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+						if (prims[i]->occluded(r, ray_t))
+							return true;
+				}
+				else
+				{
+					stack[stack_size++] = node.offset;
+					current = current + 1;
+					continue;
+				}
+			}
+
+			if (stack_size == 0)
+				return false;
+			current = stack[--stack_size];
+		}
+	}
+
+	aabb bounding_box() const override { return nodes.empty() ? aabb() : nodes[0].box; }
+
+	// Recomputes every node box from the primitives' current bounds, keeping the
+	// tree. Right for animation where objects move but none are added or removed;
+	// the tree gets looser as objects drift from where it was built, so compare
+	// sah_cost against its value after the build to decide when to rebuild.
+	void refit()
+	{
+		TRACE_SCOPE("bvh refit");
+		// Children always follow their parent, so a reverse sweep sees them first.
+		for (size_t n = nodes.size(); n-- > 0;)
+		{
+			bvh_node& node = nodes[n];
+			if (node.count > 0)
+			{
+				aabb box;
+				for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+					box = aabb(box, prims[i]->bounding_box());
+				node.box = box;
+			}
+			else
+			{
+				node.box = aabb(nodes[n + 1].box, nodes[node.offset].box);
+			}
+		}
+	}
+
+	// Expected traversal cost relative to the root: node surface areas, leaves
+	// weighted by their primitive count, summed over the root's. Lower is better.
+	double sah_cost() const
+	{
+		if (nodes.empty())
+			return 0;
+
+		double sum = 0;
+		for (const auto& node : nodes)
+			sum += node.box.surface_area() * (node.count > 0 ? node.count : 1);
+		return sum / nodes[0].box.surface_area();
+	}
+
+	size_t node_count() const { return nodes.size(); }
+	size_t primitive_count() const { return prims.size(); }
+	size_t memory_bytes() const { return nodes.size() * sizeof(bvh_node) + prims.size() * sizeof(prims[0]); }
+
+private:
+	bvh() = default; // For bvh_cache, which fills nodes and prims itself.
+
+	struct build_item
+	{
+		aabb box;
+		vec3 centroid;
+		uint32_t index;
+	};
+
+	std::vector<shared_ptr<hittable>> prims;
+	std::vector<bvh_node> nodes;
+
+	static bool slab_test(const aabb& box, const vec3& origin, const vec3& inv_dir, interval ray_t)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			auto t0 = (box.axis(a).min - origin[a]) * inv_dir[a];
+			auto t1 = (box.axis(a).max - origin[a]) * inv_dir[a];
+			if (inv_dir[a] < 0)
+				std::swap(t0, t1);
+
+			if (t0 > ray_t.min) ray_t.min = t0;
+			if (t1 < ray_t.max) ray_t.max = t1;
+
+			if (ray_t.max <= ray_t.min)
+				return false;
+		}
+
+		return true;
+	}
+
+	// Items [begin, end) with their bounds, which the parent's binning already
+	// produced, so no node needs a pass over its items just for those.
+	struct build_range
+	{
+		size_t begin, end;
+		aabb box, centroid_box;
+		int depth;
+
+		size_t count() const { return end - begin; }
+	};
+
+	struct bin_set
+	{
+		aabb box[sah_bins], centroid_box[sah_bins];
+		size_t count[sah_bins] = {};
+
+		void merge(const bin_set& other)
+		{
+			for (int b = 0; b < sah_bins; b++)
+			{
+				box[b] = aabb(box[b], other.box[b]);
+				centroid_box[b] = aabb(centroid_box[b], other.centroid_box[b]);
+				count[b] += other.count[b];
+			}
+		}
+	};
+
+	// Ranges at least this large are split with the pool's help, and top-level
+	// splitting stops once every remaining range is below the task size.
+	static constexpr size_t parallel_bin_threshold = size_t(1) << 15;
+
+	// A split of the top of the tree, or one handed to a task when subtree >= 0.
+	struct top_node
+	{
+		build_range range;
+		int axis = 0;
+		int left = -1, right = -1;
+		int subtree = -1;
+	};
+
+	void build(std::vector<build_item>& items, thread_pool& pool)
+	{
+		TRACE_SCOPE("bvh build", static_cast<int64_t>(items.size()));
+		build_range root = { 0, items.size(), aabb(), aabb(), 0 };
+		bin_bounds(items, root, &pool);
+
+		// Split the top of the tree breadth first until the ranges are small enough
+		// to give each to one task.
+		size_t task_size = std::max<size_t>(items.size() / (16 * pool.size()), 256);
+		std::vector<top_node> top = { { root } };
+		std::vector<int> tasks;
+		for (size_t t = 0; t < top.size(); t++)
+		{
+			build_range left, right;
+			int axis;
+			if (top[t].range.count() <= task_size || !split(items, top[t].range, left, right, axis, &pool))
+			{
+				top[t].subtree = static_cast<int>(tasks.size());
+				tasks.push_back(static_cast<int>(t));
+				continue;
+			}
+
+			top[t].axis = axis;
+			top[t].left = static_cast<int>(top.size());
+			top[t].right = static_cast<int>(top.size() + 1);
+			top.push_back({ left });
+			top.push_back({ right });
+		}
+
+		// Largest first, so a big subtree doesn't start last.
+		std::vector<int> order(tasks.size());
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = static_cast<int>(i);
+		std::sort(order.begin(), order.end(), [&](int a, int b) {
+			return top[tasks[a]].range.count() > top[tasks[b]].range.count();
+		});
+
+		std::vector<std::vector<bvh_node>> subtrees(tasks.size());
+		pool.parallel_for(tasks.size(), [&](size_t b, size_t e)
+			{
+				for (size_t i = b; i < e; i++)
+				{
+					int task = order[i];
+					const build_range& range = top[tasks[task]].range;
+					TRACE_SCOPE("bvh subtree", static_cast<int64_t>(range.count()));
+					perf_scope counted(perf_profile::bvh_build);
+					subtrees[task].reserve(2 * range.count());
+					build_subtree(items, range, subtrees[task]);
+				}
+			}, 1);
+
+		nodes.reserve(2 * items.size());
+		emit(top, 0, subtrees);
+	}
+
+	// Appends top node t and everything under it to nodes in depth-first order.
+	uint32_t emit(const std::vector<top_node>& top, int t, const std::vector<std::vector<bvh_node>>& subtrees)
+	{
+		uint32_t index = static_cast<uint32_t>(nodes.size());
+		if (top[t].subtree >= 0)
+		{
+			// Subtree node indices are local; primitive offsets are already global.
+			for (bvh_node node : subtrees[top[t].subtree])
+			{
+				if (node.count == 0)
+					node.offset += index;
+				nodes.push_back(node);
+			}
+			return index;
+		}
+
+		nodes.emplace_back();
+		emit(top, top[t].left, subtrees);
+		uint32_t second = emit(top, top[t].right, subtrees);
+		nodes[index] = { top[t].range.box, second, 0, static_cast<uint16_t>(top[t].axis) };
+		return index;
+	}
+
+	static uint32_t build_subtree(std::vector<build_item>& items, const build_range& range, std::vector<bvh_node>& out)
+	{
+		uint32_t index = static_cast<uint32_t>(out.size());
+		out.emplace_back();
+
+		build_range left, right;
+		int axis;
+		if (!split(items, range, left, right, axis, nullptr))
+		{
+			out[index] = { range.box, static_cast<uint32_t>(range.begin), static_cast<uint16_t>(range.count()), 0 };
+			return index;
+		}
+
+		build_subtree(items, left, out);
+		uint32_t second = build_subtree(items, right, out);
+		out[index] = { range.box, second, 0, static_cast<uint16_t>(axis) };
+		return index;
+	}
+
+	// Partitions range in place into left and right, with their bounds. Returns
+	// false if it should be a leaf. pool spreads the binning of large ranges.
+	static bool split(std::vector<build_item>& items, const build_range& range, build_range& left, build_range& right,
+		int& axis, thread_pool* pool)
+	{
+		if (range.count() <= max_leaf_size)
+			return false;
+
+		axis = range.centroid_box.longest_axis();
+		const interval& extent = range.centroid_box.axis(axis);
+		left = { range.begin, 0, aabb(), aabb(), range.depth + 1 };
+		right = { 0, range.end, aabb(), aabb(), range.depth + 1 };
+
+		// Past max_sah_depth only balanced splits, so the traversal stack can't overflow.
+		if (range.depth >= max_sah_depth || extent.size() <= 0)
+			return median_split(items, range, left, right, axis, pool);
+
+		double to_bin = sah_bins / extent.size();
+		auto bin_of = [&](const build_item& item) {
+			return std::min(static_cast<int>((item.centroid[axis] - extent.min) * to_bin), sah_bins - 1);
+		};
+
+		auto fill = [&](bin_set& bins, size_t b, size_t e) {
+			for (size_t i = b; i < e; i++)
+			{
+				int k = bin_of(items[i]);
+				bins.box[k] = aabb(bins.box[k], items[i].box);
+				bins.centroid_box[k] = aabb(bins.centroid_box[k], aabb(items[i].centroid, items[i].centroid));
+				bins.count[k]++;
+			}
+		};
+
+		bin_set bins;
+		if (pool && range.count() >= parallel_bin_threshold)
+		{
+			size_t chunks = pool->size() * 4;
+			std::vector<bin_set> partial(chunks);
+			size_t chunk_size = (range.count() + chunks - 1) / chunks;
+			pool->parallel_for(chunks, [&](size_t b, size_t e)
+				{
+					for (size_t c = b; c < e; c++)
+						fill(partial[c], range.begin + std::min(c * chunk_size, range.count()),
+							range.begin + std::min((c + 1) * chunk_size, range.count()));
+				}, 1);
+
+			for (const auto& p : partial)
+				bins.merge(p);
+		}
+		else
+		{
+			fill(bins, range.begin, range.end);
+		}
+
+		// right_cost[b]: area * count of everything in bins above b.
+		double right_cost[sah_bins];
+		aabb right_box;
+		size_t right_n = 0;
+		for (int b = sah_bins - 1; b > 0; b--)
+		{
+			right_box = aabb(right_box, bins.box[b]);
+			right_n += bins.count[b];
+			right_cost[b - 1] = right_box.surface_area() * right_n;
+		}
+
+		aabb left_box;
+		size_t left_n = 0;
+		int best = -1;
+		double best_cost = infinity;
+		for (int b = 0; b < sah_bins - 1; b++)
+		{
+			left_box = aabb(left_box, bins.box[b]);
+			left_n += bins.count[b];
+			double cost = left_box.surface_area() * left_n + right_cost[b];
+			if (left_n > 0 && left_n < range.count() && cost < best_cost)
+			{
+				best = b;
+				best_cost = cost;
+			}
+		}
+
+		if (best < 0)
+			return median_split(items, range, left, right, axis, pool);
+
+		for (int b = 0; b < sah_bins; b++)
+		{
+			build_range& side = b <= best ? left : right;
+			side.box = aabb(side.box, bins.box[b]);
+			side.centroid_box = aabb(side.centroid_box, bins.centroid_box[b]);
+		}
+
+		auto mid = std::partition(items.begin() + range.begin, items.begin() + range.end,
+			[&](const build_item& item) { return bin_of(item) <= best; });
+		left.end = right.begin = static_cast<size_t>(mid - items.begin());
+		return true;
+	}
+
+	// Fallback when SAH finds no split: halves the range at the median centroid.
+	static bool median_split(std::vector<build_item>& items, const build_range& range, build_range& left, build_range& right,
+		int axis, thread_pool* pool)
+	{
+		size_t mid = range.begin + range.count() / 2;
+		std::nth_element(items.begin() + range.begin, items.begin() + mid, items.begin() + range.end,
+			[axis](const build_item& a, const build_item& b) { return a.centroid[axis] < b.centroid[axis]; });
+
+		left.end = right.begin = mid;
+		bin_bounds(items, left, pool);
+		bin_bounds(items, right, pool);
+		return true;
+	}
+
+	// Computes range.box and range.centroid_box from its items.
+	static void bin_bounds(const std::vector<build_item>& items, build_range& range, thread_pool* pool)
+	{
+		auto bounds = [&](size_t b, size_t e, aabb& box, aabb& centroid_box) {
+			for (size_t i = b; i < e; i++)
+			{
+				box = aabb(box, items[i].box);
+				centroid_box = aabb(centroid_box, aabb(items[i].centroid, items[i].centroid));
+			}
+		};
+
+		if (!pool || range.count() < parallel_bin_threshold)
+		{
+			bounds(range.begin, range.end, range.box, range.centroid_box);
+			return;
+		}
+
+		size_t chunks = pool->size() * 4;
+		size_t chunk_size = (range.count() + chunks - 1) / chunks;
+		std::vector<aabb> boxes(chunks), centroid_boxes(chunks);
+		pool->parallel_for(chunks, [&](size_t b, size_t e)
+			{
+				for (size_t c = b; c < e; c++)
+					bounds(range.begin + std::min(c * chunk_size, range.count()),
+						range.begin + std::min((c + 1) * chunk_size, range.count()), boxes[c], centroid_boxes[c]);
+			}, 1);
+
+		for (size_t c = 0; c < chunks; c++)
+		{
+			range.box = aabb(range.box, boxes[c]);
+			range.centroid_box = aabb(range.centroid_box, centroid_boxes[c]);
+		}
+	}
+};
+
+#endif
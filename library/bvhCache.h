@@ -0,0 +1,335 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "utility.h"
+
+#include "bvh.h"
+#include "hittableList.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Built bvh saved to disk, so later runs over the same scene skip the build.
+// Layout, in the byte order of the machine that wrote it (a file from a machine
+// of the other order fails the version check and is rebuilt):
+//
+//   offset  0  char[8]        "RTBVHC" + "\0\0"
+//   offset  8  uint32         version (1)
+//   offset 12  uint32         sizeof(bvh_node)
+//   offset 16  uint64         scene hash
+//   offset 24  uint64         node count
+//   offset 32  uint64         primitive count
+//   offset 40  bvh_node[]     nodes, children referenced by index
+//   then       uint32[]       primitive order, as indices into the scene list
+//
+// Nothing in it is a pointer, so it can be mapped anywhere. The scene hash
+// covers every object's bounding box in list order and the build parameters,
+// which is all a build depends on. Beyond the header, load checks that the nodes
+// form one tree the traversal stack can hold, with every leaf's primitives in
+// range and the primitive order a permutation; a file that fails any check is
+// ignored and rebuilt.
+class bvh_cache
+{
+public:
+	static constexpr uint32_t version = 1;
+
+	struct header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t node_size;
+		uint64_t scene_hash;
+		uint64_t node_count;
+		uint64_t primitive_count;
+	};
+
+	// FNV-1a over the object count, build parameters and bounding boxes.
+	static uint64_t scene_hash(const std::vector<shared_ptr<hittable>>& objects)
+	{
+		uint64_t h = 14695981039346656037ull;
+		auto mix = [&h](const void* bytes, size_t count) {
+			for (size_t i = 0; i < count; i++)
+				h = (h ^ static_cast<const unsigned char*>(bytes)[i]) * 1099511628211ull;
+		};
+
+		uint64_t params[] = { objects.size(), bvh::max_leaf_size, bvh::sah_bins, bvh::max_sah_depth };
+		mix(params, sizeof(params));
+		for (const auto& object : objects)
+		{
+			aabb box = object->bounding_box();
+			double bounds[6] = { box.x.min, box.x.max, box.y.min, box.y.max, box.z.min, box.z.max };
+			mix(bounds, sizeof(bounds));
+		}
+		return h;
+	}
+
+	// Loads the bvh for objects from path, or builds it and writes path.
+	static bvh load_or_build(const hittable_list& list, const char* path)
+	{
+		const auto& objects = list.objects;
+		uint64_t hash = scene_hash(objects);
+
+		auto begin = std::chrono::steady_clock::now();
+		bvh tree;
+		if (load(tree, objects, hash, path))
+		{
+			std::clog << "BVH cache: loaded " << path << " in " << elapsed_us(begin) << " us\n";
+			return tree;
+		}
+
+		tree = bvh(objects);
+		std::clog << "BVH cache: built in " << elapsed_us(begin) << " us";
+		if (save(tree, objects, hash, path))
+			std::clog << ", saved to " << path;
+		std::clog << '\n';
+		return tree;
+	}
+
+	static bool save(const bvh& tree, const std::vector<shared_ptr<hittable>>& objects, uint64_t hash, const char* path)
+	{
+		std::unordered_map<const hittable*, uint32_t> index_of;
+		index_of.reserve(objects.size());
+		for (size_t i = 0; i < objects.size(); i++)
+			index_of.emplace(objects[i].get(), static_cast<uint32_t>(i));
+
+		std::vector<uint32_t> order(tree.prims.size());
+		for (size_t i = 0; i < tree.prims.size(); i++)
+			order[i] = index_of.at(tree.prims[i].get());
+
+		header h = {};
+		std::memcpy(h.magic, "RTBVHC\0", 8);
+		h.version = version;
+		h.node_size = sizeof(bvh_node);
+		h.scene_hash = hash;
+		h.node_count = tree.nodes.size();
+		h.primitive_count = order.size();
+
+		// Written to a uniquely named file next to the target and renamed, so
+		// concurrent jobs neither write into each other's file nor map a
+		// half-written one.
+		std::string temp;
+		std::FILE* file = open_temp(path, temp);
+		if (!file)
+			return false;
+
+		bool ok = std::fwrite(&h, sizeof(h), 1, file) == 1
+			&& std::fwrite(tree.nodes.data(), sizeof(bvh_node), tree.nodes.size(), file) == tree.nodes.size()
+			&& std::fwrite(order.data(), sizeof(uint32_t), order.size(), file) == order.size();
+		ok = std::fclose(file) == 0 && ok;
+
+#ifdef _WIN32
+		ok = ok && MoveFileExA(temp.c_str(), path, MOVEFILE_REPLACE_EXISTING);
+#else
+		ok = ok && std::rename(temp.c_str(), path) == 0;
+#endif
+		if (!ok)
+			std::remove(temp.c_str());
+		return ok;
+	}
+
+	static bool load(bvh& tree, const std::vector<shared_ptr<hittable>>& objects, uint64_t hash, const char* path)
+	{
+		TRACE_SCOPE("bvh cache load");
+		mapped_file file(path);
+		if (file.size < sizeof(header))
+			return false;
+
+		header h;
+		std::memcpy(&h, file.data, sizeof(h));
+		if (std::memcmp(h.magic, "RTBVHC\0", 8) != 0 || h.version != version || h.node_size != sizeof(bvh_node)
+			|| h.scene_hash != hash || h.primitive_count != objects.size())
+			return false;
+
+		// primitive_count matches the scene, so only node_count can overflow.
+		uint64_t order_bytes = h.primitive_count * sizeof(uint32_t);
+		if (file.size < sizeof(header) + order_bytes || h.node_count > (file.size - sizeof(header) - order_bytes) / sizeof(bvh_node))
+			return false;
+
+		uint64_t node_bytes = h.node_count * sizeof(bvh_node);
+		if (file.size != sizeof(header) + node_bytes + order_bytes)
+			return false;
+
+		// The nodes are copied out of the mapping so refit and wide_bvh can keep
+		// treating them as an ordinary vector; it is a straight memcpy.
+		const char* nodes = file.data + sizeof(header);
+		tree.nodes.resize(h.node_count);
+		std::memcpy(tree.nodes.data(), nodes, node_bytes);
+		if (!valid_tree(tree.nodes, h.primitive_count))
+			return false;
+
+		const char* order = nodes + node_bytes;
+		std::vector<bool> used(objects.size(), false);
+		tree.prims.resize(h.primitive_count);
+		for (size_t i = 0; i < h.primitive_count; i++)
+		{
+			uint32_t index;
+			std::memcpy(&index, order + i * sizeof(uint32_t), sizeof(index));
+			if (index >= objects.size() || used[index])
+				return false;
+			used[index] = true;
+			tree.prims[i] = objects[index];
+		}
+
+		return true;
+	}
+
+	// Whether nodes, as laid out by bvh, are a tree bvh::hit can walk: every node
+	// reached exactly once from the root, the first child of an interior node
+	// right after it and the second past it, split axes 0-2, leaves within the
+	// primitives, and no path deeper than the traversal stack.
+	static bool valid_tree(const std::vector<bvh_node>& nodes, uint64_t primitive_count)
+	{
+		if (nodes.empty())
+			return primitive_count == 0;
+
+		const int max_depth = 64; // bvh::hit's stack.
+		std::vector<bool> reached(nodes.size(), false);
+		std::vector<std::pair<uint64_t, int>> todo = { { 0, 0 } };
+		uint64_t visited = 0;
+		while (!todo.empty())
+		{
+			auto [n, depth] = todo.back();
+			todo.pop_back();
+			if (n >= nodes.size() || depth >= max_depth || reached[n])
+				return false;
+
+			reached[n] = true;
+			visited++;
+			const bvh_node& node = nodes[n];
+			if (node.count > 0)
+			{
+				if (uint64_t(node.offset) + node.count > primitive_count)
+					return false;
+				continue;
+			}
+
+			// Children after their parent also rule out cycles.
+			if (node.axis > 2 || node.offset <= n + 1)
+				return false;
+			todo.push_back({ n + 1, depth + 1 });
+			todo.push_back({ node.offset, depth + 1 });
+		}
+
+		return visited == nodes.size();
+	}
+
+private:
+	static double elapsed_us(std::chrono::steady_clock::time_point begin)
+	{
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+	}
+
+	// Creates and opens a file no other writer can be using, in path's directory
+	// so the rename stays on one filesystem.
+	static std::FILE* open_temp(const char* path, std::string& temp)
+	{
+#ifdef _WIN32
+		std::string dir(path);
+		size_t slash = dir.find_last_of("/\\");
+		dir = slash == std::string::npos ? "." : dir.substr(0, slash);
+		char name[MAX_PATH];
+		if (GetTempFileNameA(dir.c_str(), "bvh", 0, name) == 0)
+			return nullptr;
+		temp = name;
+		std::FILE* file = std::fopen(name, "wb");
+		if (!file)
+			std::remove(name);
+		return file;
+#else
+		temp = std::string(path) + ".XXXXXX";
+		int fd = mkstemp(&temp[0]);
+		if (fd < 0)
+			return nullptr;
+		fchmod(fd, 0644); // mkstemp makes it private to this user.
+		std::FILE* file = fdopen(fd, "wb");
+		if (!file)
+		{
+			close(fd);
+			std::remove(temp.c_str());
+		}
+		return file;
+#endif
+	}
+
+	// Read-only mapping of a whole file; size is 0 if it could not be mapped.
+	struct mapped_file
+	{
+		const char* data = nullptr;
+		size_t size = 0;
+
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+
+		mapped_file(const char* path)
+		{
+			file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			LARGE_INTEGER length;
+			if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &length) || length.QuadPart == 0)
+				return;
+
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (!mapping)
+				return;
+
+			data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+			size = data ? static_cast<size_t>(length.QuadPart) : 0;
+		}
+
+		~mapped_file()
+		{
+			if (data)
+				UnmapViewOfFile(data);
+			if (mapping)
+				CloseHandle(mapping);
+			if (file != INVALID_HANDLE_VALUE)
+				CloseHandle(file);
+		}
+#else
+		mapped_file(const char* path)
+		{
+			int fd = open(path, O_RDONLY);
+			if (fd < 0)
+				return;
+
+			struct stat st;
+			if (fstat(fd, &st) == 0 && st.st_size > 0)
+			{
+				void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+				if (p != MAP_FAILED)
+				{
+					data = static_cast<const char*>(p);
+					size = static_cast<size_t>(st.st_size);
+				}
+			}
+			close(fd);
+		}
+
+		~mapped_file()
+		{
+			if (data)
+				munmap(const_cast<char*>(data), size);
+		}
+#endif
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+	};
+};
+
+#endif
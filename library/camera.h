@@ -4,13 +4,39 @@
 #include "utility.h"
 
 #include "color.h"
+#include "costMap.h"
+#include "environment.h"
 #include "hittable.h"
+#include "image.h"
 #include "material.h"
+#include "morton.h"
+#include "parallel.h"
+#include "pathGuide.h"
+#include "perfCounters.h"
+#include "previewBuffer.h"
+#include "radianceCache.h"
+#include "rayStats.h"
+#include "renderCache.h"
+#include "tileWriter.h"
+#include "trace.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
 
 class camera
 {
+	friend class wavefront_integrator;
+	friend class bidirectional_integrator;
+	friend class metropolis_integrator;
+	friend class restir_integrator;
+
 public:
 	double aspect_ratio = 1;
 	int image_width = 100;
@@ -21,43 +47,575 @@ public:
 	double focus_distance = 0;
 	int max_depth = 10;
 	color background;
+	shared_ptr<environment_light> environment; // Replaces background when set.
 
 	vec3 look_from = vec3(0, 0, -1.0);
 	vec3 look_at = vec3(0, 0, 0);
 	vec3 vup = vec3(0, 1, 0);
 
-	void render(const hittable& world)
+	int tile_size = 16;
+
+	// Called after every finished tile from whichever thread finished it; calls are
+	// serialised, so the callback needs no locking of its own.
+	std::function<void(int tiles_done, int tile_count)> progress;
+
+	// Set from any thread to stop a running render. Workers check it before
+	// starting a tile, so the render stops within one tile's worth of work. It
+	// stays set until the caller clears it.
+	std::atomic<bool> cancel{ false };
+
+	int preview_block = 4; // Pixel block size of render_progressive's first pass.
+
+	// When set, render, render_to_file and render_incremental also measure every
+	// pixel's cost and write it as heatmaps named <cost_map_prefix>_cycles.ppm,
+	// _tests.ppm and _depth.ppm (see cost_map); the last two need a build with
+	// -DRT_RAY_STATS. Left empty, nothing is measured.
+	std::string cost_map_prefix;
+
+	// Wall-clock seconds for render, output included. When set, render ignores
+	// samples_per_pixel and renders as many passes as fit (see render_budgeted).
+	double time_budget = 0;
+
+	// World can be any hittable; passing a concrete (final) container such as
+	// static_scene lets the whole ray_color recursion be specialised for it.
+	// Returns false if the render was cancelled; the unfinished tiles are black.
+	template <typename World>
+	bool render(const World& world)
+	{
+		if (time_budget > 0)
+			return render_budgeted(world, time_budget);
+
+		std::vector<color> framebuffer;
+		bool finished = render_frame(world, framebuffer);
+		write_image(std::cout, framebuffer, 1.0 / samples_per_pixel);
+		write_cost_maps();
+		return finished;
+	}
+
+	// Renders into framebuffer (resized to the image) instead of writing it out.
+	// Each pixel holds the sum of its samples.
+	template <typename World>
+	bool render_frame(const World& world, std::vector<color>& framebuffer)
 	{
 		initialize();
 
-		std::cout << "P3\n"
-			<< image_width << ' ' << image_height << "\n255\n";
+		framebuffer.assign(static_cast<size_t>(image_width) * image_height, color(0, 0, 0));
+		auto tiles = tile_order();
+
+		std::atomic<int> tiles_done{ 0 };
+		int tile_count = static_cast<int>(tiles.size());
+
+		parallel_for(tiles.size(), [&](size_t b, size_t e)
+			{
+				for (size_t t = b; t < e; t++)
+				{
+					if (cancel.load(std::memory_order_relaxed))
+						return;
 
-		for (int j = 0; j < image_height; j++)
+					render_tile(world, tiles[t], [&](int i, int j, const color& c) {
+						framebuffer[static_cast<size_t>(j) * image_width + i] = c;
+					});
+
+					int done = ++tiles_done;
+					std::lock_guard<std::mutex> lock(progress_mutex);
+					if (progress)
+						progress(done, tile_count);
+					else
+						std::clog << "\rTiles remaining: " << (tile_count - done) << ' ' << std::flush;
+				}
+			}, 1);
+
+		if (cancel)
 		{
-			std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
+			std::clog << "\rCancelled after " << tiles_done << " of " << tile_count << " tiles.\n";
+			return false;
+		}
+
+		std::clog << "\rDone.                 \n";
+		return true;
+	}
+
+	int get_image_height() const { return image_height; } // Valid once a render has started.
+
+	// Renders one-sample passes over all threads until the next would overrun
+	// seconds, then writes the image. The cost of a pass is predicted from the
+	// slowest pass so far plus a margin, and the time to write the image is
+	// measured up front on the real output and reserved. Workers also stop taking
+	// tiles once the slowest tile so far would end past the deadline, first pass
+	// included; every tile is normalised by its own sample count, and tiles the
+	// first pass never reached are left black and reported. Reports the samples
+	// reached and the standard error of the mean estimated from the per-pixel
+	// luminance variance. Returns false if cancelled or some tile has no sample.
+	template <typename World>
+	bool render_budgeted(const World& world, double seconds)
+	{
+		using clock = std::chrono::steady_clock;
+		auto start = clock::now();
+		auto elapsed = [&] { return std::chrono::duration<double>(clock::now() - start).count(); };
+
+		initialize();
+
+		// Passes can stop anywhere, so samples are jittered over the whole pixel
+		// rather than stratified over a grid that might be left half covered.
+		sqrt_spp = 1;
+		recip_sqrt_spp = 1;
+
+		size_t pixels = static_cast<size_t>(image_width) * image_height;
+		std::vector<color> sum(pixels, color(0, 0, 0));
+		std::vector<double> sum_squares(pixels, 0); // Of luminance, for the error estimate.
+		auto tiles = tile_order();
+		std::vector<int> tile_samples(tiles.size(), 0);
+
+		// Time one row of the longest pixel text through write_color on the real
+		// output, as PPM header comments, and reserve that for every row.
+		constexpr double write_margin = 2;
+		double write_start = elapsed();
+		std::cout << "P3\n";
+		for (int i = 0; i < image_width; i++)
+		{
+			std::cout << '#';
+			write_color(std::cout, color(1, 1, 1));
+		}
+		std::cout.flush();
+		double write_reserve = write_margin * (elapsed() - write_start) * image_height;
+		double deadline = seconds - write_reserve;
+
+		int passes = 0;
+		double slowest = 0;
+		std::atomic<double> slowest_tile{ 0 };
+		while (!cancel)
+		{
+			double pass_start = elapsed();
+			if (pass_start + 1.25 * slowest > deadline)
+				break;
+
+			std::atomic<bool> out_of_time{ false };
+			parallel_for(tiles.size(), [&](size_t b, size_t e)
+				{
+					for (size_t t = b; t < e; t++)
+					{
+						if (cancel.load(std::memory_order_relaxed) || out_of_time.load(std::memory_order_relaxed))
+							return;
 
-			for (int i = 0; i < image_width; i++)
+						double tile_start = elapsed();
+						if (tile_start + slowest_tile.load(std::memory_order_relaxed) > deadline)
+						{
+							out_of_time = true;
+							return;
+						}
+
+						for (int j = tiles[t].y0; j < tiles[t].y1; j++)
+						{
+							for (int i = tiles[t].x0; i < tiles[t].x1; i++)
+							{
+								size_t p = static_cast<size_t>(j) * image_width + i;
+								color c = ray_color(get_ray(i, j, 0, 0), max_depth, world);
+								double y = luminance(c);
+								sum[p] += c;
+								sum_squares[p] += y * y;
+							}
+						}
+						tile_samples[t]++;
+
+						double tile_time = elapsed() - tile_start;
+						double seen = slowest_tile.load(std::memory_order_relaxed);
+						while (tile_time > seen && !slowest_tile.compare_exchange_weak(seen, tile_time, std::memory_order_relaxed))
+							;
+					}
+				}, 1);
+
+			if (out_of_time)
+				break;
+
+			passes++;
+			slowest = std::max(slowest, elapsed() - pass_start);
+
+			std::lock_guard<std::mutex> lock(progress_mutex);
+			if (progress)
+				progress(passes, static_cast<int>(passes + (deadline - elapsed()) / slowest));
+			else
+				std::clog << "\rPass " << passes << " (" << elapsed() << " s) " << std::flush;
+		}
+
+		// Normalise each tile by its own count; tiles an overrun pass reached have
+		// one more, and tiles no pass reached stay black.
+		std::vector<color> image(pixels, color(0, 0, 0));
+		double variance_sum = 0, mean_sum = 0;
+		size_t rendered_pixels = 0;
+		int unrendered = 0;
+		int min_spp = std::numeric_limits<int>::max(), max_spp = 0;
+		for (size_t t = 0; t < tiles.size(); t++)
+		{
+			int n = tile_samples[t];
+			if (n == 0)
 			{
-				// Stratified / Jittering the pixel randomnes.
-				color pixel_color(0, 0, 0);
-				for (int j_s = 0; j_s < sqrt_spp; j_s++)
+				unrendered++;
+				continue;
+			}
+			min_spp = std::min(min_spp, n);
+			max_spp = std::max(max_spp, n);
+			for (int j = tiles[t].y0; j < tiles[t].y1; j++)
+			{
+				for (int i = tiles[t].x0; i < tiles[t].x1; i++)
 				{
-					for (int i_s = 0; i_s < sqrt_spp; i_s++)
+					size_t p = static_cast<size_t>(j) * image_width + i;
+					image[p] = sum[p] / n;
+					double mean = luminance(image[p]);
+					double variance = n > 1 ? std::max(sum_squares[p] / n - mean * mean, 0.0) * n / (n - 1) : 0;
+					variance_sum += variance / n;
+					mean_sum += mean;
+					rendered_pixels++;
+				}
+			}
+		}
+
+		double render_time = elapsed();
+		write_raster(std::cout, image, 1);
+		std::cout.flush();
+
+		std::clog << "\rBudget " << seconds << " s: ";
+		if (rendered_pixels == 0)
+		{
+			std::clog << "no tile finished in " << render_time << " s (output reserve " << write_reserve << " s).\n";
+			return false;
+		}
+
+		double rms_error = sqrt(variance_sum / rendered_pixels);
+		double mean = mean_sum / rendered_pixels;
+		std::clog << min_spp;
+		if (max_spp != min_spp)
+			std::clog << '-' << max_spp;
+		std::clog << " spp in " << render_time << " s, " << elapsed() << " s with output";
+		if (passes > 0)
+			std::clog << " (pass ~" << slowest * 1000 << " ms)";
+		std::clog << ". Predicted RMS error " << rms_error << " (" << 100 * rms_error / std::max(mean, 1e-12)
+			<< "% of mean luminance)\n";
+		if (unrendered > 0)
+			std::clog << "Out of time in the first pass: " << unrendered << " of " << tiles.size()
+				<< " tiles not rendered and left black.\n";
+		return !cancel && unrendered == 0;
+	}
+
+	// Like render, but for images too large to hold in memory: each finished tile
+	// is converted to 8 bit and handed to a tile_writer, which streams it into a
+	// binary PPM at path. Only the tiles in flight are ever held, so memory grows
+	// with thread count and tile_size, not with the image.
+	template <typename World>
+	bool render_to_file(const World& world, const char* path)
+	{
+		initialize();
+
+		auto tiles = tile_order();
+		tile_writer writer(path, image_width, image_height);
+
+		std::atomic<int> tiles_done{ 0 };
+		int tile_count = static_cast<int>(tiles.size());
+		double scale = 1.0 / samples_per_pixel;
+
+		parallel_for(tiles.size(), [&](size_t b, size_t e)
+			{
+				for (size_t t = b; t < e; t++)
+				{
+					if (cancel.load(std::memory_order_relaxed))
+						return;
+
+					const tile& tl = tiles[t];
+					tile_writer::tile_data data{ tl.x0, tl.y0, tl.x1 - tl.x0, tl.y1 - tl.y0, {} };
+					data.rgb.resize(static_cast<size_t>(data.width) * data.height * 3);
+
+					render_tile(world, tl, [&](int i, int j, const color& c) {
+						size_t k = (static_cast<size_t>(j - tl.y0) * data.width + (i - tl.x0)) * 3;
+						color_to_bytes(linear_to_gamma(c * scale, gamma), &data.rgb[k]);
+					});
+					writer.submit(std::move(data));
+
+					int done = ++tiles_done;
+					std::lock_guard<std::mutex> lock(progress_mutex);
+					if (progress)
+						progress(done, tile_count);
+					else
+						std::clog << "\rTiles remaining: " << (tile_count - done) << ' ' << std::flush;
+				}
+			}, 1);
+
+		bool written = writer.finish();
+		if (written)
+			std::clog << "\rWrote " << path << ", peak queued tile memory " << writer.peak_queued() / 1024 << " KiB\n";
+		else
+			std::cerr << "\rCould not write " << path << '\n';
+		write_cost_maps();
+
+		if (cancel)
+		{
+			std::clog << "Cancelled after " << tiles_done << " of " << tile_count << " tiles.\n";
+			return false;
+		}
+
+		return written;
+	}
+
+	// Renders only the tiles of cache that are not valid, recording for each the
+	// objects its rays touched and the voxels its first-bounce rays crossed, and
+	// writes the whole accumulated image. The first call, or one after the image
+	// size or sample count changed, renders all tiles. Use invalidate after
+	// editing an object; see render_cache for the rules.
+	template <typename World>
+	bool render_incremental(const World& world, render_cache& cache)
+	{
+		initialize();
+
+		if (!cache.matches(image_width, image_height, tile_size, samples_per_pixel))
+			cache.reset(image_width, image_height, tile_size, samples_per_pixel);
+
+		// With nothing to keep, the grid can follow the scene.
+		if (cache.invalid_count() == static_cast<int>(cache.tiles.size()))
+			cache.region = visible_region(world);
+
+		auto tiles = tile_order();
+		std::vector<tile> todo;
+		for (const auto& t : tiles)
+			if (!cache.at(t.x0 / tile_size, t.y0 / tile_size).valid)
+				todo.push_back(t);
+
+		std::atomic<int> tiles_done{ 0 };
+		int tile_count = static_cast<int>(todo.size());
+
+		parallel_for(todo.size(), [&](size_t b, size_t e)
+			{
+				for (size_t k = b; k < e; k++)
+				{
+					if (cancel.load(std::memory_order_relaxed))
+						return;
+
+					const tile& t = todo[k];
+					hit_tracker local{ &cache };
+					local.crossed.assign(render_cache::words, 0);
+					tracker = &local;
+					render_tile(world, t, [&](int i, int j, const color& c) {
+						cache.sum[static_cast<size_t>(j) * image_width + i] = c;
+					});
+					tracker = nullptr;
+
+					auto& record = cache.at(t.x0 / tile_size, t.y0 / tile_size);
+					render_cache::sort_unique(local.touched);
+					record.touched = std::move(local.touched);
+					record.crossed = std::move(local.crossed);
+					record.valid = true;
+
+					int done = ++tiles_done;
+					std::lock_guard<std::mutex> lock(progress_mutex);
+					cache.emitters.insert(cache.emitters.end(), local.emitters.begin(), local.emitters.end());
+					if (progress)
+						progress(done, tile_count);
+					else
+						std::clog << "\rTiles remaining: " << (tile_count - done) << ' ' << std::flush;
+				}
+			}, 1);
+
+		render_cache::sort_unique(cache.emitters);
+		write_image(std::cout, cache.sum, 1.0 / samples_per_pixel);
+		write_cost_maps();
+
+		std::clog << "\rRe-rendered " << tiles_done << " of " << tiles.size() << " tiles.\n";
+		return !cancel;
+	}
+
+	// Marks the tiles of cache that object, moved from old_box or otherwise edited,
+	// can have changed. Must follow a render_incremental with unchanged camera.
+	void invalidate(render_cache& cache, const hittable& object, const aabb& old_box) const
+	{
+		if (cache.tiles.empty())
+			return;
+
+		aabb new_box = object.bounding_box();
+		if (render_cache::contains(cache.emitters, &object) || !cache.covers(new_box))
+		{
+			cache.clear();
+			return;
+		}
+
+		for (auto& t : cache.tiles)
+			if (render_cache::contains(t.touched, &object) || cache.crossed(t, new_box))
+				t.valid = false;
+
+		invalidate_projection(cache, old_box);
+		invalidate_projection(cache, new_box);
+	}
+
+	// Renders samples_per_pixel passes of one sample per pixel and publishes the
+	// running mean to a memory-mapped preview file after each pass (see
+	// preview_buffer). A 1/preview_block resolution pass goes first so a viewer has
+	// a recognisable image almost at once. The final image goes to std::cout.
+	template <typename World>
+	bool render_progressive(const World& world, const char* preview_path)
+	{
+		initialize();
+
+		size_t pixels = static_cast<size_t>(image_width) * image_height;
+		std::vector<color> sum(pixels, color(0, 0, 0));
+		auto tiles = tile_order();
+		preview_buffer preview(preview_path, image_width, image_height);
+
+		auto start = std::chrono::steady_clock::now();
+		auto elapsed_ms = [&] {
+			return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		};
+
+		// Coarse pass, one path per block splatted over the whole block. It is only
+		// shown, never accumulated.
+		const int block = preview_block;
+		std::vector<color> coarse(pixels);
+		parallel_for((image_height + block - 1) / block, [&](size_t b, size_t e)
+			{
+				for (size_t by = b; by < e; by++)
+				{
+					for (int bx = 0; bx * block < image_width; bx++)
 					{
-						ray r = get_ray(i, j, i_s, j_s);
-						pixel_color += ray_color(r, max_depth, world);
+						int cx = std::min(bx * block + block / 2, image_width - 1);
+						int cy = std::min(static_cast<int>(by) * block + block / 2, image_height - 1);
+						color c = ray_color(get_ray(cx, cy, 0, 0), max_depth, world);
+
+						for (int y = static_cast<int>(by) * block; y < std::min((static_cast<int>(by) + 1) * block, image_height); y++)
+							for (int x = bx * block; x < std::min((bx + 1) * block, image_width); x++)
+								coarse[static_cast<size_t>(y) * image_width + x] = c;
 					}
 				}
+			}, 1);
+		preview.publish(coarse, 1.0, 0);
+		std::clog << "Preview pass: " << elapsed_ms() << " ms\n";
 
-				write_color(std::cout, linear_to_gamma(pixel_color / samples_per_pixel, gamma));
-			}
+		int pass = 0;
+		while (pass < samples_per_pixel && !cancel)
+		{
+			// Cycle through the sqrt_spp x sqrt_spp strata, one per pass.
+			int stratum = pass % (sqrt_spp * sqrt_spp);
+			int i_s = stratum % sqrt_spp, j_s = stratum / sqrt_spp;
+
+			parallel_for(tiles.size(), [&](size_t b, size_t e)
+				{
+					for (size_t t = b; t < e; t++)
+						for (int j = tiles[t].y0; j < tiles[t].y1; j++)
+							for (int i = tiles[t].x0; i < tiles[t].x1; i++)
+								sum[static_cast<size_t>(j) * image_width + i] += ray_color(get_ray(i, j, i_s, j_s), max_depth, world);
+				}, 1);
+
+			pass++;
+			preview.publish(sum, 1.0 / pass, pass);
+
+			std::lock_guard<std::mutex> lock(progress_mutex);
+			if (progress)
+				progress(pass, samples_per_pixel);
+			else
+				std::clog << "\rPass " << pass << " / " << samples_per_pixel << " (" << elapsed_ms() << " ms) " << std::flush;
 		}
 
-		std::clog << "\rDone.                 \n";
+		write_image(std::cout, sum, pass > 0 ? 1.0 / pass : 0);
+		std::clog << "\rDone after " << pass << " passes.                 \n";
+		return pass == samples_per_pixel;
+	}
+
+	// Renders with path guiding, see path_guide. Passes of 1, 2, 4, ... samples
+	// per pixel each sample what the passes before learned, record what their own
+	// paths carry and refine guide; the last pass takes the rest of
+	// samples_per_pixel and only samples. Every pass is unbiased, so all of them
+	// are averaged into the image written to std::cout.
+	template <typename World>
+	bool render_guided(const World& world, path_guide& g)
+	{
+		initialize();
+		guide = &g;
+
+		std::vector<color> sum(static_cast<size_t>(image_width) * image_height, color(0, 0, 0));
+		auto tiles = tile_order();
+		int strata = sqrt_spp * sqrt_spp;
+		auto start = std::chrono::steady_clock::now();
+
+		int done = 0;
+		for (int n = 1; done < samples_per_pixel && !cancel; n *= 2)
+		{
+			int remaining = samples_per_pixel - done;
+			int pass_samples = remaining - n < 2 * n ? remaining : n;
+			guide_recording = pass_samples < remaining;
+
+			parallel_for(tiles.size(), [&](size_t b, size_t e)
+				{
+					for (size_t t = b; t < e; t++)
+					{
+						if (cancel.load(std::memory_order_relaxed))
+							return;
+
+						for (int j = tiles[t].y0; j < tiles[t].y1; j++)
+						{
+							for (int i = tiles[t].x0; i < tiles[t].x1; i++)
+							{
+								color pixel_color(0, 0, 0);
+								for (int s = done; s < done + pass_samples; s++)
+									pixel_color += ray_color(get_ray(i, j, s % strata % sqrt_spp, s % strata / sqrt_spp), max_depth, world);
+								sum[static_cast<size_t>(j) * image_width + i] += pixel_color;
+							}
+						}
+					}
+				}, 1);
+
+			done += pass_samples;
+			if (guide_recording)
+				g.refine();
+
+			std::lock_guard<std::mutex> lock(progress_mutex);
+			if (progress)
+				progress(done, samples_per_pixel);
+			else
+				std::clog << "\rGuided pass " << g.iteration() << ": " << done << " / " << samples_per_pixel << " spp, "
+					<< g.leaf_count() << " spatial leaves, " << g.directional_node_count() << " directional nodes ("
+					<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s)\n";
+		}
+
+		guide = nullptr;
+		guide_recording = false;
+
+		write_image(std::cout, sum, 1.0 / std::max(done, 1));
+		return !cancel;
+	}
+
+	// Renders with a radiance cache (see radiance_cache): a prepass fills c with
+	// records at the points the first diffuse bounces reach, then paths end at
+	// their second lambertian hit wherever a record is valid there. Biased, but
+	// the smooth indirect light no longer costs a path per pixel sample.
+	template <typename World>
+	bool render_cached(const World& world, radiance_cache& c)
+	{
+		initialize();
+		build_radiance_cache(world, c);
+		if (cancel)
+			return false;
+
+		cached_radiance = &c;
+		std::vector<color> framebuffer;
+		bool finished = render_frame(world, framebuffer);
+		cached_radiance = nullptr;
+
+		write_image(std::cout, framebuffer, 1.0 / samples_per_pixel);
+		write_cost_maps();
+		return finished;
+	}
+
+	void write_image(std::ostream& out, const std::vector<color>& framebuffer, double scale) const
+	{
+		out << "P3\n";
+		write_raster(out, framebuffer, scale);
+	}
+
+	// Everything after the magic number, so header comments can go in between.
+	void write_raster(std::ostream& out, const std::vector<color>& framebuffer, double scale) const
+	{
+		TRACE_SCOPE("write image");
+		out << image_width << ' ' << image_height << "\n255\n";
+		for (const auto& c : framebuffer)
+			write_color(out, linear_to_gamma(c * scale, gamma));
 	}
 
 private:
+	std::mutex progress_mutex;
 	int image_height;
 	vec3 pixel_start_loc;
 	vec3 pixel_delta_u;
@@ -67,12 +625,320 @@ private:
 	vec3 defocus_disk_u, defocus_disk_v;
 	int sqrt_spp;
 	float recip_sqrt_spp;
+	double pixel_spread;
+
+	// Cone spread given to rays leaving a diffuse bounce. Those rays are incoherent,
+	// so coarse texture levels are both accurate enough and far kinder to the cache.
+	static constexpr double diffuse_spread = .1;
+
+	struct tile
+	{
+		int x0, y0, x1, y1;
+	};
+
+	// Objects hit by the rays of the tile being rendered, see render_incremental.
+	struct hit_tracker
+	{
+		const render_cache* cache;
+		std::vector<uint64_t> crossed; // Voxels of first-bounce rays, see render_cache::mark.
+		std::vector<const hittable*> touched; // Primary and first-bounce hits.
+		std::vector<const hittable*> emitters; // Emitters hit at any depth.
+	};
+
+	inline static thread_local hit_tracker* tracker = nullptr;
+
+	// Set by render_guided: the guide that non-specular bounces sample, and
+	// whether they also record into it.
+	path_guide* guide = nullptr;
+	bool guide_recording = false;
+
+	// Set by render_cached: lambertian hits after the first diffuse bounce
+	// take their incoming light from it where it has a valid record.
+	const radiance_cache* cached_radiance = nullptr;
+	inline static thread_local int diffuse_bounces = 0; // On the path being shaded.
+
+	// Set by render_tile while perf_profile is on and counter reads are fast
+	// enough to bracket every traversal.
+	inline static thread_local perf_profile::thread_record* profiler = nullptr;
+
+	void track(const hit_record& rec, int depth) const
+	{
+		if (depth >= max_depth - 1)
+			tracker->touched.push_back(rec.object);
+		if (rec.mat->kind() == material_kind::diffuse_light)
+			tracker->emitters.push_back(rec.object);
+	}
+
+	// Box around the surfaces primary rays through every fourth pixel hit, with a
+	// margin; the extent of render_cache's grid.
+	template <typename World>
+	aabb visible_region(const World& world) const
+	{
+		aabb box;
+		for (int j = 0; j < image_height; j += 4)
+		{
+			for (int i = 0; i < image_width; i += 4)
+			{
+				vec3 target = pixel_start_loc + i * pixel_delta_u + j * pixel_delta_v;
+				hit_record rec;
+				if (world.hit(ray(center, target - center), interval(ray_epsilon, infinity), rec))
+					box = aabb(box, aabb(rec.pos, rec.pos));
+			}
+		}
+
+		if (box.x.min > box.x.max)
+			return box;
+
+		double margin = .1 * (box.max() - box.min()).length() + 1e-3;
+		return aabb(box.x.expand(2 * margin), box.y.expand(2 * margin), box.z.expand(2 * margin));
+	}
+
+	// Invalidates the tiles the eight corners of box project onto, or all of them
+	// if the box reaches behind the camera.
+	void invalidate_projection(render_cache& cache, const aabb& box) const
+	{
+		double i0 = infinity, i1 = -infinity, j0 = infinity, j1 = -infinity;
+		for (int c = 0; c < 8; c++)
+		{
+			vec3 p(c & 1 ? box.x.max : box.x.min, c & 2 ? box.y.max : box.y.min, c & 4 ? box.z.max : box.z.min);
+			double depth = dot(center - p, w);
+			if (depth <= 1e-6)
+			{
+				cache.clear();
+				return;
+			}
+
+			vec3 on_plane = center + (p - center) * (focus_distance / depth) - pixel_start_loc;
+			double i = dot(on_plane, pixel_delta_u) / pixel_delta_u.length_squared();
+			double j = dot(on_plane, pixel_delta_v) / pixel_delta_v.length_squared();
+			i0 = fmin(i0, i), i1 = fmax(i1, i);
+			j0 = fmin(j0, j), j1 = fmax(j1, j);
+		}
+
+		if (i1 < -1 || j1 < -1 || i0 > image_width || j0 > image_height)
+			return;
+
+		// One pixel of slack for the jittered sample positions.
+		int tx0 = static_cast<int>(fmax(i0 - 1, 0)) / tile_size;
+		int ty0 = static_cast<int>(fmax(j0 - 1, 0)) / tile_size;
+		int tx1 = static_cast<int>(fmin(i1 + 1, image_width - 1)) / tile_size;
+		int ty1 = static_cast<int>(fmin(j1 + 1, image_height - 1)) / tile_size;
+
+		for (int ty = ty0; ty <= ty1; ty++)
+			for (int tx = tx0; tx <= tx1; tx++)
+				cache.at(tx, ty).valid = false;
+	}
+
+	// Tiles in Z-order, so tiles rendered at the same time by different threads
+	// are close on screen and share framebuffer and scene cache lines.
+	std::vector<tile> tile_order() const
+	{
+		int tiles_x = (image_width + tile_size - 1) / tile_size;
+		int tiles_y = (image_height + tile_size - 1) / tile_size;
+
+		std::vector<std::pair<uint32_t, tile>> keyed;
+		for (int ty = 0; ty < tiles_y; ty++)
+		{
+			for (int tx = 0; tx < tiles_x; tx++)
+			{
+				tile t = { tx * tile_size, ty * tile_size,
+					std::min((tx + 1) * tile_size, image_width), std::min((ty + 1) * tile_size, image_height) };
+				keyed.push_back({ morton_2d(tx, ty), t });
+			}
+		}
+
+		std::sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+		std::vector<tile> tiles;
+		for (const auto& k : keyed)
+			tiles.push_back(k.second);
+		return tiles;
+	}
+
+	cost_map costs; // Filled by render_tile while cost_map_prefix is set.
+
+	void write_cost_maps() const
+	{
+		if (!cost_map_prefix.empty())
+			costs.write(cost_map_prefix);
+	}
+
+	// Renders one tile and hands each pixel's sample sum to store(i, j, sum).
+	template <typename World, typename Store>
+	void render_tile(const World& world, const tile& t, Store&& store)
+	{
+		int tiles_x = (image_width + tile_size - 1) / tile_size;
+		TRACE_SCOPE("render tile", (t.y0 / tile_size) * tiles_x + t.x0 / tile_size);
+		perf_scope counted(perf_profile::render);
+		auto* record = counted.counting();
+		profiler = record && record->counters.fast() ? record : nullptr;
+
+		bool measure = !cost_map_prefix.empty();
+		for (int j = t.y0; j < t.y1; j++)
+		{
+			for (int i = t.x0; i < t.x1; i++)
+			{
+				ray_stats before = measure ? thread_ray_stats : ray_stats();
+				uint64_t begin_cycles = measure ? cycle_count() : 0;
+
+				// Stratified / Jittering the pixel randomnes.
+				color pixel_color(0, 0, 0);
+				for (int j_s = 0; j_s < sqrt_spp; j_s++)
+				{
+					for (int i_s = 0; i_s < sqrt_spp; i_s++)
+					{
+						ray r = get_ray(i, j, i_s, j_s);
+						pixel_color += ray_color(r, max_depth, world);
+					}
+				}
+
+				if (measure)
+				{
+					costs.set(static_cast<size_t>(j) * image_width + i, cycle_count() - begin_cycles,
+						thread_ray_stats.intersection_tests - before.intersection_tests,
+						thread_ray_stats.rays - before.rays, sqrt_spp * sqrt_spp);
+				}
+
+				store(i, j, pixel_color);
+			}
+		}
+
+		profiler = nullptr;
+	}
+
+	// Fills c where render_cached will look records up: at lambertian points
+	// one diffuse bounce past what the camera sees, from random pixels. Each
+	// round draws candidates in parallel and computes records for those no record
+	// covers yet, then inserts them, skipping any an earlier one of the same round
+	// now covers. Rounds grow with the cache. Building stops after a round in
+	// which at least c.coverage of the candidates were already covered, or once
+	// c holds max_records.
+	template <typename World>
+	void build_radiance_cache(const World& world, radiance_cache& c)
+	{
+		TRACE_SCOPE("radiance cache prepass");
+		auto start = std::chrono::steady_clock::now();
+
+		// Radiance along r and the distance to what it hits, infinity for nothing.
+		auto trace = [&](const ray& r, double& distance)
+		{
+			ray spread(r.origin(), r.direction(), diffuse_spread);
+			hit_record rec;
+			count_ray();
+			if (!find_hit(spread, rec, world))
+			{
+				distance = infinity;
+				return miss_color(spread);
+			}
+
+			distance = rec.t * spread.direction().length();
+			diffuse_bounces++;
+			color radiance = visit_material(*rec.mat, [&](const auto& mat) { return shade(mat, spread, rec, max_depth - 1, world); });
+			diffuse_bounces--;
+			return radiance;
+		};
+
+		// Records already inserted end the paths of later ones, as in render_cached.
+		// Lookups only run while nothing is inserted.
+		cached_radiance = &c;
+
+		size_t candidates = 0;
+		double covered_share = 0;
+		while (!cancel && c.size() < c.max_records)
+		{
+			size_t batch = std::max<size_t>(256, c.size());
+			std::vector<radiance_cache::record> records(batch);
+			std::vector<char> computed(batch, 0);
+			std::atomic<size_t> found{ 0 }, covered{ 0 };
+
+			parallel_for(batch, [&](size_t b, size_t e)
+				{
+					for (size_t k = b; k < e; k++)
+					{
+						vec3 pos, normal;
+						if (!cache_candidate(world, pos, normal))
+							continue;
+						found.fetch_add(1, std::memory_order_relaxed);
+
+						color v;
+						if (c.lookup(pos, normal, v))
+						{
+							covered.fetch_add(1, std::memory_order_relaxed);
+							continue;
+						}
+						records[k] = c.compute(pos, normal, trace);
+						computed[k] = 1;
+					}
+				}, 1);
+
+			for (size_t k = 0; k < batch && c.size() < c.max_records; k++)
+			{
+				color v;
+				if (computed[k] && !c.lookup(records[k].pos, records[k].normal, v))
+					c.insert(records[k]);
+			}
+
+			candidates += found;
+			covered_share = found > 0 ? double(covered) / found : 1;
+			if (covered_share >= c.coverage)
+				break;
+		}
+
+		std::clog << "Radiance cache: " << c.size() << " records from " << candidates << " candidates, last round "
+			<< static_cast<int>(100 * covered_share) << "% covered ("
+			<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s)\n";
+		cached_radiance = nullptr;
+	}
+
+	// A point render_cached may look up: the first lambertian surface after one
+	// diffuse bounce off what a random camera ray sees.
+	template <typename World>
+	bool cache_candidate(const World& world, vec3& pos, vec3& normal) const
+	{
+		int i = std::min(static_cast<int>(random_double() * image_width), image_width - 1);
+		int j = std::min(static_cast<int>(random_double() * image_height), image_height - 1);
+		ray r = get_ray(i, j, 0, 0), scattered;
+		hit_record rec;
+		color attenuation;
+		if (!first_non_specular_hit(r, world, rec) || !rec.mat->scatter(r, rec, attenuation, scattered))
+			return false;
+		if (!first_non_specular_hit(scattered, world, rec) || rec.mat->kind() != material_kind::lambertian)
+			return false;
+
+		pos = rec.pos;
+		normal = rec.normal;
+		return true;
+	}
+
+	// Follows r through specular bounces to the first surface that isn't
+	// specular; false if the path leaves the scene or ends at a light first.
+	template <typename World>
+	bool first_non_specular_hit(ray r, const World& world, hit_record& rec) const
+	{
+		for (int depth = 0; depth < max_depth; depth++)
+		{
+			if (!find_hit(r, rec, world))
+				return false;
+			if (!rec.mat->is_specular())
+				return true;
+
+			color attenuation;
+			ray scattered;
+			if (!rec.mat->scatter(r, rec, attenuation, scattered))
+				return false;
+			r = scattered;
+		}
+		return false;
+	}
 
 	void initialize()
 	{
 		image_height = static_cast<int>(image_width * 1 / aspect_ratio);
 		image_height = (image_height < 1) ? 1 : image_height;
 
+		if (!cost_map_prefix.empty())
+			costs.resize(image_width, image_height);
+
 		bool blur = defocus_angle <= 0;
 
 		center = look_from;
@@ -93,6 +959,7 @@ private:
 
 		pixel_delta_u = viewport_u / image_width;
 		pixel_delta_v = viewport_v / image_height;
+		pixel_spread = pixel_delta_u.length() / focus_distance;
 
 		auto viewport_upper_left = center - (focus_distance * w) - .5 * (viewport_u + viewport_v);
 		pixel_start_loc = viewport_upper_left + .5 * (pixel_delta_u + pixel_delta_v);
@@ -115,7 +982,7 @@ private:
 		auto pixel_sample = pixel_center + pixel_sample_square(i_s, j_s);
 
 		auto ray_direction = pixel_sample - center;
-		return ray(center, ray_direction);
+		return ray(center, ray_direction, pixel_spread);
 	}
 
 	vec3 defocus_disk_sample() const
@@ -132,30 +999,127 @@ private:
 		return (dx * pixel_delta_u) + (dy * pixel_delta_v);
 	}
 
-	color ray_color(const ray& r, int depth, const hittable& world) const
+	template <typename World>
+	bool find_hit(const ray& r, hit_record& rec, const World& world) const
+	{
+		if (!profiler)
+			return world.hit(r, interval(ray_epsilon, infinity), rec);
+
+		auto begin = profiler->counters.read();
+		bool hit = world.hit(r, interval(ray_epsilon, infinity), rec);
+		profiler->add(perf_profile::traversal, begin, profiler->counters.read());
+		return hit;
+	}
+
+	template <typename World>
+	color ray_color(const ray& r, int depth, const World& world) const
 	{
 		hit_record rec;
 
 		if (depth <= 0)
 			return color(0, 0, 0);
 
-		if (!world.hit(r, interval(0.001, infinity), rec))
-			return background;
+		count_ray();
+		bool hit = find_hit(r, rec, world);
+		if (tracker && depth == max_depth - 1)
+			tracker->cache->mark(tracker->crossed, r, hit ? rec.t : infinity);
+		if (!hit)
+			return miss_color(r);
+
+		if (tracker)
+			track(rec, depth);
+
+		return visit_material(*rec.mat, [&](const auto& mat) { return shade(mat, r, rec, depth, world); });
+	}
 
+	template <typename Material, typename World>
+	color shade(const Material& mat, const ray& r, const hit_record& rec, int depth, const World& world) const
+	{
 		ray scattered;
 		color attenuation;
-		color color_from_emission = rec.mat->emitted(0, 0, vec3(0, 0, 0));
+		color color_from_emission = mat.emitted(rec.u, rec.v, rec.pos);
+
+		if (!mat.scatter(r, rec, attenuation, scattered))
+			return color_from_emission;
+
+		if (mat.is_specular())
+		{
+			scattered = ray(scattered.origin(), scattered.direction(), r.spread());
+			return color_from_emission + attenuation * ray_color(scattered, depth - 1, world);
+		}
+
+		if (cached_radiance && diffuse_bounces > 0 && mat.kind() == material_kind::lambertian)
+		{
+			// The record holds the cosine-weighted mean radiance, so the albedo alone
+			// turns it into outgoing radiance.
+			color cached;
+			if (cached_radiance->lookup(rec.pos, rec.normal, cached))
+				return color_from_emission + attenuation * cached;
+		}
 
-		if (!rec.mat->scatter(r, rec, attenuation, scattered))
+		double pdf;
+		double weight = sample_non_specular(mat, r, rec, scattered, pdf);
+		if (weight <= 0)
 			return color_from_emission;
 
-		double scattering_pdf = rec.mat->scattering_pdf(r, rec, scattered);
-		double pdf = scattering_pdf;
+		diffuse_bounces++;
+		color incoming = ray_color(scattered, depth - 1, world);
+		diffuse_bounces--;
+		if (guide_recording)
+			guide->record(rec.pos, scattered.direction(), luminance(incoming) / pdf);
 
-		color color_from_scatter = 
-			(attenuation * scattering_pdf * ray_color(scattered, depth - 1, world)) / pdf;
+		return attenuation * weight * incoming + color_from_emission;
+	}
+
+	template <typename Material>
+	double sample_non_specular(const Material& mat, const ray& r, const hit_record& rec, ray& scattered) const
+	{
+		double pdf;
+		return sample_non_specular(mat, r, rec, scattered, pdf);
+	}
+
+	// Picks the continuation of a non-specular bounce and returns
+	// scattering_pdf / pdf for it, 0 when the path should stop. pdf is the
+	// density the direction was drawn with.
+	template <typename Material>
+	double sample_non_specular(const Material& mat, const ray& r, const hit_record& rec, ray& scattered, double& pdf) const
+	{
+		const path_guide::directional_tree* guiding = guide ? guide->sampling_tree(rec.pos) : nullptr;
+		int strategies = 1 + (environment != nullptr) + (guiding != nullptr);
+		if (strategies > 1)
+		{
+			// One-sample MIS: pick the BSDF, the environment map or the learned guide
+			// with equal probability and divide by the mixture density (balance heuristic).
+			int pick = static_cast<int>(random_double() * strategies);
+			if (pick == 1 && environment)
+			{
+				double light_pdf;
+				scattered = ray(rec.pos, environment->sample(light_pdf));
+			}
+			else if (pick > 0)
+			{
+				scattered = ray(rec.pos, guiding->sample());
+			}
 
-		return color_from_scatter + color_from_emission;
+			pdf = mat.scattering_pdf(r, rec, scattered);
+			if (environment)
+				pdf += environment->pdf(scattered.direction());
+			if (guiding)
+				pdf += guiding->pdf(scattered.direction());
+			pdf /= strategies;
+		}
+		else
+		{
+			pdf = mat.scattering_pdf(r, rec, scattered);
+		}
+
+		scattered = ray(scattered.origin(), scattered.direction(), diffuse_spread);
+		return pdf > 0 ? mat.scattering_pdf(r, rec, scattered) / pdf : 0;
+	}
+
+	color miss_color(const ray& r) const
+	{
+		return environment ? environment->value(r.direction()) : background;
 	}
 };
 
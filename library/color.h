@@ -3,6 +3,7 @@
 
 #include "vec3.h"
 
+#include <cstdint>
 #include <iostream>
 
 using color = vec3;
@@ -26,7 +27,7 @@ vec3 linear_to_gamma(const vec3& pixel_color, double gamma)
 				linear_to_gamma(pixel_color.z(), gamma));
 }
 
-void write_color(std::ostream& out, color pixel_color)
+void write_color(std::ostream& out, const color& pixel_color)
 {
 	double r = pixel_color.x(), g = pixel_color.y(), b = pixel_color.z();
 
@@ -37,4 +38,13 @@ void write_color(std::ostream& out, color pixel_color)
 		<< static_cast<int>(255.999 * intensity.clamp(b)) << '\n';
 }
 
+// Same mapping as write_color, into three bytes for binary formats.
+void color_to_bytes(const color& pixel_color, uint8_t* out)
+{
+	static const interval intensity(0, .999);
+	out[0] = static_cast<uint8_t>(255.999 * intensity.clamp(pixel_color.x()));
+	out[1] = static_cast<uint8_t>(255.999 * intensity.clamp(pixel_color.y()));
+	out[2] = static_cast<uint8_t>(255.999 * intensity.clamp(pixel_color.z()));
+}
+
 #endif
\ No newline at end of file
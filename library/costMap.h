@@ -0,0 +1,111 @@
+#ifndef COST_MAP_H
+#define COST_MAP_H
+
+#include "utility.h"
+
+#include "color.h"
+#include "rayStats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Per-pixel render cost: cycles spent on the pixel, intersection tests per
+// sample and path segments per sample. Written as false-colour heatmaps, black
+// through red to pale yellow, each scaled to its 99th percentile so a few
+// extreme pixels don't flatten the rest; the scale is printed alongside.
+struct cost_map
+{
+	int width = 0;
+	int height = 0;
+	std::vector<float> cycles, tests, depth;
+
+	// Keeps the contents while the size is unchanged, so a partial re-render
+	// (render_incremental) only replaces the pixels it renders.
+	void resize(int w, int h)
+	{
+		if (w == width && h == height)
+			return;
+
+		width = w;
+		height = h;
+		size_t pixels = static_cast<size_t>(w) * h;
+		cycles.assign(pixels, 0.0f);
+		tests.assign(pixels, 0.0f);
+		depth.assign(pixels, 0.0f);
+	}
+
+	void set(size_t p, uint64_t pixel_cycles, uint64_t pixel_tests, uint64_t pixel_rays, int samples)
+	{
+		cycles[p] = static_cast<float>(pixel_cycles);
+		tests[p] = static_cast<float>(pixel_tests) / samples;
+		depth[p] = static_cast<float>(pixel_rays) / samples;
+	}
+
+	// Writes <prefix>_cycles.ppm, and <prefix>_tests.ppm and <prefix>_depth.ppm
+	// when the ray counters are compiled in (RT_RAY_STATS).
+	bool write(const std::string& prefix) const
+	{
+		bool ok = write_map(prefix + "_cycles.ppm", "cycles per pixel", cycles);
+		if (!ray_stats_enabled)
+		{
+			std::clog << "cost_map: build with -DRT_RAY_STATS for the test and path length maps\n";
+			return ok;
+		}
+		ok = write_map(prefix + "_tests.ppm", "intersection tests per sample", tests) && ok;
+		return write_map(prefix + "_depth.ppm", "path segments per sample", depth) && ok;
+	}
+
+private:
+	bool write_map(const std::string& path, const char* label, const std::vector<float>& values) const
+	{
+		std::vector<float> sorted(values);
+		size_t rank = sorted.empty() ? 0 : (sorted.size() - 1) * 99 / 100;
+		std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+		double scale = sorted.empty() ? 0 : sorted[rank];
+		double sum = 0, peak = 0;
+		for (float v : values)
+		{
+			sum += v;
+			peak = std::max(peak, double(v));
+		}
+
+		std::vector<uint8_t> bytes(values.size() * 3);
+		for (size_t i = 0; i < values.size(); i++)
+			color_to_bytes(heat(scale > 0 ? values[i] / scale : 0), &bytes[3 * i]);
+
+		std::FILE* file = std::fopen(path.c_str(), "wb");
+		if (!file)
+		{
+			std::cerr << "cost_map: could not write " << path << '\n';
+			return false;
+		}
+
+		std::fprintf(file, "P6\n%d %d\n255\n", width, height);
+		bool ok = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+		ok = std::fclose(file) == 0 && ok;
+
+		std::clog << "Wrote " << path << ": " << label << ", mean " << sum / std::max<size_t>(values.size(), 1)
+			<< ", full scale " << scale << ", max " << peak << '\n';
+		return ok;
+	}
+
+	// Piecewise linear ramp over [0, 1], clamped.
+	static color heat(double x)
+	{
+		static const color stops[] = {
+			color(0, 0, 0), color(.33, .06, .43), color(.87, .32, .23), color(.99, .8, .15), color(1, 1, .85)
+		};
+		const int last = sizeof(stops) / sizeof(stops[0]) - 1;
+
+		x = std::clamp(x, 0.0, 1.0) * last;
+		int k = std::min(static_cast<int>(x), last - 1);
+		double s = x - k;
+		return stops[k] * (1 - s) + stops[k + 1] * s;
+	}
+};
+
+#endif
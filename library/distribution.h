@@ -0,0 +1,118 @@
+#ifndef DISTRIBUTION_H
+#define DISTRIBUTION_H
+
+#include "utility.h"
+
+#include <algorithm>
+#include <vector>
+
+// Piecewise-constant 1D distribution over [0, 1). Sampling inverts the CDF
+// with a binary search, O(log n).
+class distribution_1d
+{
+public:
+	distribution_1d(const double* f, int n) : func(f, f + n), cdf(n + 1)
+	{
+		cdf[0] = 0;
+		for (int i = 1; i < n + 1; i++)
+			cdf[i] = cdf[i - 1] + func[i - 1] / n;
+
+		func_int = cdf[n];
+		for (int i = 1; i < n + 1; i++)
+			cdf[i] = func_int == 0 ? static_cast<double>(i) / n : cdf[i] / func_int;
+	}
+
+	int count() const { return static_cast<int>(func.size()); }
+	double integral() const { return func_int; }
+
+	// Returns x in [0, 1) and its density; offset receives the chosen segment.
+	double sample_continuous(double u, double& pdf, int* offset = nullptr) const
+	{
+		int i = find_segment(u);
+		if (offset)
+			*offset = i;
+
+		double du = u - cdf[i];
+		if (cdf[i + 1] - cdf[i] > 0)
+			du /= cdf[i + 1] - cdf[i];
+
+		pdf = func_int > 0 ? func[i] / func_int : 1;
+		return (i + du) / count();
+	}
+
+	int sample_discrete(double u, double* pdf = nullptr) const
+	{
+		int i = find_segment(u);
+		if (pdf)
+			*pdf = discrete_pdf(i);
+		return i;
+	}
+
+	double discrete_pdf(int i) const
+	{
+		return func_int > 0 ? func[i] / (func_int * count()) : 1.0 / count();
+	}
+
+	double pdf(double x) const
+	{
+		int i = std::clamp(static_cast<int>(x * count()), 0, count() - 1);
+		return func_int > 0 ? func[i] / func_int : 1;
+	}
+
+private:
+	std::vector<double> func;
+	std::vector<double> cdf;
+	double func_int;
+
+	int find_segment(double u) const
+	{
+		// Last cdf entry that is <= u.
+		auto it = std::upper_bound(cdf.begin(), cdf.end(), u);
+		int i = static_cast<int>(it - cdf.begin()) - 1;
+		return std::clamp(i, 0, count() - 1);
+	}
+};
+
+// Piecewise-constant 2D distribution over [0, 1)^2, f given row-major with nu
+// columns and nv rows. Samples v from the marginal, then u from that row.
+class distribution_2d
+{
+public:
+	distribution_2d(const double* f, int nu, int nv)
+	{
+		conditional.reserve(nv);
+		for (int v = 0; v < nv; v++)
+			conditional.emplace_back(f + static_cast<size_t>(v) * nu, nu);
+
+		std::vector<double> row_integrals(nv);
+		for (int v = 0; v < nv; v++)
+			row_integrals[v] = conditional[v].integral();
+		marginal = std::make_unique<distribution_1d>(row_integrals.data(), nv);
+	}
+
+	void sample_continuous(double u0, double u1, double& u, double& v, double& pdf) const
+	{
+		double pdfs[2];
+		int row;
+		v = marginal->sample_continuous(u1, pdfs[1], &row);
+		u = conditional[row].sample_continuous(u0, pdfs[0]);
+		pdf = pdfs[0] * pdfs[1];
+	}
+
+	double pdf(double u, double v) const
+	{
+		int nu = conditional[0].count();
+		int nv = marginal->count();
+		int iu = std::clamp(static_cast<int>(u * nu), 0, nu - 1);
+		int iv = std::clamp(static_cast<int>(v * nv), 0, nv - 1);
+		if (marginal->integral() == 0)
+			return 1;
+		return conditional[iv].pdf((iu + .5) / nu) * conditional[iv].integral() / marginal->integral();
+	}
+
+private:
+	std::vector<distribution_1d> conditional;
+	std::unique_ptr<distribution_1d> marginal;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "utility.h"
+
+#include "color.h"
+#include "distribution.h"
+#include "image.h"
+
+#include <vector>
+
+// Infinitely distant light from an equirectangular HDR map (+y up). Directions
+// are importance-sampled proportional to luminance * sin(theta) so the bright
+// parts of the map (sun, windows) get the samples.
+class environment_light
+{
+public:
+	environment_light(image_data img, double _intensity = 1.0)
+		: map(std::move(img)), intensity(_intensity)
+	{
+		std::vector<double> weights(static_cast<size_t>(map.width) * map.height);
+		for (int y = 0; y < map.height; y++)
+		{
+			double sin_theta = sin(pi * (y + .5) / map.height);
+			for (int x = 0; x < map.width; x++)
+				weights[static_cast<size_t>(y) * map.width + x] = luminance(map.at(x, y)) * sin_theta;
+		}
+
+		dist = std::make_unique<distribution_2d>(weights.data(), map.width, map.height);
+	}
+
+	color value(const vec3& direction) const
+	{
+		double u, v;
+		direction_to_uv(normalize(direction), u, v);
+
+		int x = std::clamp(static_cast<int>(u * map.width), 0, map.width - 1);
+		int y = std::clamp(static_cast<int>(v * map.height), 0, map.height - 1);
+		return intensity * map.at(x, y);
+	}
+
+	// Samples a unit direction, pdf is with respect to solid angle.
+	vec3 sample(double& pdf) const
+	{
+		double u, v, map_pdf;
+		dist->sample_continuous(random_double(), random_double(), u, v, map_pdf);
+
+		double theta = v * pi;
+		double phi = u * 2 * pi;
+		double sin_theta = sin(theta);
+
+		pdf = sin_theta > 0 ? map_pdf / (2 * pi * pi * sin_theta) : 0;
+		return vec3(sin_theta * cos(phi), cos(theta), -sin_theta * sin(phi));
+	}
+
+	double pdf(const vec3& direction) const
+	{
+		double u, v;
+		direction_to_uv(normalize(direction), u, v);
+
+		double sin_theta = sin(v * pi);
+		return sin_theta > 0 ? dist->pdf(u, v) / (2 * pi * pi * sin_theta) : 0;
+	}
+
+private:
+	image_data map;
+	double intensity;
+	std::unique_ptr<distribution_2d> dist;
+
+	static void direction_to_uv(const vec3& d, double& u, double& v)
+	{
+		double theta = acos(std::clamp(static_cast<double>(d.y()), -1.0, 1.0));
+		double phi = atan2(-d.z(), d.x());
+		if (phi < 0)
+			phi += 2 * pi;
+
+		u = phi / (2 * pi);
+		v = theta / pi;
+	}
+};
+
+#endif
@@ -1,18 +1,23 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
+#include "aabb.h"
 #include "ray.h"
 #include "utility.h"
 
 class material;
+class hittable;
 
 struct hit_record
 {
 public:
 	vec3 pos;
 	vec3 normal;
-	shared_ptr<material> mat;
+	const material* mat; // Owned by the primitive, a raw pointer keeps refcounts off the hot path.
+	const hittable* object; // Primitive that was hit.
 	double t;
+	double u, v;
+	double uv_width = 0; // Footprint of the ray cone in uv space, drives mip selection.
 	bool front_face;
 
 	void set_normal(const ray& r, const vec3& outward_normal)
@@ -31,6 +36,22 @@ public:
 	virtual ~hittable() = default;
 
 	virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
+
+	// Any-hit query for shadow and visibility rays: true if anything is hit within
+	// ray_t. Implementations return at the first hit and skip the hit record.
+	virtual bool occluded(const ray& r, interval ray_t) const
+	{
+		hit_record rec;
+		return hit(r, ray_t, rec);
+	}
+
+	virtual aabb bounding_box() const = 0;
+
+	// Surface area and a point drawn uniformly over it, with the outward normal,
+	// uv, material and object filled in, for integrators that start paths on
+	// emitters (see light_list). Primitives that can't be sampled keep area 0.
+	virtual double area() const { return 0; }
+	virtual void sample_surface(hit_record&) const {}
 };
 
 #endif
\ No newline at end of file
@@ -21,6 +21,7 @@ public:
 	void add(shared_ptr<hittable> object)
 	{
 		objects.push_back(object);
+		bbox = aabb(bbox, object->bounding_box());
 	}
 
 	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
@@ -41,6 +42,20 @@ public:
 
 		return hit_anything;
 	}
+
+	bool occluded(const ray& r, interval ray_t) const override
+	{
+		for (const auto& object : objects)
+			if (object->occluded(r, ray_t))
+				return true;
+
+		return false;
+	}
+
+	aabb bounding_box() const override { return bbox; }
+
+private:
+	aabb bbox;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,165 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "utility.h"
+
+#include "color.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Linear RGB float image, rows stored top to bottom.
+struct image_data
+{
+	int width = 0;
+	int height = 0;
+	std::vector<float> pixels;
+
+	void resize(int w, int h)
+	{
+		width = w;
+		height = h;
+		pixels.assign(static_cast<size_t>(w) * h * 3, 0.0f);
+	}
+
+	color at(int x, int y) const
+	{
+		const float* p = &pixels[(static_cast<size_t>(y) * width + x) * 3];
+		return color(p[0], p[1], p[2]);
+	}
+
+	void set(int x, int y, const color& c)
+	{
+		float* p = &pixels[(static_cast<size_t>(y) * width + x) * 3];
+		p[0] = static_cast<float>(c.x());
+		p[1] = static_cast<float>(c.y());
+		p[2] = static_cast<float>(c.z());
+	}
+};
+
+inline double luminance(const color& c)
+{
+	return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+// Portable Float Map. "PF" is RGB and "Pf" greyscale; a negative scale marks
+// little-endian data and scanlines are stored bottom to top.
+inline bool load_pfm(const char* filename, image_data& img)
+{
+	std::ifstream in(filename, std::ios::binary);
+	if (!in)
+		return false;
+
+	std::string magic;
+	int w = 0, h = 0;
+	double scale = 0;
+	in >> magic >> w >> h >> scale;
+	in.get(); // Single whitespace before the raster.
+
+	if (!in || (magic != "PF" && magic != "Pf") || w <= 0 || h <= 0)
+	{
+		std::cerr << "load_pfm: bad header in " << filename << '\n';
+		return false;
+	}
+
+	int channels = magic == "PF" ? 3 : 1;
+	std::vector<float> raw(static_cast<size_t>(w) * h * channels);
+	in.read(reinterpret_cast<char*>(raw.data()), raw.size() * sizeof(float));
+	if (!in)
+	{
+		std::cerr << "load_pfm: truncated raster in " << filename << '\n';
+		return false;
+	}
+
+	const uint16_t probe = 1;
+	bool host_little = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+	if ((scale < 0) != host_little)
+	{
+		for (auto& f : raw)
+		{
+			uint8_t b[4];
+			std::memcpy(b, &f, 4);
+			std::swap(b[0], b[3]);
+			std::swap(b[1], b[2]);
+			std::memcpy(&f, b, 4);
+		}
+	}
+
+	img.resize(w, h);
+	for (int y = 0; y < h; y++)
+	{
+		const float* row = &raw[static_cast<size_t>(h - 1 - y) * w * channels];
+		for (int x = 0; x < w; x++)
+		{
+			const float* p = row + x * channels;
+			img.set(x, y, channels == 3 ? color(p[0], p[1], p[2]) : color(p[0], p[0], p[0]));
+		}
+	}
+
+	return true;
+}
+
+// Binary (P6) or ASCII (P3) 8-bit PPM. Values are assumed sRGB-ish and
+// converted to linear with a 2.2 gamma.
+inline bool load_ppm(const char* filename, image_data& img)
+{
+	std::ifstream in(filename, std::ios::binary);
+	if (!in)
+		return false;
+
+	std::string magic;
+	int w = 0, h = 0, maxval = 0;
+	in >> magic >> w >> h >> maxval;
+	in.get();
+
+	if (!in || (magic != "P6" && magic != "P3") || w <= 0 || h <= 0 || maxval <= 0 || maxval > 255)
+	{
+		std::cerr << "load_ppm: bad header in " << filename << '\n';
+		return false;
+	}
+
+	std::vector<uint8_t> raw(static_cast<size_t>(w) * h * 3);
+	if (magic == "P6")
+	{
+		in.read(reinterpret_cast<char*>(raw.data()), raw.size());
+	}
+	else
+	{
+		for (auto& b : raw)
+		{
+			int x;
+			in >> x;
+			b = static_cast<uint8_t>(x);
+		}
+	}
+
+	if (!in)
+	{
+		std::cerr << "load_ppm: truncated raster in " << filename << '\n';
+		return false;
+	}
+
+	img.resize(w, h);
+	for (size_t i = 0; i < raw.size(); i++)
+		img.pixels[i] = static_cast<float>(pow(raw[i] / static_cast<double>(maxval), 2.2));
+
+	return true;
+}
+
+inline bool load_image(const char* filename, image_data& img)
+{
+	std::ifstream in(filename, std::ios::binary);
+	char magic[2] = { 0, 0 };
+	if (!in.read(magic, 2))
+		return false;
+
+	if (magic[0] == 'P' && (magic[1] == 'F' || magic[1] == 'f'))
+		return load_pfm(filename, img);
+	return load_ppm(filename, img);
+}
+
+#endif
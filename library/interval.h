@@ -11,6 +11,21 @@ public:
 
 	interval(double _min, double _max) : max(_max), min(_min) {}
 
+	// Tightly encloses both intervals.
+	interval(const interval& a, const interval& b)
+		: min(a.min <= b.min ? a.min : b.min), max(a.max >= b.max ? a.max : b.max) {}
+
+	double size() const
+	{
+		return max - min;
+	}
+
+	interval expand(double delta) const
+	{
+		auto padding = delta / 2;
+		return interval(min - padding, max + padding);
+	}
+
 	bool contains(double x) const
 	{
 		return min <= x && x <= max;
@@ -0,0 +1,87 @@
+#ifndef LIGHT_LIST_H
+#define LIGHT_LIST_H
+
+#include "utility.h"
+
+#include "color.h"
+#include "distribution.h"
+#include "hittableList.h"
+#include "image.h"
+#include "material.h"
+
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// The emitters of a scene, for integrators that start paths on lights or
+// sample them directly: the primitives with a diffuse_light material that can
+// be sampled (area() > 0). An emitter is picked in proportion to its power,
+// estimated from its area and its emission at one point, then a point on it
+// uniformly by area. Like diffuse_light, emitters shine from both sides.
+class light_list
+{
+public:
+	struct point
+	{
+		hit_record rec; // Normal outward.
+		color emission;
+		double pdf;     // Per unit area, the choice of emitter included.
+	};
+
+	light_list(const hittable_list& world)
+	{
+		std::vector<double> power;
+		for (const auto& object : world.objects)
+		{
+			double a = object->area();
+			if (a <= 0)
+				continue;
+
+			hit_record rec;
+			object->sample_surface(rec);
+			if (rec.mat->kind() != material_kind::diffuse_light)
+				continue;
+
+			index[object.get()] = static_cast<int>(lights.size());
+			lights.push_back(object.get());
+			areas.push_back(a);
+
+			// Floored so an emitter dark where it was probed can still be picked.
+			power.push_back(a * std::max(luminance(rec.mat->emitted(rec.u, rec.v, rec.pos)), 1e-3));
+		}
+
+		if (!lights.empty())
+			dist = std::make_unique<distribution_1d>(power.data(), static_cast<int>(power.size()));
+	}
+
+	bool empty() const { return lights.empty(); }
+	size_t size() const { return lights.size(); }
+
+	point sample() const
+	{
+		double pick_pdf;
+		int i = dist->sample_discrete(random_double(), &pick_pdf);
+
+		point p;
+		lights[i]->sample_surface(p.rec);
+		p.emission = p.rec.mat->emitted(p.rec.u, p.rec.v, p.rec.pos);
+		p.pdf = pick_pdf / areas[i];
+		return p;
+	}
+
+	// Area density of sample() on object, 0 if it isn't one of the emitters.
+	double pdf(const hittable* object) const
+	{
+		auto it = index.find(object);
+		return it == index.end() ? 0 : dist->discrete_pdf(it->second) / areas[it->second];
+	}
+
+private:
+	std::vector<const hittable*> lights;
+	std::vector<double> areas;
+	std::unordered_map<const hittable*, int> index;
+	std::unique_ptr<distribution_1d> dist;
+};
+
+#endif
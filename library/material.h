@@ -3,13 +3,30 @@
 
 #include "utility.h"
 
+#include "texture.h"
+
 class hit_record;
 
+// Closed set of built-in materials. Hot loops can switch on the tag and call the
+// concrete (final) class directly instead of going through the vtable, see
+// visit_material. User materials keep working through the virtual interface.
+enum class material_kind
+{
+	other,
+	lambertian,
+	metal,
+	dielectric,
+	diffuse_light
+};
+
 class material
 {
 public:
+	material(material_kind k = material_kind::other) : tag(k) {}
 	virtual ~material() = default;
 
+	material_kind kind() const { return tag; }
+
 	virtual color emitted(double u, double v, const vec3& p) const
 	{
 		return color(0, 0, 0);
@@ -21,12 +38,39 @@ public:
 	{
 		return 0;
 	}
+
+	// BSDF times the cosine at the surface for light leaving along scattered
+	// after arriving along r_in, the factor scatter's attenuation * scattering_pdf
+	// stands for. Lets a path be connected to a point it didn't sample.
+	virtual color eval(const ray& r_in, const hit_record& rec, const ray& scattered) const
+	{
+		return color(0, 0, 0);
+	}
+
+	// Density with which scatter would have sent r_in back the way it came had it
+	// arrived along scattered reversed: scattering_pdf of the same bounce traced
+	// in the other direction, for weighting paths built from both ends.
+	virtual double reverse_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
+	{
+		return scattering_pdf(ray(rec.pos - scattered.direction(), -scattered.direction()), rec, ray(rec.pos, -r_in.direction()));
+	}
+
+	// Specular materials pick their scattered direction from a delta distribution,
+	// so they have no scattering_pdf and can't be combined with light sampling.
+	virtual bool is_specular() const
+	{
+		return true;
+	}
+
+private:
+	material_kind tag;
 };
 
-class lambertian : public material
+class lambertian final : public material
 {
 public:
-	lambertian(const color& a) : albedo(a) {}
+	lambertian(const color& a) : material(material_kind::lambertian), albedo(make_shared<solid_color>(a)) {}
+	lambertian(shared_ptr<texture> a) : material(material_kind::lambertian), albedo(a) {}
 
 	bool scatter(
 		const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
@@ -36,25 +80,35 @@ public:
 			scattered_dir = rec.normal;
 
 		scattered = ray(rec.pos, scattered_dir);
-		attenuation = albedo;
+		attenuation = albedo->value(rec.u, rec.v, rec.pos, rec.uv_width);
 
 		return true;
 	}
 
-	double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
+	double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override
 	{
 		auto cos_theta = dot(rec.normal, normalize(scattered.direction()));
 		return cos_theta < 0 ? 0 : cos_theta / pi;
 	}
 
+	color eval(const ray& r_in, const hit_record& rec, const ray& scattered) const override
+	{
+		return albedo->value(rec.u, rec.v, rec.pos, rec.uv_width) * scattering_pdf(r_in, rec, scattered);
+	}
+
+	bool is_specular() const override
+	{
+		return false;
+	}
+
 private:
-	color albedo;
+	shared_ptr<texture> albedo;
 };
 
-class metal : public material
+class metal final : public material
 {
 public:
-	metal(const color& a, double _fuzz) : albedo(a), fuzz(_fuzz < 1 ? _fuzz : 1) {}
+	metal(const color& a, double _fuzz) : material(material_kind::metal), albedo(a), fuzz(_fuzz < 1 ? _fuzz : 1) {}
 
 	bool scatter(
 		const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
@@ -72,10 +126,10 @@ private:
 	double fuzz;
 };
 
-class dielectric : public material
+class dielectric final : public material
 {
 public:
-	dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+	dielectric(double index_of_refraction) : material(material_kind::dielectric), ir(index_of_refraction) {}
 
 	bool scatter(
 		const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
@@ -114,12 +168,11 @@ private:
 	}
 };
 
-class diffuse_light : public material
+class diffuse_light final : public material
 {
 public:
-	diffuse_light(const color& a) : emit(a) {}
-
-	// TODO add for texture
+	diffuse_light(const color& a) : material(material_kind::diffuse_light), emit(make_shared<solid_color>(a)) {}
+	diffuse_light(shared_ptr<texture> a) : material(material_kind::diffuse_light), emit(a) {}
 
 	bool scatter(const ray& r_in, const hit_record& rec, color& atenuation, ray& scatter) const override
 	{
@@ -128,11 +181,26 @@ public:
 
 	color emitted(double u, double v, const vec3& p) const override
 	{
-		return emit;
+		return emit->value(u, v, p);
 	}
 
 private:
-	color emit;
+	shared_ptr<texture> emit;
 };
 
+// Calls f with m downcast to its concrete built-in type so that f's calls can be
+// inlined, or with the base class for user-defined materials.
+template <typename F>
+inline decltype(auto) visit_material(const material& m, F&& f)
+{
+	switch (m.kind())
+	{
+	case material_kind::lambertian: return f(static_cast<const lambertian&>(m));
+	case material_kind::metal: return f(static_cast<const metal&>(m));
+	case material_kind::dielectric: return f(static_cast<const dielectric&>(m));
+	case material_kind::diffuse_light: return f(static_cast<const diffuse_light&>(m));
+	default: return f(m);
+	}
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,294 @@
+#ifndef METROPOLIS_H
+#define METROPOLIS_H
+
+#include "utility.h"
+
+#include "camera.h"
+#include "color.h"
+#include "distribution.h"
+#include "image.h"
+#include "parallel.h"
+#include "splatBuffer.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+// Primary sample space Metropolis light transport (Kelemen et al., "A Simple
+// and Robust Mutation Strategy for the Metropolis Light Transport Algorithm";
+// the structure follows pbrt-v3's MLTIntegrator). A path is a function of the
+// random numbers it consumes, the first two placing it on the image and the
+// rest going to camera::ray_color through random_double. Markov chains walk
+// over those number vectors with two mutations: a large step draws all of them
+// afresh, a small step moves each by a narrow normal perturbation, so a chain
+// that found a hard path (a caustic through a dielectric) keeps exploring its
+// neighbourhood. Proposals are accepted by the ratio of the paths' luminance.
+//
+// The chains only see relative brightness, so a bootstrap phase of independent
+// paths estimates the image's mean luminance b, which scales the result, and
+// picks the chains' starting paths in proportion to their luminance. Every
+// mutation splats both the proposed and the current path, weighted by the
+// acceptance probability, into a shared splat_buffer.
+class metropolis_integrator
+{
+public:
+	int bootstrap_samples = 100000;
+	int chain_count = 1000;
+	double large_step_probability = .3;
+	double sigma = .01; // Of the small steps' perturbation.
+
+	metropolis_integrator(camera& _cam) : cam(_cam) {}
+
+	// Takes samples_per_pixel mutations per pixel in total and writes the image to
+	// std::cout like camera::render; false if cancelled.
+	template <typename World>
+	bool render(const World& world)
+	{
+		cam.initialize();
+
+		int width = cam.image_width, height = cam.image_height;
+		size_t pixels = static_cast<size_t>(width) * height;
+
+		std::vector<double> weights(bootstrap_samples);
+		{
+			TRACE_SCOPE("metropolis bootstrap");
+			parallel_for(weights.size(), [&](size_t begin, size_t end)
+				{
+					for (size_t k = begin; k < end; k++)
+					{
+						primary_sampler sampler(k, sigma, large_step_probability);
+						int pixel;
+						weights[k] = luminance(path(world, sampler, pixel));
+					}
+				});
+		}
+
+		double b = 0;
+		for (double w : weights)
+			b += w;
+		b /= std::max<size_t>(weights.size(), 1);
+
+		std::vector<color> framebuffer(pixels, color(0, 0, 0));
+		if (b <= 0)
+		{
+			std::clog << "Metropolis: no bootstrap path carried light.\n";
+			cam.write_image(std::cout, framebuffer, 1);
+			return true;
+		}
+
+		distribution_1d starts(weights.data(), static_cast<int>(weights.size()));
+		splat_buffer splats(width, height);
+
+		uint64_t total = static_cast<uint64_t>(cam.samples_per_pixel) * pixels;
+		std::atomic<uint64_t> accepted{ 0 };
+		std::atomic<int> chains_done{ 0 };
+
+		parallel_for(chain_count, [&](size_t begin, size_t end)
+			{
+				for (size_t c = begin; c < end; c++)
+				{
+					if (cam.cancel.load(std::memory_order_relaxed))
+						return;
+
+					TRACE_SCOPE("metropolis chain", static_cast<int64_t>(c));
+					uint64_t mutations = total / chain_count + (c < total % chain_count);
+					accepted += run_chain(world, c, mutations, starts, splats);
+
+					int done = ++chains_done;
+					std::lock_guard<std::mutex> lock(cam.progress_mutex);
+					if (cam.progress)
+						cam.progress(done, chain_count);
+					else
+						std::clog << "\rChains remaining: " << (chain_count - done) << ' ' << std::flush;
+				}
+			}, 1);
+
+		if (cam.cancel)
+		{
+			std::clog << "\rCancelled after " << chains_done << " of " << chain_count << " chains.\n";
+			return false;
+		}
+
+		std::clog << "\rDone, mean luminance " << b << ", " << 100.0 * accepted / std::max<uint64_t>(total, 1)
+			<< "% of mutations accepted.\n";
+
+		// Every mutation splats a total weight of 1; b turns that into radiance.
+		splats.add_to(framebuffer, b * pixels / std::max<uint64_t>(total, 1));
+		cam.write_image(std::cout, framebuffer, 1);
+		return true;
+	}
+
+private:
+	// The vector of numbers a path consumes, created as the path asks for them.
+	// Each value remembers the iteration it was last changed in, so a small step
+	// applied to a value unused for n iterations moves it as n steps would have,
+	// and values not touched since the last accepted large step are drawn anew.
+	class primary_sampler : public random_source
+	{
+	public:
+		primary_sampler(uint64_t seed, double _sigma, double _large_step_probability)
+			: state(0x9E3779B97F4A7C15ull * (seed + 1) ^ 0xD1B54A32D192ED03ull), sigma(_sigma),
+			large_step_probability(_large_step_probability)
+		{
+		}
+
+		void start_iteration()
+		{
+			iteration++;
+			large_step = next_random(state) < large_step_probability;
+			index = 0;
+		}
+
+		void accept()
+		{
+			if (large_step)
+				last_large_step = iteration;
+		}
+
+		// Puts back every value the rejected iteration changed.
+		void reject()
+		{
+			for (auto& x : values)
+			{
+				if (x.modified == iteration)
+				{
+					x.value = x.backup;
+					x.modified = x.modified_backup;
+				}
+			}
+			iteration--;
+		}
+
+		// Starts the path over without mutating, for replaying it.
+		void restart() { index = 0; }
+
+		double next() override
+		{
+			if (index >= values.size())
+				values.push_back({});
+			value& x = values[index++];
+
+			if (x.modified < last_large_step)
+			{
+				x.value = next_random(state);
+				x.modified = last_large_step;
+			}
+
+			x.backup = x.value;
+			x.modified_backup = x.modified;
+			if (large_step)
+			{
+				x.value = next_random(state);
+			}
+			else if (x.modified < iteration)
+			{
+				double n = static_cast<double>(iteration - x.modified);
+				x.value += normal() * sigma * std::sqrt(n);
+				x.value -= std::floor(x.value);
+			}
+			x.modified = iteration;
+			return x.value;
+		}
+
+	private:
+		struct value
+		{
+			double value = 0, backup = 0;
+			int64_t modified = -1, modified_backup = -1; // -1: never drawn, so it is drawn on first use.
+		};
+
+		uint64_t state;
+		double sigma, large_step_probability;
+		std::vector<value> values;
+		size_t index = 0;
+		int64_t iteration = 0, last_large_step = 0;
+		bool large_step = true;
+
+		// Box-Muller.
+		double normal()
+		{
+			double u1 = 1 - next_random(state), u2 = next_random(state);
+			return std::sqrt(-2 * std::log(u1)) * std::cos(2 * pi * u2);
+		}
+	};
+
+	camera& cam;
+
+	// Runs chain c for mutations steps from a bootstrap path chosen by
+	// luminance; returns the number of accepted proposals.
+	template <typename World>
+	uint64_t run_chain(const World& world, size_t c, uint64_t mutations, const distribution_1d& starts, splat_buffer& splats) const
+	{
+		seed_random(0xA24BAED4963EE407ull * (c + 1));
+		int start = starts.sample_discrete(random_uniform());
+
+		// Replays the bootstrap path: a fresh sampler with its seed draws the same numbers.
+		primary_sampler sampler(start, sigma, large_step_probability);
+		int current_pixel;
+		color current = path(world, sampler, current_pixel);
+		double current_luminance = luminance(current);
+
+		uint64_t accepted = 0;
+		for (uint64_t m = 0; m < mutations; m++)
+		{
+			sampler.start_iteration();
+			int proposed_pixel;
+			color proposed = path(world, sampler, proposed_pixel);
+			double proposed_luminance = luminance(proposed);
+
+			double accept = std::min(1.0, proposed_luminance / current_luminance);
+			if (accept > 0)
+				splat(splats, proposed_pixel, proposed * (accept / proposed_luminance));
+			splat(splats, current_pixel, current * ((1 - accept) / current_luminance));
+
+			if (random_uniform() < accept)
+			{
+				current = proposed;
+				current_luminance = proposed_luminance;
+				current_pixel = proposed_pixel;
+				sampler.accept();
+				accepted++;
+			}
+			else
+			{
+				sampler.reject();
+			}
+		}
+		return accepted;
+	}
+
+	// The radiance of the path sampler's numbers describe, and its pixel.
+	template <typename World>
+	color path(const World& world, primary_sampler& sampler, int& pixel) const
+	{
+		random_source* saved = random_override();
+		random_override() = &sampler;
+		sampler.restart();
+
+		double x = random_double() * cam.image_width;
+		double y = random_double() * cam.image_height;
+		int i = std::min(static_cast<int>(x), cam.image_width - 1);
+		int j = std::min(static_cast<int>(y), cam.image_height - 1);
+		pixel = j * cam.image_width + i;
+
+		vec3 film = cam.pixel_start_loc + (x - .5) * cam.pixel_delta_u + (y - .5) * cam.pixel_delta_v;
+		color radiance = cam.ray_color(ray(cam.center, film - cam.center, cam.pixel_spread), cam.max_depth, world);
+
+		random_override() = saved;
+
+		// A path the luminance can't rank is dropped rather than let it stall a chain.
+		double l = luminance(radiance);
+		return std::isfinite(l) && l > 0 ? radiance : color(0, 0, 0);
+	}
+
+	void splat(splat_buffer& splats, int pixel, const color& c) const
+	{
+		splats.add(pixel % cam.image_width, pixel / cam.image_width, c);
+	}
+};
+
+#endif
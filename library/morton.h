@@ -0,0 +1,39 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include <cstdint>
+
+// Spreads the low 10 bits of x so there are two zero bits between each.
+inline uint32_t expand_bits_3d(uint32_t x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x30000ff;
+	x = (x | (x << 8)) & 0x300f00f;
+	x = (x | (x << 4)) & 0x30c30c3;
+	x = (x | (x << 2)) & 0x9249249;
+	return x;
+}
+
+// 30-bit Z-order code of a point on a 1024^3 grid.
+inline uint32_t morton_3d(uint32_t x, uint32_t y, uint32_t z)
+{
+	return (expand_bits_3d(z) << 2) | (expand_bits_3d(y) << 1) | expand_bits_3d(x);
+}
+
+// Spreads the low 16 bits of x so there is one zero bit between each.
+inline uint32_t expand_bits_2d(uint32_t x)
+{
+	x &= 0xffff;
+	x = (x | (x << 8)) & 0x00ff00ff;
+	x = (x | (x << 4)) & 0x0f0f0f0f;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+inline uint32_t morton_2d(uint32_t x, uint32_t y)
+{
+	return (expand_bits_2d(y) << 1) | expand_bits_2d(x);
+}
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker pool. parallel_for hands out [begin, end) chunks through an
+// atomic counter; the calling thread works too and returns once every chunk is
+// done. Calls from inside a task run inline, so nesting is safe.
+class thread_pool
+{
+public:
+	thread_pool(int threads = 0)
+	{
+		int n = threads > 0 ? threads : static_cast<int>(std::thread::hardware_concurrency());
+		n = std::max(n, 1);
+		for (int i = 1; i < n; i++)
+			workers.emplace_back([this, i] { worker_loop(i); });
+	}
+
+	~thread_pool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& w : workers)
+			w.join();
+	}
+
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+
+	int size() const { return static_cast<int>(workers.size()) + 1; }
+
+	// Index of the calling pool thread in [0, size()), 0 for outside callers.
+	static int thread_index() { return current_index(); }
+
+	template <typename F>
+	void parallel_for(size_t count, F&& body, size_t grain = 0)
+	{
+		if (count == 0)
+			return;
+
+		if (grain == 0)
+			grain = std::max<size_t>(1, count / (size() * 8));
+
+		if (in_task() || workers.empty() || count <= grain)
+		{
+			body(size_t(0), count);
+			return;
+		}
+
+		std::unique_lock<std::mutex> run_lock(run_mutex);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = [&body](size_t b, size_t e) { body(b, e); };
+			job_count = count;
+			job_grain = grain;
+			next.store(0);
+			active = static_cast<int>(workers.size());
+			generation++;
+		}
+		wake.notify_all();
+
+		run_chunks();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return active == 0; });
+		job = nullptr;
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::mutex run_mutex; // One parallel_for at a time.
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	std::function<void(size_t, size_t)> job;
+	size_t job_count = 0, job_grain = 1;
+	std::atomic<size_t> next{ 0 };
+	int active = 0;
+	uint64_t generation = 0;
+	bool stopping = false;
+
+	static int& current_index()
+	{
+		thread_local int index = 0;
+		return index;
+	}
+
+	static bool& in_task()
+	{
+		thread_local bool flag = false;
+		return flag;
+	}
+
+	void run_chunks()
+	{
+		in_task() = true;
+		while (true)
+		{
+			size_t b = next.fetch_add(job_grain);
+			if (b >= job_count)
+				break;
+			job(b, std::min(b + job_grain, job_count));
+		}
+		in_task() = false;
+	}
+
+	void worker_loop(int index)
+	{
+		current_index() = index;
+		uint64_t seen = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return stopping || generation != seen; });
+				if (stopping)
+					return;
+				seen = generation;
+			}
+
+			run_chunks();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--active == 0)
+				done.notify_one();
+		}
+	}
+};
+
+// Process-wide pool used by the renderer.
+inline thread_pool& default_pool()
+{
+	static thread_pool pool;
+	return pool;
+}
+
+template <typename F>
+void parallel_for(size_t count, F&& body, size_t grain = 0)
+{
+	default_pool().parallel_for(count, std::forward<F>(body), grain);
+}
+
+// Stable parallel counting sort of items into `buckets` keys. Afterwards
+// out[offsets[b], offsets[b + 1]) holds the items with key b, in input order.
+template <typename T, typename Key>
+void parallel_counting_sort(const std::vector<T>& in, std::vector<T>& out, std::vector<size_t>& offsets,
+	int buckets, Key&& key)
+{
+	size_t n = in.size();
+	size_t chunks = std::min<size_t>(std::max<size_t>(n / 4096, 1), default_pool().size() * 4);
+	size_t chunk_size = (n + chunks - 1) / chunks;
+
+	std::vector<size_t> counts(chunks * buckets, 0);
+	parallel_for(chunks, [&](size_t b, size_t e)
+		{
+			for (size_t c = b; c < e; c++)
+			{
+				size_t* h = &counts[c * buckets];
+				for (size_t i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); i++)
+					h[key(in[i])]++;
+			}
+		}, 1);
+
+	// Exclusive prefix over (bucket, chunk) turns counts into write cursors.
+	offsets.assign(buckets + 1, 0);
+	size_t sum = 0;
+	for (int k = 0; k < buckets; k++)
+	{
+		offsets[k] = sum;
+		for (size_t c = 0; c < chunks; c++)
+		{
+			size_t count = counts[c * buckets + k];
+			counts[c * buckets + k] = sum;
+			sum += count;
+		}
+	}
+	offsets[buckets] = sum;
+
+	out.resize(n);
+	parallel_for(chunks, [&](size_t b, size_t e)
+		{
+			for (size_t c = b; c < e; c++)
+			{
+				size_t* cursor = &counts[c * buckets];
+				for (size_t i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); i++)
+					out[cursor[key(in[i])]++] = in[i];
+			}
+		}, 1);
+}
+
+// LSD radix sort of values by 64-bit keys, 8 bits per pass, each pass a
+// parallel_counting_sort. Only the low key_bits of the keys are considered.
+inline void parallel_radix_sort(std::vector<uint64_t>& keys, std::vector<uint32_t>& values, int key_bits)
+{
+	struct item
+	{
+		uint64_t key;
+		uint32_t value;
+	};
+
+	std::vector<item> a(keys.size()), b;
+	parallel_for(keys.size(), [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+				a[i] = { keys[i], values[i] };
+		});
+
+	std::vector<size_t> offsets;
+	for (int shift = 0; shift < key_bits; shift += 8)
+	{
+		parallel_counting_sort(a, b, offsets, 256, [shift](const item& x) { return (x.key >> shift) & 0xff; });
+		a.swap(b);
+	}
+
+	parallel_for(keys.size(), [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				keys[i] = a[i].key;
+				values[i] = a[i].value;
+			}
+		});
+}
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef PATH_GUIDE_H
+#define PATH_GUIDE_H
+
+#include "utility.h"
+
+#include "aabb.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Learned incident radiance for guiding non-specular bounces: an SD-tree after
+// Müller et al., "Practical Path Guiding for Efficient Light-Transport
+// Simulation". A binary tree over space, split at the midpoint along x, y, z in
+// turn, ends in leaves that each hold a quadtree over directions. Directions map
+// to the unit square by (cos theta, phi), which preserves area, so a quadtree
+// cell's share of the flux is its probability.
+//
+// Training runs in iterations. During one, paths record the radiance they
+// carried into the building trees while sampling uses the trees of the previous
+// iteration; both structures stay fixed, so recording is a descent with atomic
+// float adds and needs no locks. refine() then splits spatial leaves that
+// received many samples, subdivides directional cells that hold much flux,
+// and makes the trees just built the ones sampled.
+class path_guide
+{
+public:
+	int spatial_threshold = 12000; // Samples a leaf takes per iteration before it splits, times sqrt(2^iteration).
+	double flux_threshold = .01;   // Directional cells with more of a leaf's flux than this are subdivided.
+	static constexpr int max_directional_depth = 20;
+
+	// Quadtree over the direction square. Each node stores its four quadrants'
+	// flux and, for subdivided quadrants, the index of the child node.
+	class directional_tree
+	{
+	public:
+		directional_tree() : nodes(1) {}
+
+		double total() const { return nodes[0].total(); }
+		size_t node_count() const { return nodes.size(); }
+
+		// Draws a direction with probability proportional to the recorded flux;
+		// pdf gives its density.
+		vec3 sample() const
+		{
+			double u0 = 0, v0 = 0, size = 1;
+			uint32_t n = 0;
+			while (true)
+			{
+				const node& nd = nodes[n];
+				double sums[4], sum = 0;
+				for (int q = 0; q < 4; q++)
+					sum += sums[q] = nd.sum[q].load(std::memory_order_relaxed);
+
+				int q = 0;
+				for (double x = random_double() * sum; q < 3 && x >= sums[q]; q++)
+					x -= sums[q];
+
+				size *= .5;
+				u0 += (q & 1) * size;
+				v0 += (q >> 1) * size;
+
+				if (!nd.child[q])
+					return from_square(u0 + random_double() * size, v0 + random_double() * size);
+				n = nd.child[q];
+			}
+		}
+
+		// Solid-angle density of sample() at direction.
+		double pdf(const vec3& direction) const
+		{
+			double u, v;
+			to_square(direction, u, v);
+
+			double square_pdf = 1;
+			uint32_t n = 0;
+			while (true)
+			{
+				const node& nd = nodes[n];
+				int q = quadrant(u, v);
+				double sum = nd.total();
+				if (sum <= 0)
+					return 0;
+
+				square_pdf *= 4 * nd.sum[q].load(std::memory_order_relaxed) / sum;
+				if (!nd.child[q] || square_pdf == 0)
+					return square_pdf / (4 * pi);
+				n = nd.child[q];
+			}
+		}
+
+		// Adds flux to the cells containing direction, on every level. Safe to call
+		// from any number of threads.
+		void record(const vec3& direction, float flux)
+		{
+			double u, v;
+			to_square(direction, u, v);
+
+			uint32_t n = 0;
+			while (true)
+			{
+				int q = quadrant(u, v);
+				atomic_add(nodes[n].sum[q], flux);
+				if (!nodes[n].child[q])
+					return;
+				n = nodes[n].child[q];
+			}
+		}
+
+		// A tree with no flux whose cells follow this tree's flux: quadrants with
+		// more than threshold of the total are subdivided, the rest are leaves.
+		directional_tree refined(double threshold) const
+		{
+			directional_tree out;
+			double total_flux = total();
+
+			// from is -1 where this tree has no node for the cell; its flux is then
+			// taken as spread evenly over the quadrants.
+			struct pending { int64_t from; uint32_t to; int depth; double flux; };
+			std::vector<pending> stack = { { 0, 0, 1, total_flux } };
+			while (!stack.empty() && total_flux > 0)
+			{
+				pending p = stack.back();
+				stack.pop_back();
+
+				for (int q = 0; q < 4; q++)
+				{
+					double flux = p.from >= 0 ? nodes[p.from].sum[q].load(std::memory_order_relaxed) : p.flux / 4;
+					if (flux <= threshold * total_flux || p.depth >= max_directional_depth)
+						continue;
+
+					uint32_t child = static_cast<uint32_t>(out.nodes.size());
+					out.nodes.emplace_back();
+					out.nodes[p.to].child[q] = child;
+
+					int64_t from_child = p.from >= 0 && nodes[p.from].child[q] ? int64_t(nodes[p.from].child[q]) : -1;
+					stack.push_back({ from_child, child, p.depth + 1, flux });
+				}
+			}
+			return out;
+		}
+
+	private:
+		struct node
+		{
+			std::atomic<float> sum[4];
+			uint32_t child[4] = {}; // 0 for a leaf quadrant; the root is never a child.
+
+			node()
+			{
+				for (auto& s : sum)
+					s.store(0, std::memory_order_relaxed);
+			}
+
+			node(const node& other) { *this = other; }
+
+			node& operator=(const node& other)
+			{
+				for (int q = 0; q < 4; q++)
+				{
+					sum[q].store(other.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed);
+					child[q] = other.child[q];
+				}
+				return *this;
+			}
+
+			double total() const
+			{
+				double t = 0;
+				for (const auto& s : sum)
+					t += s.load(std::memory_order_relaxed);
+				return t;
+			}
+		};
+
+		std::vector<node> nodes;
+
+		// Picks the quadrant of (u, v) and rescales both to it.
+		static int quadrant(double& u, double& v)
+		{
+			int q = 0;
+			u *= 2;
+			v *= 2;
+			if (u >= 1) { u -= 1; q |= 1; }
+			if (v >= 1) { v -= 1; q |= 2; }
+			return q;
+		}
+
+		static void atomic_add(std::atomic<float>& target, float value)
+		{
+			float current = target.load(std::memory_order_relaxed);
+			while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+				;
+		}
+	};
+
+	path_guide(const aabb& bounds)
+	{
+		aabb box = bounds.pad();
+		for (int a = 0; a < 3; a++)
+		{
+			origin[a] = box.axis(a).min;
+			extent[a] = box.axis(a).size();
+		}
+		nodes.push_back({ 0, 0, 0 });
+		leaves.push_back(std::make_unique<leaf>());
+	}
+
+	int iteration() const { return iterations; }
+	size_t leaf_count() const { return leaves.size(); }
+
+	// The distribution to sample at p, or nullptr until one has been learned there.
+	const directional_tree* sampling_tree(const vec3& p) const
+	{
+		const leaf& l = *leaves[find(p)];
+		return l.sampling.total() > 0 ? &l.sampling : nullptr;
+	}
+
+	// Records that radiance / pdf arrived at p from direction. Lock-free.
+	void record(const vec3& p, const vec3& direction, double weighted_radiance)
+	{
+		leaf& l = *leaves[find(p)];
+		l.samples.fetch_add(1, std::memory_order_relaxed);
+		if (weighted_radiance > 0 && std::isfinite(weighted_radiance))
+			l.building.record(direction, static_cast<float>(weighted_radiance));
+	}
+
+	// Ends a training iteration; call while no thread records or samples.
+	void refine()
+	{
+		double limit = spatial_threshold * std::sqrt(std::pow(2.0, iterations));
+		split(0, 0, limit);
+
+		for (auto& l : leaves)
+		{
+			if (l->building.total() > 0)
+			{
+				directional_tree next = l->building.refined(flux_threshold);
+				l->sampling = std::move(l->building);
+				l->building = std::move(next);
+			}
+			l->samples.store(0, std::memory_order_relaxed);
+		}
+		iterations++;
+	}
+
+	size_t directional_node_count() const
+	{
+		size_t n = 0;
+		for (const auto& l : leaves)
+			n += l->sampling.node_count();
+		return n;
+	}
+
+private:
+	struct spatial_node
+	{
+		int axis;         // Split axis of an interior node.
+		uint32_t child;   // First of two children, 0 for a leaf.
+		uint32_t leaf;    // Index into leaves, for a leaf.
+	};
+
+	struct leaf
+	{
+		directional_tree sampling, building;
+		std::atomic<uint32_t> samples{ 0 };
+	};
+
+	double origin[3], extent[3];
+	std::vector<spatial_node> nodes;
+	std::vector<std::unique_ptr<leaf>> leaves;
+	int iterations = 0;
+
+	size_t find(const vec3& p) const
+	{
+		double lo[3] = { origin[0], origin[1], origin[2] }, size[3] = { extent[0], extent[1], extent[2] };
+		uint32_t n = 0;
+		while (nodes[n].child)
+		{
+			int a = nodes[n].axis;
+			size[a] *= .5;
+			bool upper = p[a] >= lo[a] + size[a];
+			if (upper)
+				lo[a] += size[a];
+			n = nodes[n].child + upper;
+		}
+		return nodes[n].leaf;
+	}
+
+	// Splits leaves whose sample count exceeds limit, halving the count with
+	// every level, as the samples are assumed spread evenly over the halves.
+	void split(uint32_t n, int depth, double limit)
+	{
+		if (nodes[n].child)
+		{
+			split(nodes[n].child, depth + 1, limit);
+			split(nodes[n].child + 1, depth + 1, limit);
+			return;
+		}
+
+		leaf& l = *leaves[nodes[n].leaf];
+		uint32_t samples = l.samples.load(std::memory_order_relaxed);
+		if (samples <= limit)
+			return;
+
+		auto other = std::make_unique<leaf>();
+		other->sampling = l.sampling;
+		other->building = l.building;
+		other->samples.store(samples / 2, std::memory_order_relaxed);
+		l.samples.store(samples / 2, std::memory_order_relaxed);
+
+		uint32_t child = static_cast<uint32_t>(nodes.size());
+		int axis = depth % 3;
+		nodes.push_back({ 0, 0, nodes[n].leaf });
+		nodes.push_back({ 0, 0, static_cast<uint32_t>(leaves.size()) });
+		leaves.push_back(std::move(other));
+		nodes[n] = { axis, child, 0 };
+
+		split(child, depth + 1, limit);
+		split(child + 1, depth + 1, limit);
+	}
+
+	static void to_square(const vec3& d, double& u, double& v)
+	{
+		vec3 n = normalize(d);
+		double phi = std::atan2(n.y(), n.x());
+		if (phi < 0)
+			phi += 2 * pi;
+		u = std::min(std::max((n.z() + 1) * .5, 0.0), std::nextafter(1.0, 0.0));
+		v = std::min(phi / (2 * pi), std::nextafter(1.0, 0.0));
+	}
+
+	static vec3 from_square(double u, double v)
+	{
+		double cos_theta = 2 * u - 1;
+		double sin_theta = std::sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+		double phi = 2 * pi * v;
+		return vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+	}
+};
+
+#endif
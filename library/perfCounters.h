@@ -0,0 +1,393 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include "rayStats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PERF_COUNTERS_RDPMC
+#endif
+#endif
+
+// Hardware event counts of the calling thread: cycles, instructions, cache
+// misses and branch misses, user space only. Linux only, through
+// perf_event_open; elsewhere, or when the kernel refuses (no PMU in a VM,
+// perf_event_paranoid too high), available() is false and read returns zeros.
+//
+// The four events form one group, so they are scheduled together. Where the
+// kernel allows rdpmc, read takes tens of cycles without a system call,
+// which is cheap enough to bracket every ray traversal (see fast()).
+// Otherwise it falls back to read(2) on the group.
+class perf_counters
+{
+public:
+	enum event { cycles, instructions, cache_misses, branch_misses, event_count };
+
+	struct sample
+	{
+		uint64_t count[event_count] = {};
+		bool scaled = false; // Read through read(2); see perf_profile::thread_record::add.
+
+		sample& operator+=(const sample& s)
+		{
+			for (int k = 0; k < event_count; k++)
+				count[k] += s.count[k];
+			return *this;
+		}
+
+		sample operator-(const sample& s) const
+		{
+			sample d;
+			for (int k = 0; k < event_count; k++)
+				d.count[k] = count[k] - s.count[k];
+			return d;
+		}
+	};
+
+	perf_counters()
+	{
+#ifdef __linux__
+		static const uint64_t configs[event_count] = {
+			PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+		};
+
+		for (int k = 0; k < event_count; k++)
+		{
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = configs[k];
+			attr.disabled = k == 0; // The leader starts the whole group.
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+			fd[k] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, k == 0 ? -1 : fd[0], 0));
+			if (fd[k] < 0)
+			{
+				error = errno;
+				close_all();
+				return;
+			}
+		}
+
+		page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		mapped = true;
+		for (int k = 0; k < event_count; k++)
+		{
+			void* p = mmap(nullptr, page_size, PROT_READ, MAP_SHARED, fd[k], 0);
+			page[k] = p == MAP_FAILED ? nullptr : static_cast<const perf_event_mmap_page*>(p);
+			mapped = mapped && page[k] && page[k]->cap_user_rdpmc;
+		}
+
+		ioctl(fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+	}
+
+	~perf_counters() { close_all(); }
+
+	perf_counters(const perf_counters&) = delete;
+	perf_counters& operator=(const perf_counters&) = delete;
+
+	bool available() const { return fd[0] >= 0; }
+
+	// Reads are cheap enough to take per ray.
+	bool fast() const
+	{
+#ifdef PERF_COUNTERS_RDPMC
+		return available() && mapped;
+#else
+		return false;
+#endif
+	}
+
+	// errno of the failed perf_event_open, for the message when unavailable.
+	int open_error() const { return error; }
+
+	// Counts since the counters were opened.
+	sample read() const
+	{
+		sample s;
+		if (!available())
+			return s;
+
+#ifdef PERF_COUNTERS_RDPMC
+		if (mapped)
+		{
+			bool ok = true;
+			for (int k = 0; k < event_count && ok; k++)
+				ok = read_mapped(page[k], s.count[k]);
+			if (ok)
+				return s;
+		}
+#endif
+
+#ifdef __linux__
+		// nr, time_enabled, time_running, then one value per event.
+		uint64_t data[3 + event_count];
+		if (::read(fd[0], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)) || data[0] != event_count)
+			return s;
+
+		// Scale up if the group was multiplexed with other users of the PMU.
+		double scale = data[2] > 0 ? double(data[1]) / data[2] : 1;
+		for (int k = 0; k < event_count; k++)
+			s.count[k] = static_cast<uint64_t>(data[3 + k] * scale);
+		s.scaled = true;
+#endif
+		return s;
+	}
+
+private:
+	int fd[event_count] = { -1, -1, -1, -1 };
+	int error = 0;
+	bool mapped = false;
+	size_t page_size = 0;
+#ifdef __linux__
+	const perf_event_mmap_page* page[event_count] = {};
+#endif
+
+	void close_all()
+	{
+#ifdef __linux__
+		for (int k = 0; k < event_count; k++)
+		{
+			if (page[k])
+				munmap(const_cast<perf_event_mmap_page*>(page[k]), page_size);
+			if (fd[k] >= 0)
+				close(fd[k]);
+			page[k] = nullptr;
+			fd[k] = -1;
+		}
+#endif
+	}
+
+#ifdef PERF_COUNTERS_RDPMC
+	// Seqlock read of the kernel's offset plus the live counter, as described in
+	// linux/perf_event.h. Fails while the event isn't on a hardware counter.
+	static bool read_mapped(const perf_event_mmap_page* pc, uint64_t& count)
+	{
+		const volatile perf_event_mmap_page* p = pc;
+		uint32_t seq;
+		do
+		{
+			seq = p->lock;
+			std::atomic_signal_fence(std::memory_order_seq_cst);
+
+			uint32_t index = p->index;
+			if (!p->cap_user_rdpmc || index == 0)
+				return false;
+
+			int64_t value = p->offset;
+			int width = p->pmc_width;
+			uint64_t pmc = static_cast<uint64_t>(__rdpmc(static_cast<int>(index - 1)));
+			pmc <<= 64 - width;
+			value += static_cast<int64_t>(pmc) >> (64 - width);
+			count = static_cast<uint64_t>(value);
+
+			std::atomic_signal_fence(std::memory_order_seq_cst);
+		} while (p->lock != seq);
+		return true;
+	}
+#endif
+};
+
+// Counter totals per thread and phase, for telling compute-bound from
+// memory-bound work. start() turns it on; each thread opens its counters the
+// first time it records. Shading is taken as render minus traversal, and
+// traversal is only split out when reads are fast (rdpmc).
+class perf_profile
+{
+public:
+	enum phase { scene_build, bvh_build, render, traversal, phase_count };
+
+	struct thread_record
+	{
+		int tid = 0;
+		perf_counters counters;
+		perf_counters::sample totals[phase_count];
+		int open_scopes[phase_count] = {};
+		uint64_t rays = 0; // Traced inside render scopes.
+		uint64_t discarded = 0;
+
+		// Adds end - begin to phase p. read falls back from rdpmc to read(2) while
+		// an event is off its hardware counter (multiplexing, index 0), and the
+		// raw and scaled counts of the two paths don't subtract, so a delta whose
+		// reads took different paths is dropped and counted in discarded.
+		void add(phase p, const perf_counters::sample& begin, const perf_counters::sample& end)
+		{
+			if (begin.scaled != end.scaled)
+			{
+				discarded++;
+				return;
+			}
+			totals[p] += end - begin;
+		}
+	};
+
+	static perf_profile& instance()
+	{
+		static perf_profile profile;
+		return profile;
+	}
+
+	void start() { on.store(true, std::memory_order_relaxed); }
+	bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+	// The calling thread's record, or nullptr if profiling is off or its
+	// counters could not be opened.
+	thread_record* local()
+	{
+		if (!enabled())
+			return nullptr;
+
+		thread_local thread_record* record = nullptr;
+		thread_local bool opened = false;
+		if (!opened)
+		{
+			opened = true;
+			auto r = std::make_unique<thread_record>();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!r->counters.available())
+			{
+				if (!warned)
+					std::clog << "perf counters unavailable (" << std::strerror(r->counters.open_error()) << "); not profiling.\n";
+				warned = true;
+				return nullptr;
+			}
+
+			r->tid = static_cast<int>(records.size());
+			records.push_back(std::move(r));
+			record = records.back().get();
+		}
+		return record;
+	}
+
+	// Prints counts, IPC and misses per ray for each phase and thread. Call it
+	// once the threads being profiled are idle.
+	void report(std::ostream& out)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (records.empty())
+			return;
+
+		// Without fast reads traversal isn't measured, so the last row is the whole render.
+		bool split = records.front()->counters.fast();
+		const char* names[] = { "scene build", "bvh build", "traversal", split ? "shading" : "render" };
+		out << "Perf counters (user space)\n"
+			<< "  phase        thread        cycles  instructions    IPC  cache misses  branch misses  per ray: cache br.miss\n";
+
+		perf_counters::sample all[4];
+		uint64_t all_rays = 0, discarded = 0;
+		for (const auto& r : records)
+		{
+			discarded += r->discarded;
+			perf_counters::sample rows[4] = { r->totals[scene_build], r->totals[bvh_build], r->totals[traversal],
+				r->totals[render] - r->totals[traversal] };
+			for (int k = 0; k < 4; k++)
+			{
+				all[k] += rows[k];
+				print_row(out, names[k], std::to_string(r->tid), rows[k], k >= 2 ? r->rays : 0);
+			}
+			all_rays += r->rays;
+		}
+
+		for (int k = 0; k < 4; k++)
+			print_row(out, names[k], "all", all[k], k >= 2 ? all_rays : 0);
+		if (discarded > 0)
+			out << "  " << discarded << " measurements dropped: their two reads took different paths\n";
+	}
+
+private:
+	std::atomic<bool> on{ false };
+	bool warned = false;
+	std::mutex mutex; // Guards records while a thread registers and while reporting.
+	std::vector<std::unique_ptr<thread_record>> records;
+
+	static void print_row(std::ostream& out, const char* name, const std::string& thread, const perf_counters::sample& s, uint64_t rays)
+	{
+		if (s.count[perf_counters::cycles] == 0)
+			return;
+
+		double ipc = double(s.count[perf_counters::instructions]) / s.count[perf_counters::cycles];
+		out << "  " << std::left << std::setw(12) << name << ' ' << std::right << std::setw(6) << thread
+			<< std::setw(14) << s.count[perf_counters::cycles] << std::setw(14) << s.count[perf_counters::instructions]
+			<< std::setw(7) << std::fixed << std::setprecision(2) << ipc
+			<< std::setw(14) << s.count[perf_counters::cache_misses] << std::setw(15) << s.count[perf_counters::branch_misses];
+		if (rays > 0)
+		{
+			out << std::setw(17) << std::setprecision(3) << double(s.count[perf_counters::cache_misses]) / rays
+				<< std::setw(8) << double(s.count[perf_counters::branch_misses]) / rays;
+		}
+		out << std::defaultfloat << '\n';
+	}
+};
+
+// Adds the calling thread's counts over its lifetime to phase p. A scope
+// nested in another of the same phase on the same thread counts nothing, so
+// a parallel_for caller running some of its own tasks isn't counted twice.
+class perf_scope
+{
+public:
+	perf_scope(perf_profile::phase p) : phase(p)
+	{
+		record = perf_profile::instance().local();
+		if (!record)
+			return;
+
+		if (record->open_scopes[phase] > 0)
+		{
+			record = nullptr;
+			return;
+		}
+
+		record->open_scopes[phase]++;
+		rays = thread_ray_stats.rays;
+		begin = record->counters.read();
+	}
+
+	~perf_scope()
+	{
+		if (!record)
+			return;
+
+		record->add(phase, begin, record->counters.read());
+		if (phase == perf_profile::render)
+			record->rays += thread_ray_stats.rays - rays;
+		record->open_scopes[phase]--;
+	}
+
+	perf_scope(const perf_scope&) = delete;
+	perf_scope& operator=(const perf_scope&) = delete;
+
+	// The thread's record while this scope counts, else nullptr.
+	perf_profile::thread_record* counting() const { return record; }
+
+private:
+	perf_profile::phase phase;
+	perf_profile::thread_record* record;
+	perf_counters::sample begin;
+	uint64_t rays = 0;
+};
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef PREVIEW_BUFFER_H
+#define PREVIEW_BUFFER_H
+
+#include "utility.h"
+
+#include "color.h"
+#include "parallel.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Memory-mapped framebuffer file for watching a render while it runs. Layout:
+//
+//   offset  0  char[8]   "RTPREVW" + '\0'
+//   offset  8  uint32    version (1)
+//   offset 12  uint32    width
+//   offset 16  uint32    height
+//   offset 20  uint32    passes accumulated into the pixels
+//   offset 24  uint64    generation, odd while a pass is being written
+//   offset 32  float[3]  linear RGB mean per pixel, rows top to bottom
+//
+// A reader maps the file, reads generation, copies or displays the pixels and
+// re-reads generation; if it changed or is odd the frame was torn (seqlock).
+class preview_buffer
+{
+public:
+	struct header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t width;
+		uint32_t height;
+		uint32_t passes;
+		uint64_t generation;
+	};
+
+	preview_buffer(const char* path, int width, int height)
+	{
+		size_t bytes = sizeof(header) + static_cast<size_t>(width) * height * 3 * sizeof(float);
+		if (!map(path, bytes))
+		{
+			std::cerr << "preview_buffer: could not map " << path << '\n';
+			return;
+		}
+
+		header* h = head();
+		std::memcpy(h->magic, "RTPREVW", 8);
+		h->version = 1;
+		h->width = width;
+		h->height = height;
+		h->passes = 0;
+		generation().store(0, std::memory_order_release);
+	}
+
+	~preview_buffer()
+	{
+		unmap();
+	}
+
+	preview_buffer(const preview_buffer&) = delete;
+	preview_buffer& operator=(const preview_buffer&) = delete;
+
+	bool valid() const { return data != nullptr; }
+
+	// Publishes sum * scale as the current image.
+	void publish(const std::vector<color>& sum, double scale, int passes)
+	{
+		if (!data)
+			return;
+
+		auto& gen = generation();
+		uint64_t g = gen.load(std::memory_order_relaxed);
+		gen.store(g + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		float* pixels = reinterpret_cast<float*>(data + sizeof(header));
+		parallel_for(sum.size(), [&](size_t b, size_t e)
+			{
+				for (size_t i = b; i < e; i++)
+				{
+					color c = sum[i] * scale;
+					pixels[3 * i + 0] = static_cast<float>(c.x());
+					pixels[3 * i + 1] = static_cast<float>(c.y());
+					pixels[3 * i + 2] = static_cast<float>(c.z());
+				}
+			});
+
+		head()->passes = passes;
+		gen.store(g + 2, std::memory_order_release);
+	}
+
+private:
+	char* data = nullptr;
+	size_t size = 0;
+
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+
+	header* head() { return reinterpret_cast<header*>(data); }
+
+	std::atomic<uint64_t>& generation()
+	{
+		static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "atomic must overlay the header field");
+		return *reinterpret_cast<std::atomic<uint64_t>*>(&head()->generation);
+	}
+
+#ifdef _WIN32
+	bool map(const char* path, size_t bytes)
+	{
+		file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE,
+			static_cast<DWORD>(static_cast<uint64_t>(bytes) >> 32), static_cast<DWORD>(bytes), nullptr);
+		if (!mapping)
+			return false;
+
+		data = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes));
+		size = bytes;
+		return data != nullptr;
+	}
+
+	void unmap()
+	{
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+	}
+#else
+	bool map(const char* path, size_t bytes)
+	{
+		int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			return false;
+
+		if (ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+		{
+			close(fd);
+			return false;
+		}
+
+		void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			return false;
+
+		data = static_cast<char*>(p);
+		size = bytes;
+		return true;
+	}
+
+	void unmap()
+	{
+		if (data)
+			munmap(data, size);
+	}
+#endif
+};
+
+#endif
@@ -17,14 +17,44 @@ public:
 		D = dot(normal, Q);
 
 		w = n / dot(n, n);
+		uv_scale = 1 / sqrt(u.length() * v.length());
+
+		// Box over all four vertices, padded so axis-aligned quads aren't flat.
+		bbox = aabb(aabb(Q, Q + u + v), aabb(Q + u, Q + v)).pad();
 	}
 
-	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+	aabb bounding_box() const override { return bbox; }
+
+	double area() const override { return cross(u, v).length(); }
+
+	void sample_surface(hit_record& rec) const override
+	{
+		rec.u = random_double();
+		rec.v = random_double();
+		rec.pos = Q + rec.u * u + rec.v * v;
+		rec.normal = normal;
+		rec.front_face = true;
+		rec.uv_width = 0;
+		rec.mat = mat.get();
+		rec.object = this;
+	}
+
+	const vec3& get_origin() const { return Q; }
+
+	// Moves the corner Q, keeping the edges u and v.
+	void set_origin(const vec3& q)
+	{
+		Q = q;
+		D = dot(normal, Q);
+		bbox = aabb(aabb(Q, Q + u + v), aabb(Q + u, Q + v)).pad();
+	}
+
+	bool hit(const ray& r, interval ray_t, hit_record& rec) const final
 	{
 		auto denom = dot(normal, r.direction());
 
 		// No hit if the ray is parallel to the plane.
-		if (fabs(denom) < 1e-8)
+		if (fabs(denom) < parallel_epsilon)
 			return false;
 
 		// Return false if the hit point parameter t is outside the ray interval.
@@ -45,33 +75,62 @@ public:
 		// Ray hits the 2D shape; set the rest of the hit record and return true.
 
 		rec.t = t;
+		rec.uv_width = t * r.direction().length() * r.spread() * uv_scale;
 		rec.pos = intersection;
-		rec.mat = mat;
+		rec.mat = mat.get();
+		rec.object = this;
 		rec.set_normal(r, normal);
 
 		return true;
 	}
 
+	bool occluded(const ray& r, interval ray_t) const final
+	{
+		auto denom = dot(normal, r.direction());
+		if (fabs(denom) < parallel_epsilon)
+			return false;
+
+		auto t = (D - dot(normal, r.origin())) / denom;
+		if (!ray_t.contains(t))
+			return false;
+
+		vec3 planar_hitpt_vector = r.at(t) - Q;
+		auto alpha = dot(w, cross(planar_hitpt_vector, v));
+		auto beta = dot(w, cross(u, planar_hitpt_vector));
+
+		// is_interior may be overridden to write uv, so give it a scratch record.
+		hit_record scratch;
+		return is_interior(alpha, beta, scratch);
+	}
+
 	virtual bool is_interior(double a, double b, hit_record& rec) const
 	{
 		// Given the hit point in plane coordinates, return false if it is outside the
 		// primitive, otherwise set the hit record UV coordinates and return true.
 
-		if ((a < 0) || (1 < a) || (b < 0) || (1 < b))
+		if ((a < -edge_epsilon) || (1 + edge_epsilon < a) || (b < -edge_epsilon) || (1 + edge_epsilon < b))
 			return false;
 
-		// rec.u = a;
-		// rec.v = b;
+		rec.u = a;
+		rec.v = b;
 		return true;
 	}
 
 private:
+	// In single precision the plane test needs a looser threshold, and the interior
+	// test is padded slightly so rays can't slip through the seam between two
+	// quads sharing an edge.
+	static constexpr double parallel_epsilon = single_precision ? 1e-6 : 1e-8;
+	static constexpr double edge_epsilon = single_precision ? 1e-5 : 0;
+
 	vec3 Q;
 	vec3 u, v;
 	vec3 normal;
 	shared_ptr<material> mat;
 	double D;
 	vec3 w;
+	double uv_scale;
+	aabb bbox;
 };
 
 #endif
\ No newline at end of file
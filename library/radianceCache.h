@@ -0,0 +1,284 @@
+#ifndef RADIANCE_CACHE_H
+#define RADIANCE_CACHE_H
+
+#include "utility.h"
+
+#include "aabb.h"
+#include "color.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Irradiance cache (Ward et al.) for diffuse interreflection. A record holds
+// the cosine-weighted mean radiance arriving at a point, which a lambertian
+// surface turns into outgoing radiance by multiplying with its albedo, plus
+// rotational and translational gradients (Ward and Heckbert). Records sit in
+// an octree by the sphere they are valid in.
+//
+// A record at p_i with normal n_i and radius R_i is used at (p, n) while
+//
+//   |p - p_i| / R_i + sqrt(1 - n . n_i) < accuracy
+//
+// and p is not behind it. Values found are blended with weight 1 / error -
+// 1 / accuracy, which falls to zero at the edge of each record's region, after
+// extrapolating each by its gradients. R_i is the harmonic mean distance to
+// the surfaces seen from p_i, clamped between min_spacing and max_spacing and
+// to where the translational gradient would change the value by its own size.
+//
+// Records are computed and inserted from outside (camera::render_cached does it
+// in parallel rounds); lookups only read, so any number may run at once while
+// nothing is inserted.
+class radiance_cache
+{
+public:
+	struct record
+	{
+		vec3 pos, normal;
+		color value;
+		vec3 rotation[3], translation[3]; // Gradients of the red, green and blue components.
+		double radius;
+	};
+
+	double accuracy = .3;
+	int hemisphere_samples = 128;
+	double coverage = .9;       // camera::render_cached's prepass stops once this share of new points is covered,
+	size_t max_records = 50000; // or at this many records.
+	double min_spacing, max_spacing; // World units, defaulting to fractions of the scene's extent.
+
+	radiance_cache(const aabb& bounds)
+	{
+		aabb box = bounds.pad();
+		double size = std::max({ box.x.size(), box.y.size(), box.z.size() });
+		for (int a = 0; a < 3; a++)
+			origin[a] = box.axis(a).min;
+		extent = size;
+		min_spacing = .002 * size;
+		max_spacing = .05 * size;
+		nodes.emplace_back();
+	}
+
+	size_t size() const { return records.size(); }
+
+	// Interpolated value at p with normal n; false if no record is valid there.
+	bool lookup(const vec3& p, const vec3& n, color& value) const
+	{
+		color sum(0, 0, 0);
+		double weight_sum = 0;
+
+		double lo[3] = { origin[0], origin[1], origin[2] }, size = extent;
+		uint32_t node = 0;
+		while (true)
+		{
+			for (uint32_t i : nodes[node].records)
+			{
+				const record& r = records[i];
+				vec3 d = p - r.pos;
+				double error = d.length() / r.radius + std::sqrt(std::max(0.0, double(1 - dot(n, r.normal))));
+				if (error >= accuracy)
+					continue;
+
+				// Skip records in front of p; they see light p doesn't.
+				if (dot(d, r.normal + n) < -.1 * r.radius)
+					continue;
+
+				double weight = 1 / std::max(error, 1e-6) - 1 / accuracy;
+				vec3 axis = cross(r.normal, n);
+				color v;
+				for (int c = 0; c < 3; c++)
+					v[c] = std::max(0.0, double(r.value[c] + dot(axis, r.rotation[c]) + dot(d, r.translation[c])));
+				sum += weight * v;
+				weight_sum += weight;
+			}
+
+			size *= .5;
+			int octant = 0;
+			for (int a = 0; a < 3; a++)
+			{
+				if (p[a] >= lo[a] + size)
+				{
+					octant |= 1 << a;
+					lo[a] += size;
+				}
+			}
+
+			uint32_t child = nodes[node].child[octant];
+			if (!child)
+				break;
+			node = child;
+		}
+
+		if (weight_sum <= 0)
+			return false;
+		value = sum / weight_sum;
+		return true;
+	}
+
+	// Computes the record at p with normal n from cosine-weighted, stratified
+	// hemisphere samples. trace(ray, distance) returns the radiance arriving
+	// along ray and sets the distance to what it hit (infinity for nothing).
+	template <typename Trace>
+	record compute(const vec3& p, const vec3& n, Trace&& trace) const
+	{
+		// M strata in theta and N = pi M in phi keep the strata roughly square.
+		int m = std::max(2, static_cast<int>(std::sqrt(hemisphere_samples / pi)));
+		int nphi = std::max(3, hemisphere_samples / m);
+
+		vec3 t, b;
+		tangent_frame(n, t, b);
+
+		std::vector<color> radiance(static_cast<size_t>(m) * nphi);
+		std::vector<double> distance(radiance.size()), sin_theta(radiance.size()), phi(radiance.size());
+
+		record rec;
+		rec.pos = p;
+		rec.normal = n;
+		rec.value = color(0, 0, 0);
+		double inverse_distance_sum = 0;
+		for (int k = 0; k < nphi; k++)
+		{
+			for (int j = 0; j < m; j++)
+			{
+				size_t i = static_cast<size_t>(k) * m + j;
+				double u = (j + random_double()) / m;
+				phi[i] = 2 * pi * (k + random_double()) / nphi;
+				double s = std::sqrt(u), c = std::sqrt(1 - u);
+				vec3 dir = (s * std::cos(phi[i])) * t + (s * std::sin(phi[i])) * b + c * n;
+
+				radiance[i] = trace(ray(p, dir), distance[i]);
+				sin_theta[i] = s;
+				rec.value += radiance[i];
+				inverse_distance_sum += 1 / distance[i];
+			}
+		}
+		rec.value /= static_cast<double>(radiance.size());
+
+		for (int c = 0; c < 3; c++)
+		{
+			rec.rotation[c] = vec3(0, 0, 0);
+			rec.translation[c] = vec3(0, 0, 0);
+		}
+
+		for (int k = 0; k < nphi; k++)
+		{
+			double phi_center = 2 * pi * (k + .5) / nphi, phi_edge = 2 * pi * k / nphi;
+			vec3 u_k = std::cos(phi_center) * t + std::sin(phi_center) * b;
+			vec3 v_edge = -std::sin(phi_edge) * t + std::cos(phi_edge) * b;
+			int k_prev = (k + nphi - 1) % nphi;
+
+			for (int j = 0; j < m; j++)
+			{
+				size_t i = static_cast<size_t>(k) * m + j;
+				double s = sin_theta[i], c = std::sqrt(1 - s * s);
+				double tan_theta = s / std::max(c, 1e-6);
+				vec3 v_k = -std::sin(phi[i]) * t + std::cos(phi[i]) * b;
+
+				// Across theta strata, at the boundary between j - 1 and j.
+				double radial = 0;
+				if (j > 0)
+				{
+					double cos2 = 1 - double(j) / m;
+					double sin_edge = std::sqrt(double(j) / m);
+					radial = 2 * pi / nphi * sin_edge * cos2 / std::min(distance[i], distance[i - 1]);
+				}
+
+				// Across phi strata, at the boundary between k - 1 and k.
+				size_t i_prev = static_cast<size_t>(k_prev) * m + j;
+				double around = .5 / m / (std::max(s, 1e-6) * std::min(distance[i], distance[i_prev]));
+
+				for (int ch = 0; ch < 3; ch++)
+				{
+					rec.rotation[ch] += (tan_theta * radiance[i][ch]) * v_k;
+					if (j > 0)
+						rec.translation[ch] += (radial * (radiance[i][ch] - radiance[i - 1][ch])) * u_k;
+					rec.translation[ch] += (around * (radiance[i][ch] - radiance[i_prev][ch])) * v_edge;
+				}
+			}
+		}
+
+		// The sums above are for irradiance, pi times the mean radiance.
+		double samples = static_cast<double>(radiance.size());
+		double radius = std::clamp(samples / inverse_distance_sum, min_spacing, max_spacing);
+		for (int c = 0; c < 3; c++)
+		{
+			rec.rotation[c] /= samples;
+			rec.translation[c] /= pi;
+
+			double gradient = rec.translation[c].length();
+			if (gradient > 0)
+				radius = std::min(radius, std::max(double(rec.value[c]) / gradient, min_spacing));
+		}
+		rec.radius = radius;
+		return rec;
+	}
+
+	void insert(const record& r)
+	{
+		uint32_t index = static_cast<uint32_t>(records.size());
+		records.push_back(r);
+
+		double reach = accuracy * r.radius;
+		double lo[3] = { origin[0], origin[1], origin[2] };
+		insert(0, lo, extent, 0, index, r.pos, reach);
+	}
+
+private:
+	static constexpr int max_depth = 16;
+
+	struct node
+	{
+		uint32_t child[8] = {}; // 0 where there is none; the root is never a child.
+		std::vector<uint32_t> records;
+	};
+
+	double origin[3], extent;
+	std::vector<node> nodes;
+	std::vector<record> records;
+
+	// Stores index in every node of edge about four times reach that its sphere
+	// touches, so a lookup only has to visit the nodes containing its point.
+	void insert(uint32_t n, const double lo[3], double size, int depth, uint32_t index, const vec3& center, double reach)
+	{
+		if (size < 4 * reach || depth == max_depth)
+		{
+			nodes[n].records.push_back(index);
+			return;
+		}
+
+		double half = size * .5;
+		for (int octant = 0; octant < 8; octant++)
+		{
+			double child_lo[3];
+			bool overlaps = true;
+			for (int a = 0; a < 3; a++)
+			{
+				child_lo[a] = lo[a] + ((octant >> a) & 1) * half;
+				overlaps = overlaps && center[a] + reach >= child_lo[a] && center[a] - reach <= child_lo[a] + half;
+			}
+			if (!overlaps)
+				continue;
+
+			if (!nodes[n].child[octant])
+			{
+				uint32_t child = static_cast<uint32_t>(nodes.size());
+				nodes.emplace_back();
+				nodes[n].child[octant] = child;
+			}
+			insert(nodes[n].child[octant], child_lo, half, depth + 1, index, center, reach);
+		}
+	}
+
+	// Orthonormal t, b with t x b = n (Duff et al., "Building an Orthonormal
+	// Basis, Revisited").
+	static void tangent_frame(const vec3& n, vec3& t, vec3& b)
+	{
+		double sign = std::copysign(1.0, double(n.z()));
+		double a = -1 / (sign + n.z());
+		double c = n.x() * n.y() * a;
+		t = vec3(1 + sign * n.x() * n.x() * a, sign * c, -sign * n.x());
+		b = vec3(c, sign + n.y() * n.y() * a, -n.y());
+	}
+};
+
+#endif
@@ -7,11 +7,14 @@ class ray
 {
 public:
 	ray() {}
-	ray(const vec3& a, const vec3& b) : A(a), B(b) {}
+	ray(const vec3& a, const vec3& b, double spread = 0) : A(a), B(b), cone(spread) {}
 
 	vec3 origin() const { return A; }
 	vec3 direction() const { return B; }
 
+	// Spread angle of the ray cone, its width at t is roughly t * |B| * spread.
+	double spread() const { return cone; }
+
 	vec3 at(double t) const
 	{
 		return A + B * t;
@@ -20,6 +23,7 @@ public:
 private:
 	vec3 A;
 	vec3 B;
+	double cone = 0;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,60 @@
+#ifndef RAY_STATS_H
+#define RAY_STATS_H
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Work done by the calling thread. Readers take the difference across the
+// stretch they care about, e.g. one pixel for the cost maps. Counting is only
+// compiled in with -DRT_RAY_STATS; without it count_ray and test_tally do
+// nothing and the counters stay zero.
+struct ray_stats
+{
+	uint64_t rays = 0;               // Path segments traced by the integrators.
+	uint64_t intersection_tests = 0; // Ray-box and ray-primitive, counted by the accelerators.
+};
+
+inline thread_local ray_stats thread_ray_stats;
+
+#ifdef RT_RAY_STATS
+constexpr bool ray_stats_enabled = true;
+
+inline void count_ray() { thread_ray_stats.rays++; }
+
+// Counts a traversal's tests in a local and adds them to the thread's total on
+// return, so the traversal loop doesn't touch thread-local storage.
+struct test_tally
+{
+	uint64_t count = 0;
+	void add(uint64_t n) { count += n; }
+	~test_tally() { thread_ray_stats.intersection_tests += count; }
+};
+#else
+constexpr bool ray_stats_enabled = false;
+
+inline void count_ray() {}
+
+struct test_tally
+{
+	void add(uint64_t) {}
+};
+#endif
+
+// Time stamp counter, or nanoseconds where there is none.
+inline uint64_t cycle_count()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef RENDER_CACHE_H
+#define RENDER_CACHE_H
+
+#include "utility.h"
+
+#include "aabb.h"
+#include "color.h"
+#include "hittable.h"
+#include "ray.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Accumulated image of a previous render plus, per tile, the objects its primary
+// and first-bounce rays hit and the voxels of a coarse grid its first-bounce
+// rays passed through. camera::render_incremental fills it and re-renders only
+// tiles marked invalid; camera::invalidate marks the tiles an edited object can
+// have changed.
+//
+// Invalidation rules for an object that moved or changed material:
+//  - tiles whose primary or first-bounce rays hit it;
+//  - tiles its old or new bounds project onto, so it is caught where it was
+//    and where it now becomes directly visible;
+//  - tiles whose first-bounce rays crossed a voxel of its new bounds, for the
+//    reflections, contact shadows and bounce light it now casts;
+//  - every tile if the object was hit as an emitter at any depth, or if its
+//    new bounds leave the grid.
+// This is conservative for everything seen directly and through one
+// reflection, refraction or diffuse bounce. Rays after the first bounce are not
+// tracked, so light the object changes only by way of two or more bounces
+// (its bounce light seen in a mirror, say) can stay stale until clear(). Call
+// clear() after any camera or background change.
+struct render_cache
+{
+	static constexpr int grid = 32; // Voxels per axis.
+	static constexpr size_t words = grid * grid * grid / 64;
+
+	struct tile_record
+	{
+		std::vector<const hittable*> touched; // Sorted.
+		std::vector<uint64_t> crossed; // One bit per voxel.
+		bool valid = false;
+	};
+
+	int width = 0, height = 0, tile_size = 0, samples_per_pixel = 0;
+	int tiles_x = 0, tiles_y = 0;
+	std::vector<color> sum;
+	std::vector<tile_record> tiles;
+	std::vector<const hittable*> emitters; // Sorted.
+	aabb region; // Spanned by the grid: what the camera sees directly, with a margin.
+
+	bool matches(int w, int h, int ts, int spp) const
+	{
+		return w == width && h == height && ts == tile_size && spp == samples_per_pixel;
+	}
+
+	void reset(int w, int h, int ts, int spp)
+	{
+		width = w, height = h, tile_size = ts, samples_per_pixel = spp;
+		tiles_x = (w + ts - 1) / ts;
+		tiles_y = (h + ts - 1) / ts;
+		sum.assign(static_cast<size_t>(w) * h, color(0, 0, 0));
+		tiles.assign(static_cast<size_t>(tiles_x) * tiles_y, tile_record());
+		emitters.clear();
+		region = aabb();
+	}
+
+	void clear()
+	{
+		for (auto& t : tiles)
+			t.valid = false;
+		emitters.clear();
+	}
+
+	int invalid_count() const
+	{
+		return static_cast<int>(std::count_if(tiles.begin(), tiles.end(), [](const tile_record& t) { return !t.valid; }));
+	}
+
+	tile_record& at(int tx, int ty) { return tiles[static_cast<size_t>(ty) * tiles_x + tx]; }
+
+	static bool contains(const std::vector<const hittable*>& sorted, const hittable* object)
+	{
+		return std::binary_search(sorted.begin(), sorted.end(), object);
+	}
+
+	static void sort_unique(std::vector<const hittable*>& list)
+	{
+		std::sort(list.begin(), list.end());
+		list.erase(std::unique(list.begin(), list.end()), list.end());
+	}
+
+	bool covers(const aabb& box) const
+	{
+		for (int a = 0; a < 3; a++)
+			if (box.axis(a).min < region.axis(a).min || box.axis(a).max > region.axis(a).max)
+				return false;
+		return true;
+	}
+
+	// Sets the voxels r passes through up to t_end (3D DDA, Amanatides and Woo).
+	void mark(std::vector<uint64_t>& bits, const ray& r, double t_end) const
+	{
+		double t0 = 0, t1 = t_end;
+		const vec3& o = r.origin();
+		const vec3& d = r.direction();
+		for (int a = 0; a < 3; a++)
+		{
+			const interval& slab = region.axis(a);
+			if (d[a] == 0)
+			{
+				if (o[a] < slab.min || o[a] > slab.max)
+					return;
+				continue;
+			}
+			double ta = (slab.min - o[a]) / d[a], tb = (slab.max - o[a]) / d[a];
+			t0 = std::max(t0, std::min(ta, tb));
+			t1 = std::min(t1, std::max(ta, tb));
+		}
+		if (t0 > t1)
+			return;
+
+		int cell[3], step[3];
+		double t_next[3], t_delta[3];
+		for (int a = 0; a < 3; a++)
+		{
+			const interval& slab = region.axis(a);
+			double size = slab.size() / grid;
+			cell[a] = std::clamp(static_cast<int>((o[a] + t0 * d[a] - slab.min) / size), 0, grid - 1);
+			step[a] = d[a] > 0 ? 1 : d[a] < 0 ? -1 : 0;
+			if (step[a] == 0)
+			{
+				t_next[a] = t_delta[a] = infinity;
+				continue;
+			}
+			double boundary = slab.min + (cell[a] + (step[a] > 0)) * size;
+			t_next[a] = (boundary - o[a]) / d[a];
+			t_delta[a] = size / std::fabs(d[a]);
+		}
+
+		while (true)
+		{
+			size_t v = (static_cast<size_t>(cell[2]) * grid + cell[1]) * grid + cell[0];
+			bits[v / 64] |= uint64_t(1) << (v % 64);
+
+			int a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+			if (t_next[a] > t1)
+				return;
+			cell[a] += step[a];
+			if (cell[a] < 0 || cell[a] >= grid)
+				return;
+			t_next[a] += t_delta[a];
+		}
+	}
+
+	// Whether t's marked voxels include one overlapping box. A hair of padding
+	// absorbs rounding in mark.
+	bool crossed(const tile_record& t, const aabb& box) const
+	{
+		if (t.crossed.empty())
+			return false;
+
+		int lo[3], hi[3];
+		for (int a = 0; a < 3; a++)
+		{
+			const interval& slab = region.axis(a);
+			double size = slab.size() / grid, pad = 1e-3 * size;
+			lo[a] = std::clamp(static_cast<int>((box.axis(a).min - pad - slab.min) / size), 0, grid - 1);
+			hi[a] = std::clamp(static_cast<int>((box.axis(a).max + pad - slab.min) / size), 0, grid - 1);
+		}
+
+		for (int z = lo[2]; z <= hi[2]; z++)
+			for (int y = lo[1]; y <= hi[1]; y++)
+				for (int x = lo[0]; x <= hi[0]; x++)
+				{
+					size_t v = (static_cast<size_t>(z) * grid + y) * grid + x;
+					if (t.crossed[v / 64] >> (v % 64) & 1)
+						return true;
+				}
+		return false;
+	}
+};
+
+#endif
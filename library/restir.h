@@ -0,0 +1,457 @@
+#ifndef RESTIR_H
+#define RESTIR_H
+
+#include "utility.h"
+
+#include "camera.h"
+#include "color.h"
+#include "hittable.h"
+#include "image.h"
+#include "lightList.h"
+#include "material.h"
+#include "parallel.h"
+#include "rayStats.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+// Direct lighting by spatiotemporal reservoir resampling (ReSTIR; Bitterli et
+// al., "Spatiotemporal reservoir resampling for real-time ray tracing with
+// dynamic direct lighting"). Each pass traces one camera ray per pixel through
+// specular surfaces to the first diffuse one, then:
+//
+//   1. draws candidate_count points on the emitters (light_list) and keeps one
+//      by weighted reservoir sampling, in proportion to the unshadowed light it
+//      would bring (resampled importance sampling), then tests its visibility;
+//   2. if temporal_reuse, merges the previous pass's reservoir of the same
+//      pixel, its count capped at temporal_history times the new one's so old
+//      samples fade out;
+//   3. merges the reservoirs of spatial_neighbors random pixels within
+//      spatial_radius whose surface is alike (normal and depth);
+//   4. shades with the one sample the reservoir holds and a shadow ray.
+//
+// A merged reservoir is normalised by the counts of the reservoirs that could
+// have produced its sample, those whose surface it lights and can see (Z in
+// the paper's unbiased variant), at one shadow ray per merged reservoir.
+// Dropping that test saves the rays but darkens the image by a few percent.
+//
+// The image is the average of samples_per_pixel passes. Temporal reuse makes
+// each pass much less noisy but correlates it with the ones before, so the
+// average converges no faster; it is off by default and pays off when passes
+// are looked at on their own. Light reaching the diffuse surface indirectly is
+// not included.
+class restir_integrator
+{
+public:
+	int candidate_count = 32;
+	int spatial_neighbors = 5; // 0 turns spatial reuse off.
+	double spatial_radius = 30; // Pixels.
+	bool temporal_reuse = false;
+	int temporal_history = 20;
+
+	restir_integrator(camera& _cam, const light_list& _lights) : cam(_cam), lights(_lights) {}
+
+	template <typename World>
+	bool render(const World& world)
+	{
+		cam.initialize();
+
+		size_t pixels = static_cast<size_t>(cam.image_width) * cam.image_height;
+		surfaces.assign(pixels, surface());
+		previous_surfaces.assign(pixels, surface());
+		initial.resize(pixels);
+		reused.resize(pixels);
+		previous.resize(pixels);
+
+		std::vector<color> sum(pixels, color(0, 0, 0));
+		auto start = std::chrono::steady_clock::now();
+
+		int pass = 0;
+		for (; pass < cam.samples_per_pixel && !cam.cancel; pass++)
+		{
+			TRACE_SCOPE("restir pass", pass);
+			int i_s = pass % cam.sqrt_spp, j_s = pass / cam.sqrt_spp % cam.sqrt_spp;
+
+			for_pixels([&](size_t p, int i, int j)
+				{
+					sum[p] += trace_primary(world, cam.get_ray(i, j, i_s, j_s), surfaces[p]);
+					initial.store(p, sample_lights(world, surfaces[p]));
+				});
+
+			if (temporal_reuse && pass > 0)
+				for_pixels([&](size_t p, int, int) { initial.store(p, merge_previous(world, p)); });
+
+			for_pixels([&](size_t p, int i, int j)
+				{
+					reservoir r = spatial_neighbors > 0 ? merge_neighbours(world, p, i, j) : initial.load(p);
+					sum[p] += shade(world, surfaces[p], r);
+					reused.store(p, r);
+				});
+
+			std::swap(previous, reused);
+			std::swap(previous_surfaces, surfaces);
+
+			std::lock_guard<std::mutex> lock(cam.progress_mutex);
+			if (cam.progress)
+				cam.progress(pass + 1, cam.samples_per_pixel);
+			else
+				std::clog << "\rPass " << pass + 1 << " / " << cam.samples_per_pixel << " ("
+					<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s) " << std::flush;
+		}
+		std::clog << "\rDone after " << pass << " passes.                 \n";
+
+		cam.write_image(std::cout, sum, pass > 0 ? 1.0 / pass : 0);
+		return pass == cam.samples_per_pixel;
+	}
+
+private:
+	struct light_sample
+	{
+		vec3 pos, normal;
+		color emission;
+	};
+
+	// A reservoir as worked on; reservoir_buffer stores it. weight is W, the
+	// sample's contribution weight (an estimate of 1 / its density), and count
+	// is M, the number of candidates it stands for.
+	struct reservoir
+	{
+		light_sample y;
+		double weight = 0;
+		uint32_t count = 0;
+	};
+
+	// One reservoir per pixel, each field in its own array: the passes that
+	// read neighbours' reservoirs touch only what they use, and the light point
+	// takes 28 bytes in floats with the normal octahedral-packed.
+	class reservoir_buffer
+	{
+	public:
+		void resize(size_t n)
+		{
+			for (auto* v : { &x, &y, &z, &r, &g, &b, &weight })
+				v->assign(n, 0.0f);
+			normal.assign(n, 0);
+			count.assign(n, 0);
+		}
+
+		reservoir load(size_t p) const
+		{
+			reservoir res;
+			res.y.pos = vec3(x[p], y[p], z[p]);
+			res.y.normal = decode_normal(normal[p]);
+			res.y.emission = color(r[p], g[p], b[p]);
+			res.weight = weight[p];
+			res.count = count[p];
+			return res;
+		}
+
+		void store(size_t p, const reservoir& res)
+		{
+			x[p] = static_cast<float>(res.y.pos.x());
+			y[p] = static_cast<float>(res.y.pos.y());
+			z[p] = static_cast<float>(res.y.pos.z());
+			normal[p] = encode_normal(res.y.normal);
+			r[p] = static_cast<float>(res.y.emission.x());
+			g[p] = static_cast<float>(res.y.emission.y());
+			b[p] = static_cast<float>(res.y.emission.z());
+			weight[p] = static_cast<float>(res.weight);
+			count[p] = res.count;
+		}
+
+	private:
+		std::vector<float> x, y, z;   // Light point.
+		std::vector<uint32_t> normal; // Its normal, see encode_normal.
+		std::vector<float> r, g, b;   // Its emission.
+		std::vector<float> weight;
+		std::vector<uint32_t> count;
+
+		// Octahedral mapping (Cigolle et al.), 16 bits per coordinate.
+		static uint32_t encode_normal(const vec3& n)
+		{
+			double l1 = std::fabs(n.x()) + std::fabs(n.y()) + std::fabs(n.z());
+			if (l1 <= 0)
+				return 0;
+			double u = n.x() / l1, v = n.y() / l1;
+			if (n.z() < 0)
+				fold(u, v);
+
+			auto quantise = [](double c) { return static_cast<uint32_t>(std::lround((std::clamp(c, -1.0, 1.0) * .5 + .5) * 65535)); };
+			return quantise(u) | quantise(v) << 16;
+		}
+
+		static vec3 decode_normal(uint32_t e)
+		{
+			double u = (e & 0xffff) / 65535.0 * 2 - 1, v = (e >> 16) / 65535.0 * 2 - 1;
+			double z = 1 - std::fabs(u) - std::fabs(v);
+			if (z < 0)
+				fold(u, v);
+			return normalize(vec3(u, v, z));
+		}
+
+		static void fold(double& u, double& v)
+		{
+			double fu = (1 - std::fabs(v)) * (u >= 0 ? 1 : -1);
+			double fv = (1 - std::fabs(u)) * (v >= 0 ? 1 : -1);
+			u = fu;
+			v = fv;
+		}
+	};
+
+	// Where a pixel's camera ray first reached a diffuse surface.
+	struct surface
+	{
+		hit_record rec;
+		ray incoming;
+		color throughput; // Of the specular bounces on the way.
+		double depth = 0; // Distance travelled from the camera.
+		bool valid = false; // False if the ray escaped, ended on a light or was absorbed.
+	};
+
+	camera& cam;
+	const light_list& lights;
+	std::vector<surface> surfaces, previous_surfaces;
+	reservoir_buffer initial, reused, previous;
+
+	template <typename F>
+	void for_pixels(F&& f) const
+	{
+		int width = cam.image_width;
+		parallel_for(cam.image_height, [&](size_t b, size_t e)
+			{
+				for (size_t j = b; j < e; j++)
+					for (int i = 0; i < width; i++)
+						f(j * width + i, i, static_cast<int>(j));
+			});
+	}
+
+	// Follows r through specular bounces and fills s with the first diffuse
+	// surface; returns the light emitted towards the camera on the way.
+	template <typename World>
+	color trace_primary(const World& world, ray r, surface& s) const
+	{
+		color throughput(1, 1, 1), radiance(0, 0, 0);
+		double depth = 0;
+		s.valid = false;
+
+		for (int bounce = 0; bounce < cam.max_depth; bounce++)
+		{
+			hit_record rec;
+			count_ray();
+			if (!world.hit(r, interval(ray_epsilon, infinity), rec))
+				return radiance + throughput * cam.miss_color(r);
+
+			depth += rec.t * r.direction().length();
+			radiance += throughput * rec.mat->emitted(rec.u, rec.v, rec.pos);
+
+			ray scattered;
+			color attenuation;
+			if (!rec.mat->scatter(r, rec, attenuation, scattered))
+				return radiance;
+
+			if (!rec.mat->is_specular())
+			{
+				s.rec = rec;
+				s.incoming = r;
+				s.throughput = throughput;
+				s.depth = depth;
+				s.valid = true;
+				return radiance;
+			}
+
+			throughput = throughput * attenuation;
+			r = ray(rec.pos, scattered.direction(), r.spread());
+		}
+		return radiance;
+	}
+
+	// Light y brings to the camera through s, ignoring what lies between.
+	color unshadowed(const surface& s, const light_sample& y) const
+	{
+		vec3 d = y.pos - s.rec.pos;
+		double distance_squared = d.length_squared();
+		if (!s.valid || distance_squared <= 0)
+			return color(0, 0, 0);
+
+		vec3 dir = d / std::sqrt(distance_squared);
+		double cos_light = std::fabs(dot(y.normal, dir));
+		color f = s.rec.mat->eval(s.incoming, s.rec, ray(s.rec.pos, dir));
+		return s.throughput * f * y.emission * (cos_light / distance_squared);
+	}
+
+	// The target density, up to a constant: the unshadowed contribution's luminance.
+	double target(const surface& s, const light_sample& y) const { return luminance(unshadowed(s, y)); }
+
+	template <typename World>
+	reservoir sample_lights(const World& world, const surface& s) const
+	{
+		reservoir r;
+		if (!s.valid || lights.empty())
+			return r;
+
+		double weight_sum = 0, chosen = 0;
+		for (int k = 0; k < candidate_count; k++)
+		{
+			light_list::point p = lights.sample();
+			light_sample y = { p.rec.pos, p.rec.normal, p.emission };
+			double t = target(s, y);
+			double w = p.pdf > 0 ? t / p.pdf : 0;
+
+			weight_sum += w;
+			if (w > 0 && random_double() * weight_sum < w)
+			{
+				r.y = y;
+				chosen = t;
+			}
+		}
+
+		r.count = candidate_count;
+		r.weight = chosen > 0 ? weight_sum / (candidate_count * chosen) : 0;
+
+		// Occluded samples are dropped before they can spread to neighbours.
+		if (r.weight > 0 && !visible(world, s.rec.pos, r.y.pos))
+			r.weight = 0;
+		return r;
+	}
+
+	// Streams q into r for a pixel whose surface is s; chosen receives the
+	// target of q's sample if it was taken.
+	static bool stream(reservoir& r, double& weight_sum, const reservoir& q, double t, double& chosen)
+	{
+		double w = t * q.weight * q.count;
+		weight_sum += w;
+		r.count += q.count;
+		if (w > 0 && random_double() * weight_sum < w)
+		{
+			r.y = q.y;
+			chosen = t;
+			return true;
+		}
+		return false;
+	}
+
+	// Pixels are jittered differently in every pass, so the previous surface may
+	// be another object at an edge; it is checked like a neighbour's.
+	template <typename World>
+	reservoir merge_previous(const World& world, size_t p) const
+	{
+		const surface& s = surfaces[p];
+		const surface& last = previous_surfaces[p];
+		reservoir current = initial.load(p);
+		if (!s.valid || !alike(last, s))
+			return current;
+
+		reservoir old = previous.load(p);
+		old.count = std::min<uint32_t>(old.count, temporal_history * std::max<uint32_t>(current.count, 1));
+
+		reservoir r;
+		double weight_sum = 0, chosen = 0;
+		stream(r, weight_sum, current, current.weight > 0 ? target(s, current.y) : 0, chosen);
+		bool from_old = stream(r, weight_sum, old, old.weight > 0 ? target(s, old.y) : 0, chosen);
+		if (chosen <= 0)
+			return r;
+
+		// Each reservoir holds only samples visible from its surface, so only the
+		// one the sample didn't come from needs testing.
+		double z = 0;
+		z += from_old ? (reaches(world, s, r.y) ? current.count : 0) : current.count;
+		z += from_old ? old.count : (reaches(world, last, r.y) ? old.count : 0);
+		r.weight = weight_sum / (z * chosen);
+		return r;
+	}
+
+	template <typename World>
+	reservoir merge_neighbours(const World& world, size_t p, int i, int j) const
+	{
+		const surface& s = surfaces[p];
+		reservoir own = initial.load(p);
+		if (!s.valid)
+			return own;
+
+		size_t merged[32];
+		uint32_t counts[32];
+		int merged_count = 0, source = 0;
+
+		reservoir r;
+		double weight_sum = 0, chosen = 0;
+		stream(r, weight_sum, own, own.weight > 0 ? target(s, own.y) : 0, chosen);
+		merged[merged_count] = p;
+		counts[merged_count++] = own.count;
+
+		int width = cam.image_width, height = cam.image_height;
+		for (int k = 0; k < std::min(spatial_neighbors, 31); k++)
+		{
+			vec3 offset = random_in_unit_disk() * spatial_radius;
+			int ni = i + static_cast<int>(std::lround(offset.x())), nj = j + static_cast<int>(std::lround(offset.y()));
+			if (ni < 0 || nj < 0 || ni >= width || nj >= height || (ni == i && nj == j))
+				continue;
+
+			size_t q = static_cast<size_t>(nj) * width + ni;
+			if (!alike(surfaces[q], s))
+				continue;
+
+			reservoir other = initial.load(q);
+			if (stream(r, weight_sum, other, other.weight > 0 ? target(s, other.y) : 0, chosen))
+				source = merged_count;
+			merged[merged_count] = q;
+			counts[merged_count++] = other.count;
+		}
+		if (chosen <= 0)
+			return r;
+
+		// Z: the candidates of the reservoirs that could have produced the sample,
+		// those whose surface it lights and can see.
+		double z = 0;
+		for (int k = 0; k < merged_count; k++)
+			if (k == source || reaches(world, surfaces[merged[k]], r.y))
+				z += counts[k];
+
+		r.weight = weight_sum / (z * chosen);
+		return r;
+	}
+
+	template <typename World>
+	bool reaches(const World& world, const surface& s, const light_sample& y) const
+	{
+		return target(s, y) > 0 && visible(world, s.rec.pos, y.pos);
+	}
+
+	static bool alike(const surface& a, const surface& b)
+	{
+		return a.valid && b.valid && dot(a.rec.normal, b.rec.normal) >= .9 && std::fabs(a.depth - b.depth) <= .1 * b.depth;
+	}
+
+	// A sample found occluded here is dropped from r too, so the next pass
+	// doesn't carry it forward.
+	template <typename World>
+	color shade(const World& world, const surface& s, reservoir& r) const
+	{
+		if (!s.valid || r.weight <= 0)
+			return color(0, 0, 0);
+
+		color c = unshadowed(s, r.y);
+		if (c.near_zero() || !visible(world, s.rec.pos, r.y.pos))
+		{
+			r.weight = 0;
+			return color(0, 0, 0);
+		}
+		return c * r.weight;
+	}
+
+	template <typename World>
+	bool visible(const World& world, const vec3& a, const vec3& b) const
+	{
+		vec3 d = b - a;
+		double distance = d.length();
+		count_ray();
+		return !world.occluded(ray(a, d / distance), interval(ray_epsilon, distance - ray_epsilon));
+	}
+};
+
+#endif
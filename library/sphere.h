@@ -4,46 +4,119 @@
 #include "hittable.h"
 #include "utility.h"
 
-class sphere : public hittable
+#include <utility>
+
+class sphere final : public hittable
 {
 public:
 	sphere(vec3 _center, double _radius, shared_ptr<material> _material) : 
-		center(_center), radius(_radius), mat(_material) {}
+		center(_center), radius(_radius), mat(_material)
+	{
+		auto rvec = vec3(radius, radius, radius);
+		bbox = aabb(center - rvec, center + rvec);
+	}
 
 	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+	{
+		double root;
+		if (!nearest_root(r, ray_t, root))
+			return false;
+
+		rec.t = root;
+		rec.pos = r.at(root);
+		vec3 outward_normal = (rec.pos - center) / radius;
+		rec.set_normal(r, outward_normal);
+		get_sphere_uv(outward_normal, rec.u, rec.v);
+		rec.uv_width = root * r.direction().length() * r.spread() / (pi * radius);
+		rec.mat = mat.get();
+		rec.object = this;
+
+		return true;
+	}
+
+	bool occluded(const ray& r, interval ray_t) const override
+	{
+		double root;
+		return nearest_root(r, ray_t, root);
+	}
+
+	aabb bounding_box() const override { return bbox; }
+
+	double area() const override { return 4 * pi * radius * radius; }
+
+	void sample_surface(hit_record& rec) const override
+	{
+		rec.normal = random_unit_vector();
+		rec.pos = center + radius * rec.normal;
+		rec.front_face = true;
+		get_sphere_uv(rec.normal, rec.u, rec.v);
+		rec.uv_width = 0;
+		rec.mat = mat.get();
+		rec.object = this;
+	}
+
+	const vec3& get_center() const { return center; }
+
+	void set_center(const vec3& c)
+	{
+		center = c;
+		auto rvec = vec3(radius, radius, radius);
+		bbox = aabb(center - rvec, center + rvec);
+	}
+
+private:
+	vec3 center;
+	double radius;
+	shared_ptr<material> mat;
+	aabb bbox;
+
+	bool nearest_root(const ray& r, interval ray_t, double& root) const
 	{
 		vec3 oc = r.origin() - center;
 		auto a = r.direction().length_squared();
 		auto half_b = dot(oc, r.direction());
 		auto c = oc.length_squared() - radius * radius;
 
-		auto discriminant = half_b * half_b - a * c;
+		// half_b^2 - a*c cancels badly when the ray passes far from the centre or the
+		// sphere is large; r^2 - |oc - (half_b / a) d|^2 is the same quantity without
+		// the subtraction of two large numbers (Haines et al., Ray Tracing Gems ch. 7).
+		vec3 l = oc - (half_b / a) * r.direction();
+		auto discriminant = a * (radius * radius - l.length_squared());
 		if (discriminant < 0)
 			return false;
 
 		auto sqrtd = sqrt(discriminant);
 
+		// Both roots without cancellation: q has the sign of -half_b.
+		auto q = half_b > 0 ? -half_b - sqrtd : -half_b + sqrtd;
+		auto near_root = q / a, far_root = c / q;
+		if (near_root > far_root)
+			std::swap(near_root, far_root);
+
 		// Find the nearest root that lies in the acceptable range.
-		auto root = (-half_b - sqrtd) / a;
+		root = near_root;
 		if (!ray_t.surrounds(root))
 		{
-			root = (-half_b + sqrtd) / a;
+			root = far_root;
 			if (!ray_t.surrounds(root))
 				return false;
 		}
 
-		rec.t = root;
-		rec.pos = r.at(root);
-		rec.set_normal(r, (rec.pos - center) / radius);
-		rec.mat = mat;
-
 		return true;
 	}
 
-private:
-	vec3 center;
-	double radius;
-	shared_ptr<material> mat;
+	static void get_sphere_uv(const vec3& p, double& u, double& v)
+	{
+		// p: a given point on the sphere of radius one, centered at the origin.
+		// u: returned value [0,1] of angle around the Y axis from X=-1.
+		// v: returned value [0,1] of angle from Y=-1 to Y=+1.
+
+		auto theta = acos(-p.y());
+		auto phi = atan2(-p.z(), p.x()) + pi;
+
+		u = phi / (2 * pi);
+		v = theta / pi;
+	}
 };
 
 #endif
\ No newline at end of file
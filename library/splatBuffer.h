@@ -0,0 +1,51 @@
+#ifndef SPLAT_BUFFER_H
+#define SPLAT_BUFFER_H
+
+#include "utility.h"
+
+#include "color.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Image any thread can add to at any pixel, for samples that land away from the
+// pixel being rendered (light paths connected to the camera, Metropolis
+// chains). Components are updated by compare-and-swap; splats scatter over the
+// image, so two threads rarely meet on one pixel.
+class splat_buffer
+{
+public:
+	splat_buffer(int w, int h)
+		: width(w), height(h), values(new std::atomic<double>[static_cast<size_t>(w) * h * 3]())
+	{
+	}
+
+	void add(int i, int j, const color& c)
+	{
+		std::atomic<double>* v = &values[(static_cast<size_t>(j) * width + i) * 3];
+		for (int k = 0; k < 3; k++)
+		{
+			double current = v[k].load(std::memory_order_relaxed);
+			while (!v[k].compare_exchange_weak(current, current + c[k], std::memory_order_relaxed))
+				;
+		}
+	}
+
+	// Adds scale times the splats to framebuffer; call once the splatting threads are done.
+	void add_to(std::vector<color>& framebuffer, double scale) const
+	{
+		for (size_t p = 0; p < framebuffer.size(); p++)
+		{
+			const std::atomic<double>* v = &values[p * 3];
+			framebuffer[p] += scale * color(v[0].load(std::memory_order_relaxed), v[1].load(std::memory_order_relaxed),
+				v[2].load(std::memory_order_relaxed));
+		}
+	}
+
+private:
+	int width, height;
+	std::unique_ptr<std::atomic<double>[]> values;
+};
+
+#endif
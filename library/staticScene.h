@@ -0,0 +1,76 @@
+#ifndef STATIC_SCENE_H
+#define STATIC_SCENE_H
+
+#include "utility.h"
+#include "hittable.h"
+
+#include <tuple>
+#include <vector>
+
+// Scene container closed over a fixed list of primitive types. Each type lives by
+// value in its own contiguous array and is intersected through its concrete type,
+// so the compiler can inline sphere::hit and friends straight into the render loop.
+// Use hittable_list when the set of types has to stay open.
+template <typename... Prims>
+class static_scene final : public hittable
+{
+public:
+	template <typename T>
+	void add(T object)
+	{
+		bbox = aabb(bbox, object.bounding_box());
+		std::get<std::vector<T>>(objects).push_back(std::move(object));
+	}
+
+	size_t size() const
+	{
+		return std::apply([](const auto&... lists) { return (lists.size() + ... + 0); }, objects);
+	}
+
+	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+	{
+		bool hit_anything = false;
+		std::apply([&](const auto&... lists) { ((hit_anything |= hit_all(lists, r, ray_t, rec)), ...); }, objects);
+		return hit_anything;
+	}
+
+	bool occluded(const ray& r, interval ray_t) const override
+	{
+		return std::apply([&](const auto&... lists) { return (occluded_any(lists, r, ray_t) || ...); }, objects);
+	}
+
+	aabb bounding_box() const override { return bbox; }
+
+private:
+	std::tuple<std::vector<Prims>...> objects;
+	aabb bbox;
+
+	template <typename T>
+	static bool hit_all(const std::vector<T>& list, const ray& r, interval& ray_t, hit_record& rec)
+	{
+		// The built-in primitives only write rec on a hit, so no temporary record is needed.
+		bool hit_anything = false;
+		for (const auto& object : list)
+		{
+			if (object.T::hit(r, ray_t, rec))
+			{
+				hit_anything = true;
+				ray_t.max = rec.t;
+			}
+		}
+
+		return hit_anything;
+	}
+
+	template <typename T>
+	static bool occluded_any(const std::vector<T>& list, const ray& r, interval ray_t)
+	{
+		for (const auto& object : list)
+			if (object.T::occluded(r, ray_t))
+				return true;
+
+		return false;
+	}
+};
+
+#endif
@@ -0,0 +1,249 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "utility.h"
+
+#include "color.h"
+#include "image.h"
+#include "textureCache.h"
+
+#include <algorithm>
+#include <vector>
+
+class texture
+{
+public:
+	virtual ~texture() = default;
+
+	// uv_width is the approximate footprint of the lookup in uv space, 0 asks for
+	// the finest detail.
+	virtual color value(double u, double v, const vec3& p, double uv_width = 0) const = 0;
+};
+
+class solid_color : public texture
+{
+public:
+	solid_color(const color& c) : albedo(c) {}
+
+	solid_color(double red, double green, double blue) : solid_color(color(red, green, blue)) {}
+
+	color value(double u, double v, const vec3& p, double uv_width = 0) const override
+	{
+		return albedo;
+	}
+
+private:
+	color albedo;
+};
+
+// Procedural 3D checker, independent of the surface parameterisation.
+class checker_texture : public texture
+{
+public:
+	checker_texture(double _scale, shared_ptr<texture> _even, shared_ptr<texture> _odd)
+		: inv_scale(1.0 / _scale), even(_even), odd(_odd) {}
+
+	checker_texture(double _scale, const color& c1, const color& c2)
+		: checker_texture(_scale, make_shared<solid_color>(c1), make_shared<solid_color>(c2)) {}
+
+	color value(double u, double v, const vec3& p, double uv_width = 0) const override
+	{
+		auto x = static_cast<int>(std::floor(inv_scale * p.x()));
+		auto y = static_cast<int>(std::floor(inv_scale * p.y()));
+		auto z = static_cast<int>(std::floor(inv_scale * p.z()));
+
+		bool is_even = (x + y + z) % 2 == 0;
+		return is_even ? even->value(u, v, p, uv_width) : odd->value(u, v, p, uv_width);
+	}
+
+private:
+	double inv_scale;
+	shared_ptr<texture> even;
+	shared_ptr<texture> odd;
+};
+
+// Image texture stored as a mip pyramid of cache tiles. The source image is only
+// held during construction; afterwards every texel read goes through the
+// texture_cache, so memory use is bounded by the cache budget. Lookups are
+// trilinear, with the level picked from the hit's uv footprint.
+class image_texture : public texture
+{
+public:
+	image_texture(const char* filename, shared_ptr<texture_cache> _cache) : cache(_cache)
+	{
+		image_data img;
+		if (!load_image(filename, img))
+		{
+			std::cerr << "image_texture: could not load " << filename << '\n';
+			img.resize(1, 1);
+			img.set(0, 0, color(0, 1, 1)); // Cyan stands out as a missing texture.
+		}
+
+		build(std::move(img));
+	}
+
+	image_texture(image_data img, shared_ptr<texture_cache> _cache) : cache(_cache)
+	{
+		build(std::move(img));
+	}
+
+	color value(double u, double v, const vec3& p, double uv_width = 0) const override
+	{
+		// Repeat in u, clamp in v; image row 0 is v = 1.
+		u = u - std::floor(u);
+		v = 1.0 - std::clamp(v, 0.0, 1.0);
+
+		double lod = uv_width > 0 ? std::log2(uv_width * std::max(levels[0].width, levels[0].height)) : 0;
+		lod = std::clamp(lod, 0.0, static_cast<double>(levels.size() - 1));
+
+		int l0 = static_cast<int>(lod);
+		int l1 = std::min(l0 + 1, static_cast<int>(levels.size()) - 1);
+		double t = lod - l0;
+
+		color c = bilinear(l0, u, v);
+		return t > 0 ? (1 - t) * c + t * bilinear(l1, u, v) : c;
+	}
+
+	int width() const { return levels[0].width; }
+	int height() const { return levels[0].height; }
+
+private:
+	struct level
+	{
+		int width, height;
+		int tiles_x, tiles_y;
+		uint32_t first_tile;
+	};
+
+	shared_ptr<texture_cache> cache;
+	std::vector<level> levels;
+
+	void build(image_data img)
+	{
+		while (true)
+		{
+			store_level(img);
+			if (img.width == 1 && img.height == 1)
+				break;
+			img = downsample(img);
+		}
+	}
+
+	void store_level(const image_data& img)
+	{
+		const int ts = texture_tile::size;
+
+		level lv;
+		lv.width = img.width;
+		lv.height = img.height;
+		lv.tiles_x = (img.width + ts - 1) / ts;
+		lv.tiles_y = (img.height + ts - 1) / ts;
+
+		texture_tile tile;
+		for (int ty = 0; ty < lv.tiles_y; ty++)
+		{
+			for (int tx = 0; tx < lv.tiles_x; tx++)
+			{
+				// Edge tiles replicate the last row/column.
+				for (int y = 0; y < ts; y++)
+				{
+					int sy = std::min(ty * ts + y, img.height - 1);
+					for (int x = 0; x < ts; x++)
+					{
+						int sx = std::min(tx * ts + x, img.width - 1);
+						const float* src = &img.pixels[(static_cast<size_t>(sy) * img.width + sx) * 3];
+						std::copy(src, src + 3, &tile.texels[(y * ts + x) * 3]);
+					}
+				}
+
+				uint32_t id = cache->store(tile);
+				if (tx == 0 && ty == 0)
+					lv.first_tile = id;
+			}
+		}
+
+		levels.push_back(lv);
+	}
+
+	static image_data downsample(const image_data& img)
+	{
+		image_data out;
+		out.resize(std::max(1, img.width / 2), std::max(1, img.height / 2));
+
+		for (int y = 0; y < out.height; y++)
+		{
+			for (int x = 0; x < out.width; x++)
+			{
+				int x0 = std::min(2 * x, img.width - 1), x1 = std::min(2 * x + 1, img.width - 1);
+				int y0 = std::min(2 * y, img.height - 1), y1 = std::min(2 * y + 1, img.height - 1);
+				out.set(x, y, .25 * (img.at(x0, y0) + img.at(x1, y0) + img.at(x0, y1) + img.at(x1, y1)));
+			}
+		}
+
+		return out;
+	}
+
+	// x wraps around the level, y is clamped, matching value()'s repeat in u.
+	color texel(int l, int x, int y) const
+	{
+		const int ts = texture_tile::size;
+		const level& lv = levels[l];
+
+		x = wrap(x, lv.width);
+		y = std::clamp(y, 0, lv.height - 1);
+
+		uint32_t id = lv.first_tile + (y / ts) * lv.tiles_x + (x / ts);
+		auto tile = cache->fetch(id);
+		const float* p = tile->at(x % ts, y % ts);
+		return color(p[0], p[1], p[2]);
+	}
+
+	color bilinear(int l, double u, double v) const
+	{
+		const int ts = texture_tile::size;
+		const level& lv = levels[l];
+		double x = u * lv.width - .5;
+		double y = v * lv.height - .5;
+
+		int x0 = static_cast<int>(std::floor(x));
+		int y0 = static_cast<int>(std::floor(y));
+		double fx = x - x0, fy = y - y0;
+
+		int x1 = wrap(x0 + 1, lv.width), y1 = std::clamp(y0 + 1, 0, lv.height - 1);
+		x0 = wrap(x0, lv.width);
+		y0 = std::clamp(y0, 0, lv.height - 1);
+
+		color c00, c10, c01, c11;
+		if (x0 / ts == x1 / ts && y0 / ts == y1 / ts)
+		{
+			// The usual case: one tile holds the whole footprint, fetched once.
+			auto tile = cache->fetch(lv.first_tile + (y0 / ts) * lv.tiles_x + (x0 / ts));
+			auto at = [&](int tx, int ty)
+				{
+					const float* p = tile->at(tx % ts, ty % ts);
+					return color(p[0], p[1], p[2]);
+				};
+			c00 = at(x0, y0);
+			c10 = at(x1, y0);
+			c01 = at(x0, y1);
+			c11 = at(x1, y1);
+		}
+		else
+		{
+			c00 = texel(l, x0, y0);
+			c10 = texel(l, x1, y0);
+			c01 = texel(l, x0, y1);
+			c11 = texel(l, x1, y1);
+		}
+
+		return (1 - fx) * (1 - fy) * c00 + fx * (1 - fy) * c10 + (1 - fx) * fy * c01 + fx * fy * c11;
+	}
+
+	static int wrap(int x, int width)
+	{
+		x %= width;
+		return x < 0 ? x + width : x;
+	}
+};
+
+#endif
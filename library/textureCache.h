@@ -0,0 +1,235 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+// Fixed-size square tile of RGB float texels.
+struct texture_tile
+{
+	static constexpr int size = 32;
+	static constexpr size_t bytes = size * size * 3 * sizeof(float);
+
+	float texels[size * size * 3];
+
+	const float* at(int x, int y) const { return &texels[(y * size + x) * 3]; }
+};
+
+// Memory-bounded LRU cache of texture tiles. Image textures write all their tiles
+// once into an unlinked temporary backing file and afterwards only touch them
+// through the cache, so resident texel memory never exceeds the budget no
+// matter how large the scene's textures are. Locks are sharded by tile id and the
+// backing file is read with positional reads, so render threads paging tiles in
+// don't serialise on one mutex or file position. Tiles that can't be written to
+// the backing file (no temporary file, disk full) are kept in memory instead,
+// outside the budget.
+class texture_cache
+{
+public:
+	texture_cache(size_t budget_bytes = size_t(256) << 20) : backing(std::tmpfile())
+	{
+		if (!backing)
+			std::cerr << "texture_cache: could not create backing file, keeping tiles in memory\n";
+
+		size_t per_shard = budget_bytes / shard_count;
+		for (auto& s : shards)
+			s.capacity = per_shard / texture_tile::bytes > 0 ? per_shard / texture_tile::bytes : 1;
+	}
+
+	~texture_cache()
+	{
+		if (backing)
+			std::fclose(backing);
+	}
+
+	texture_cache(const texture_cache&) = delete;
+	texture_cache& operator=(const texture_cache&) = delete;
+
+	// Appends a tile to the backing file and returns its id.
+	uint32_t store(const texture_tile& tile)
+	{
+		std::lock_guard<std::mutex> lock(file_mutex);
+		bool written = false;
+		if (backing)
+		{
+			written = write_at(tile.texels, static_cast<uint64_t>(tile_count) * texture_tile::bytes);
+			if (!written && !write_failed)
+				std::cerr << "texture_cache: could not write to backing file, keeping tiles in memory\n";
+			write_failed |= !written;
+		}
+
+		in_memory.push_back(written ? nullptr : std::make_shared<const texture_tile>(tile));
+		return tile_count++;
+	}
+
+	// Returns the resident tile, paging it in and evicting the least recently used
+	// tile when the shard is over budget. The shared_ptr keeps an evicted tile alive
+	// for callers still reading it.
+	std::shared_ptr<const texture_tile> fetch(uint32_t id)
+	{
+		shard& s = shards[id % shard_count];
+		{
+			std::lock_guard<std::mutex> lock(s.mutex);
+			auto it = s.entries.find(id);
+			if (it != s.entries.end())
+			{
+				s.lru.splice(s.lru.begin(), s.lru, it->second.lru_pos);
+				s.hits++;
+				return it->second.tile;
+			}
+		}
+
+		std::shared_ptr<const texture_tile> tile;
+		{
+			std::lock_guard<std::mutex> lock(file_mutex);
+			if (id < in_memory.size())
+				tile = in_memory[id];
+		}
+		if (!tile)
+			tile = read(id);
+
+		std::lock_guard<std::mutex> lock(s.mutex);
+		s.misses++;
+
+		// Another thread may have paged it in while we were reading.
+		auto it = s.entries.find(id);
+		if (it != s.entries.end())
+			return it->second.tile;
+
+		while (s.entries.size() >= s.capacity)
+		{
+			s.entries.erase(s.lru.back());
+			s.lru.pop_back();
+			s.evictions++;
+		}
+
+		s.lru.push_front(id);
+		s.entries.emplace(id, entry{ tile, s.lru.begin() });
+		return tile;
+	}
+
+	void report(std::ostream& out)
+	{
+		size_t hits = 0, misses = 0, evictions = 0, resident = 0;
+		for (auto& s : shards)
+		{
+			std::lock_guard<std::mutex> lock(s.mutex);
+			hits += s.hits;
+			misses += s.misses;
+			evictions += s.evictions;
+			resident += s.entries.size();
+		}
+
+		out << "Texture cache: " << tile_count << " tiles stored, "
+			<< resident * texture_tile::bytes / 1024 << " KB resident, "
+			<< hits << " hits, " << misses << " misses, " << evictions << " evictions\n";
+	}
+
+private:
+	static constexpr int shard_count = 16;
+
+	struct entry
+	{
+		std::shared_ptr<const texture_tile> tile;
+		std::list<uint32_t>::iterator lru_pos;
+	};
+
+	struct shard
+	{
+		std::mutex mutex;
+		std::list<uint32_t> lru;
+		std::unordered_map<uint32_t, entry> entries;
+		size_t capacity = 1;
+		size_t hits = 0, misses = 0, evictions = 0;
+	};
+
+	shard shards[shard_count];
+	std::mutex file_mutex;
+	std::FILE* backing;
+	std::vector<std::shared_ptr<const texture_tile>> in_memory; // By id, null for tiles in the file.
+	bool write_failed = false;
+	uint32_t tile_count = 0;
+
+	std::shared_ptr<const texture_tile> read(uint32_t id) const
+	{
+		auto tile = std::make_shared<texture_tile>();
+		if (!read_at(tile->texels, static_cast<uint64_t>(id) * texture_tile::bytes))
+			std::fill(std::begin(tile->texels), std::end(tile->texels), 0.0f);
+		return tile;
+	}
+
+	// Positional I/O on the backing file's descriptor, bypassing stdio's buffer
+	// and shared file position, so reads need no lock.
+#ifdef _WIN32
+	HANDLE handle() const { return reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(backing))); }
+
+	static OVERLAPPED at(uint64_t offset)
+	{
+		OVERLAPPED o = {};
+		o.Offset = static_cast<DWORD>(offset);
+		o.OffsetHigh = static_cast<DWORD>(offset >> 32);
+		return o;
+	}
+
+	bool read_at(float* texels, uint64_t offset) const
+	{
+		OVERLAPPED o = at(offset);
+		DWORD done = 0;
+		return ReadFile(handle(), texels, texture_tile::bytes, &done, &o) && done == texture_tile::bytes;
+	}
+
+	bool write_at(const float* texels, uint64_t offset)
+	{
+		OVERLAPPED o = at(offset);
+		DWORD done = 0;
+		return WriteFile(handle(), texels, texture_tile::bytes, &done, &o) && done == texture_tile::bytes;
+	}
+#else
+	bool read_at(float* texels, uint64_t offset) const
+	{
+		char* p = reinterpret_cast<char*>(texels);
+		for (size_t left = texture_tile::bytes; left > 0;)
+		{
+			ssize_t n = pread(fileno(backing), p, left, static_cast<off_t>(offset));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			p += n, left -= n, offset += n;
+		}
+		return true;
+	}
+
+	bool write_at(const float* texels, uint64_t offset)
+	{
+		const char* p = reinterpret_cast<const char*>(texels);
+		for (size_t left = texture_tile::bytes; left > 0;)
+		{
+			ssize_t n = pwrite(fileno(backing), p, left, static_cast<off_t>(offset));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			p += n, left -= n, offset += n;
+		}
+		return true;
+	}
+#endif
+};
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef TILE_WRITER_H
+#define TILE_WRITER_H
+
+#include "trace.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Writes a binary PPM (P6) tile by tile from a background thread. The file is
+// sized up front, so every tile row has a fixed offset and can go straight to
+// its place with pwrite. Render threads hand over finished tiles through a
+// bounded queue and block when it is full, so memory holds at most the tiles
+// being rendered plus max_queued waiting ones, whatever the image size.
+class tile_writer
+{
+public:
+	struct tile_data
+	{
+		int x0, y0, width, height;
+		std::vector<uint8_t> rgb; // width * height * 3 bytes, rows top to bottom.
+	};
+
+	tile_writer(const char* path, int _image_width, int _image_height, size_t _max_queued = 64)
+		: image_width(_image_width), image_height(_image_height), max_queued(_max_queued)
+	{
+		std::string header = "P6\n" + std::to_string(image_width) + ' ' + std::to_string(image_height) + "\n255\n";
+		header_bytes = header.size();
+		uint64_t total = header_bytes + static_cast<uint64_t>(image_width) * image_height * 3;
+
+#ifdef _WIN32
+		file = std::fopen(path, "w+b");
+		ok = file != nullptr;
+		if (ok)
+		{
+			// Writing the last byte sizes the file.
+			ok = _fseeki64(file, static_cast<__int64>(total - 1), SEEK_SET) == 0 && std::fputc(0, file) != EOF;
+			ok = ok && write_at(0, header.data(), header.size());
+		}
+#else
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		ok = fd >= 0 && ftruncate(fd, static_cast<off_t>(total)) == 0;
+		ok = ok && write_at(0, header.data(), header.size());
+#endif
+
+		if (!ok)
+			std::cerr << "tile_writer: could not create " << path << '\n';
+
+		worker = std::thread([this] { run(); });
+	}
+
+	~tile_writer()
+	{
+		finish();
+	}
+
+	tile_writer(const tile_writer&) = delete;
+	tile_writer& operator=(const tile_writer&) = delete;
+
+	// Queues a finished tile, blocking while the writer is max_queued tiles behind.
+	void submit(tile_data tile)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		space.wait(lock, [this] { return queue.size() < max_queued; });
+
+		queued_bytes += tile.rgb.size();
+		peak_queued_bytes = std::max(peak_queued_bytes, queued_bytes);
+		queue.push_back(std::move(tile));
+		ready.notify_one();
+	}
+
+	// Drains the queue and closes the file. Returns false if any write failed.
+	bool finish()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopping)
+				return ok;
+			stopping = true;
+		}
+		ready.notify_one();
+		worker.join();
+
+#ifdef _WIN32
+		if (file)
+			std::fclose(file);
+#else
+		if (fd >= 0)
+			close(fd);
+#endif
+		return ok;
+	}
+
+	size_t peak_queued() const { return peak_queued_bytes; }
+
+private:
+	int image_width, image_height;
+	size_t max_queued;
+	uint64_t header_bytes = 0;
+	bool ok = false;
+
+#ifdef _WIN32
+	std::FILE* file = nullptr;
+#else
+	int fd = -1;
+#endif
+
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable ready, space;
+	std::deque<tile_data> queue;
+	size_t queued_bytes = 0, peak_queued_bytes = 0;
+	bool stopping = false;
+
+	bool write_at(uint64_t offset, const void* bytes, size_t count)
+	{
+#ifdef _WIN32
+		return _fseeki64(file, static_cast<__int64>(offset), SEEK_SET) == 0 && std::fwrite(bytes, 1, count, file) == count;
+#else
+		const char* p = static_cast<const char*>(bytes);
+		while (count > 0)
+		{
+			ssize_t n = pwrite(fd, p, count, static_cast<off_t>(offset));
+			if (n <= 0)
+				return false;
+			p += n;
+			offset += n;
+			count -= n;
+		}
+		return true;
+#endif
+	}
+
+	void run()
+	{
+		while (true)
+		{
+			tile_data tile;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [this] { return stopping || !queue.empty(); });
+				if (queue.empty())
+					return;
+
+				tile = std::move(queue.front());
+				queue.pop_front();
+				queued_bytes -= tile.rgb.size();
+			}
+			space.notify_one();
+
+			TRACE_SCOPE("write tile");
+			for (int y = 0; y < tile.height && ok; y++)
+			{
+				uint64_t offset = header_bytes + (static_cast<uint64_t>(tile.y0 + y) * image_width + tile.x0) * 3;
+				ok = write_at(offset, &tile.rgb[static_cast<size_t>(y) * tile.width * 3], static_cast<size_t>(tile.width) * 3);
+			}
+		}
+	}
+};
+
+#endif
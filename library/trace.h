@@ -0,0 +1,163 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Timeline of named scopes per thread, written as Chrome trace JSON for
+// about:tracing or ui.perfetto.dev. Each thread records into its own ring
+// buffer, so recording takes no locks; a full buffer overwrites its oldest
+// events. While tracing is off a scope costs one relaxed load and a branch;
+// building with -DRT_NO_TRACE removes the scopes altogether.
+//
+//   trace_recorder::instance().start();
+//   { TRACE_SCOPE("bvh build"); ... }
+//   trace_recorder::instance().write("trace.json"); // Once the work is done.
+class trace_recorder
+{
+public:
+	static constexpr size_t buffer_events = size_t(1) << 16; // Per thread, a power of two.
+
+	struct event
+	{
+		const char* name; // Must be a string literal or otherwise outlive the recorder.
+		int64_t arg;      // Shown as args.n when >= 0, e.g. a tile index.
+		uint64_t begin_ns, end_ns;
+	};
+
+	static trace_recorder& instance()
+	{
+		static trace_recorder recorder;
+		return recorder;
+	}
+
+	static bool enabled() { return instance().on.load(std::memory_order_relaxed); }
+
+	void start()
+	{
+		epoch = std::chrono::steady_clock::now();
+		on.store(true, std::memory_order_relaxed);
+	}
+
+	void stop() { on.store(false, std::memory_order_relaxed); }
+
+	uint64_t now_ns() const
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - epoch).count());
+	}
+
+	void record(const event& e)
+	{
+		thread_buffer& buffer = local_buffer();
+		uint64_t head = buffer.head.load(std::memory_order_relaxed);
+		buffer.events[head & (buffer_events - 1)] = e;
+		buffer.head.store(head + 1, std::memory_order_release);
+	}
+
+	// Writes every buffered event. Call it once the traced threads are idle; a
+	// thread still recording may have its oldest events overwritten mid-write.
+	bool write(const char* path)
+	{
+		std::FILE* file = std::fopen(path, "w");
+		if (!file)
+			return false;
+
+		std::fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		bool first = true;
+
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		for (const auto& buffer : buffers)
+		{
+			std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+				first ? "" : ",\n", buffer->tid, buffer->tid);
+			first = false;
+
+			uint64_t head = buffer->head.load(std::memory_order_acquire);
+			uint64_t begin = head > buffer_events ? head - buffer_events : 0;
+			for (uint64_t i = begin; i < head; i++)
+			{
+				const event& e = buffer->events[i & (buffer_events - 1)];
+				std::fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+					e.name, buffer->tid, e.begin_ns / 1000.0, (e.end_ns - e.begin_ns) / 1000.0);
+				if (e.arg >= 0)
+					std::fprintf(file, ",\"args\":{\"n\":%lld}", static_cast<long long>(e.arg));
+				std::fprintf(file, "}");
+			}
+		}
+
+		std::fprintf(file, "\n]}\n");
+		return std::fclose(file) == 0;
+	}
+
+private:
+	struct thread_buffer
+	{
+		std::vector<event> events = std::vector<event>(buffer_events);
+		std::atomic<uint64_t> head{ 0 };
+		int tid = 0;
+	};
+
+	std::atomic<bool> on{ false };
+	std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+	std::mutex registry_mutex; // Taken once per thread, when its buffer is made.
+	std::vector<std::unique_ptr<thread_buffer>> buffers;
+
+	thread_buffer& local_buffer()
+	{
+		thread_local thread_buffer* buffer = nullptr;
+		if (!buffer)
+		{
+			std::lock_guard<std::mutex> lock(registry_mutex);
+			buffers.push_back(std::make_unique<thread_buffer>());
+			buffer = buffers.back().get();
+			buffer->tid = static_cast<int>(buffers.size() - 1);
+		}
+		return *buffer;
+	}
+};
+
+// Records the time from construction to destruction under name.
+class trace_scope
+{
+public:
+	trace_scope(const char* _name, int64_t _arg = -1)
+	{
+		if (!trace_recorder::enabled())
+			return;
+
+		name = _name;
+		arg = _arg;
+		begin_ns = trace_recorder::instance().now_ns();
+	}
+
+	~trace_scope()
+	{
+		if (name)
+			trace_recorder::instance().record({ name, arg, begin_ns, trace_recorder::instance().now_ns() });
+	}
+
+	trace_scope(const trace_scope&) = delete;
+	trace_scope& operator=(const trace_scope&) = delete;
+
+private:
+	const char* name = nullptr;
+	int64_t arg = -1;
+	uint64_t begin_ns = 0;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#ifdef RT_NO_TRACE
+#define TRACE_SCOPE(...) ((void)0)
+#else
+#define TRACE_SCOPE(...) trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+#endif
+
+#endif
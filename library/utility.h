@@ -1,20 +1,37 @@
 #ifndef UTILITY_H
 #define UTILITY_H
 
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <memory>
 #include <cstdlib>
+#include <type_traits>
 
 using std::make_shared;
 using std::shared_ptr;
 using std::sqrt;
 
+// Scalar type of vectors and colours. Build with -DRT_FLOAT to render in single
+// precision throughout.
+#ifdef RT_FLOAT
+using real = float;
+#else
+using real = double;
+#endif
+
+constexpr bool single_precision = std::is_same<real, float>::value;
+
 // Constants
 
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
 
+// Smallest hit distance accepted, so rays don't re-hit the surface they leave.
+// Float positions carry roughly 1e-7 relative error, hence the wider margin.
+const double ray_epsilon = single_precision ? 4e-3 : 1e-3;
+
 // Utility functions
 
 inline double degrees_to_radians(double degrees)
@@ -22,9 +39,56 @@ inline double degrees_to_radians(double degrees)
 	return degrees * pi / 180.0;
 }
 
+// Per-thread xorshift64* generator. rand() shares one locked state between all
+// threads, which serialises parallel rendering.
+inline uint64_t& random_state()
+{
+	static std::atomic<uint64_t> streams{ 0 };
+	thread_local uint64_t state = 0x9E3779B97F4A7C15ull * (++streams) ^ 0xD1B54A32D192ED03ull;
+	return state;
+}
+
+inline void seed_random(uint64_t seed)
+{
+	random_state() = seed ? seed : 1;
+}
+
+// Advances the xorshift64* state x and returns a double in [0, 1).
+inline double next_random(uint64_t& x)
+{
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	return ((x * 0x2545F4914F6CDD1Dull) >> 11) * 0x1.0p-53;
+}
+
+// Replaces the generator behind random_double on the thread it is installed
+// on, so a sampler can decide what numbers a path sees; Metropolis sampling
+// (see metropolis.h) replays and mutates them.
+class random_source
+{
+public:
+	virtual ~random_source() = default;
+	virtual double next() = 0;
+};
+
+inline random_source*& random_override()
+{
+	thread_local random_source* source = nullptr;
+	return source;
+}
+
+// The thread's generator, whatever random_source is installed.
+inline double random_uniform()
+{
+	return next_random(random_state());
+}
+
 inline double random_double()
 {
-	return rand() / (RAND_MAX + 1.0);
+	if (random_source* source = random_override())
+		return source->next();
+	return random_uniform();
 }
 
 inline double random_double(double min, double max)
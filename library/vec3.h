@@ -6,68 +6,181 @@
 #include <cmath>
 #include <iostream>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define VEC3_SSE
+#endif
+
+#if defined(__AVX__)
+#define VEC3_AVX
+#endif
+
 using std::sqrt;
 
-class vec3
+// Lane-wise kernels on four aligned scalars. The fourth lane of a vec3 is padding
+// and kept at zero, so horizontal sums and cross products can run on all lanes.
+namespace vec3_simd
+{
+	template <typename T>
+	inline void add(const T* a, const T* b, T* r) { for (int i = 0; i < 4; i++) r[i] = a[i] + b[i]; }
+
+	template <typename T>
+	inline void sub(const T* a, const T* b, T* r) { for (int i = 0; i < 4; i++) r[i] = a[i] - b[i]; }
+
+	template <typename T>
+	inline void mul(const T* a, const T* b, T* r) { for (int i = 0; i < 4; i++) r[i] = a[i] * b[i]; }
+
+	template <typename T>
+	inline void scale(const T* a, T t, T* r) { for (int i = 0; i < 4; i++) r[i] = a[i] * t; }
+
+	template <typename T>
+	inline T dot(const T* a, const T* b) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; }
+
+	template <typename T>
+	inline void cross(const T* a, const T* b, T* r)
+	{
+		T x = a[1] * b[2] - a[2] * b[1];
+		T y = a[2] * b[0] - a[0] * b[2];
+		T z = a[0] * b[1] - a[1] * b[0];
+		r[0] = x, r[1] = y, r[2] = z, r[3] = 0;
+	}
+
+#ifdef VEC3_SSE
+	// float: one SSE register per vector.
+
+	inline void add(const float* a, const float* b, float* r) { _mm_store_ps(r, _mm_add_ps(_mm_load_ps(a), _mm_load_ps(b))); }
+	inline void sub(const float* a, const float* b, float* r) { _mm_store_ps(r, _mm_sub_ps(_mm_load_ps(a), _mm_load_ps(b))); }
+	inline void mul(const float* a, const float* b, float* r) { _mm_store_ps(r, _mm_mul_ps(_mm_load_ps(a), _mm_load_ps(b))); }
+	inline void scale(const float* a, float t, float* r) { _mm_store_ps(r, _mm_mul_ps(_mm_load_ps(a), _mm_set1_ps(t))); }
+
+	inline float dot(const float* a, const float* b)
+	{
+		__m128 m = _mm_mul_ps(_mm_load_ps(a), _mm_load_ps(b));
+		__m128 s = _mm_add_ps(m, _mm_movehl_ps(m, m));
+		s = _mm_add_ss(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1)));
+		return _mm_cvtss_f32(s);
+	}
+
+	inline void cross(const float* a, const float* b, float* r)
+	{
+		__m128 va = _mm_load_ps(a), vb = _mm_load_ps(b);
+		__m128 a_yzx = _mm_shuffle_ps(va, va, _MM_SHUFFLE(3, 0, 2, 1));
+		__m128 b_yzx = _mm_shuffle_ps(vb, vb, _MM_SHUFFLE(3, 0, 2, 1));
+		__m128 c = _mm_sub_ps(_mm_mul_ps(va, b_yzx), _mm_mul_ps(a_yzx, vb));
+		_mm_store_ps(r, _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+	}
+
+#ifdef VEC3_AVX
+	// double: one AVX register per vector.
+
+	inline void add(const double* a, const double* b, double* r) { _mm256_store_pd(r, _mm256_add_pd(_mm256_load_pd(a), _mm256_load_pd(b))); }
+	inline void sub(const double* a, const double* b, double* r) { _mm256_store_pd(r, _mm256_sub_pd(_mm256_load_pd(a), _mm256_load_pd(b))); }
+	inline void mul(const double* a, const double* b, double* r) { _mm256_store_pd(r, _mm256_mul_pd(_mm256_load_pd(a), _mm256_load_pd(b))); }
+	inline void scale(const double* a, double t, double* r) { _mm256_store_pd(r, _mm256_mul_pd(_mm256_load_pd(a), _mm256_set1_pd(t))); }
+
+	inline double dot(const double* a, const double* b)
+	{
+		__m256d m = _mm256_mul_pd(_mm256_load_pd(a), _mm256_load_pd(b));
+		__m128d s = _mm_add_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1));
+		return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+	}
+#else
+	// double: two SSE2 registers per vector.
+
+	inline void add(const double* a, const double* b, double* r)
+	{
+		_mm_store_pd(r, _mm_add_pd(_mm_load_pd(a), _mm_load_pd(b)));
+		_mm_store_pd(r + 2, _mm_add_pd(_mm_load_pd(a + 2), _mm_load_pd(b + 2)));
+	}
+
+	inline void sub(const double* a, const double* b, double* r)
+	{
+		_mm_store_pd(r, _mm_sub_pd(_mm_load_pd(a), _mm_load_pd(b)));
+		_mm_store_pd(r + 2, _mm_sub_pd(_mm_load_pd(a + 2), _mm_load_pd(b + 2)));
+	}
+
+	inline void mul(const double* a, const double* b, double* r)
+	{
+		_mm_store_pd(r, _mm_mul_pd(_mm_load_pd(a), _mm_load_pd(b)));
+		_mm_store_pd(r + 2, _mm_mul_pd(_mm_load_pd(a + 2), _mm_load_pd(b + 2)));
+	}
+
+	inline void scale(const double* a, double t, double* r)
+	{
+		__m128d vt = _mm_set1_pd(t);
+		_mm_store_pd(r, _mm_mul_pd(_mm_load_pd(a), vt));
+		_mm_store_pd(r + 2, _mm_mul_pd(_mm_load_pd(a + 2), vt));
+	}
+
+	inline double dot(const double* a, const double* b)
+	{
+		__m128d s = _mm_add_pd(_mm_mul_pd(_mm_load_pd(a), _mm_load_pd(b)),
+			_mm_mul_pd(_mm_load_pd(a + 2), _mm_load_pd(b + 2)));
+		return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+	}
+#endif
+#endif
+}
+
+// 3-component vector stored in four aligned lanes so each operator is a single
+// SIMD instruction. T is float or double; the renderer uses vec3 = vec3_t<real>.
+template <typename T>
+class alignas(4 * sizeof(T)) vec3_t
 {
 public:
-	double e[3];
+	T e[4];
 
-	vec3() : e{ 0, 0, 0 } {}
-	vec3(double e0, double e1, double e2) : e{ e0, e1, e2 } {}
+	vec3_t() : e{ 0, 0, 0, 0 } {}
+	vec3_t(T e0, T e1, T e2) : e{ e0, e1, e2, 0 } {}
 
-	double x() const { return e[0]; }
-	double y() const { return e[1]; }
-	double z() const { return e[2]; }
+	T x() const { return e[0]; }
+	T y() const { return e[1]; }
+	T z() const { return e[2]; }
 
-	vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-	double operator[](int i) const { return e[i]; }
-	double& operator[](int i) { return e[i]; }
+	vec3_t operator-() const { return vec3_t(-e[0], -e[1], -e[2]); }
+	T operator[](int i) const { return e[i]; }
+	T& operator[](int i) { return e[i]; }
 
-	vec3& operator+=(const vec3& v)
+	vec3_t& operator+=(const vec3_t& v)
 	{
-		e[0] += v.e[0];
-		e[1] += v.e[1];
-		e[2] += v.e[2];
+		vec3_simd::add(e, v.e, e);
 		return *this;
 	}
 
-	vec3& operator*=(double t)
+	vec3_t& operator*=(T t)
 	{
-		e[0] *= t;
-		e[1] *= t;
-		e[2] *= t;
+		vec3_simd::scale(e, t, e);
 		return *this;
 	}
 
-	vec3& operator/=(double t)
+	vec3_t& operator/=(T t)
 	{
 		return *this *= 1 / t;
 	}
 
-	double length() const
+	T length() const
 	{
 		return sqrt(length_squared());
 	}
 
-	double length_squared() const
+	T length_squared() const
 	{
-		return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+		return vec3_simd::dot(e, e);
 	}
 
-	static vec3 random()
+	static vec3_t random()
 	{
-		return vec3(random_double(), random_double(), random_double());
+		return vec3_t(random_double(), random_double(), random_double());
 	}
 
-	static vec3 random(double min, double max)
+	static vec3_t random(double min, double max)
 	{
-		return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+		return vec3_t(random_double(min, max), random_double(min, max), random_double(min, max));
 	}
 
-	static vec3 lerp(const vec3& u, const vec3& v, double t)
+	static vec3_t lerp(const vec3_t& u, const vec3_t& v, double t)
 	{
-		return vec3(
+		return vec3_t(
 			lerp_double(u.x(), v.x(), t),
 			lerp_double(u.y(), v.y(), t),
 			lerp_double(u.z(), v.z(), t)
@@ -77,64 +190,75 @@ public:
 	bool near_zero() const
 	{
 		// Return true if the vector is close to zero in all dimensions.
-		auto s = 1e-8;
+		auto s = T(1e-8);
 		return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
 	}
-};
 
-// Utility functions
+	// Utility functions, defined as friends so that mixed float/double arguments
+	// convert implicitly.
 
-inline std::ostream& operator<<(std::ostream& out, const vec3& v)
-{
-	return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
-}
+	friend std::ostream& operator<<(std::ostream& out, const vec3_t& v)
+	{
+		return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
+	}
 
-inline vec3 operator+(const vec3& u, const vec3& v)
-{
-	return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
-}
+	friend vec3_t operator+(const vec3_t& u, const vec3_t& v)
+	{
+		vec3_t r;
+		vec3_simd::add(u.e, v.e, r.e);
+		return r;
+	}
 
-inline vec3 operator-(const vec3& u, const vec3& v)
-{
-	return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
-}
+	friend vec3_t operator-(const vec3_t& u, const vec3_t& v)
+	{
+		vec3_t r;
+		vec3_simd::sub(u.e, v.e, r.e);
+		return r;
+	}
 
-inline vec3 operator*(const vec3& u, const vec3& v)
-{
-	return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
-}
+	friend vec3_t operator*(const vec3_t& u, const vec3_t& v)
+	{
+		vec3_t r;
+		vec3_simd::mul(u.e, v.e, r.e);
+		return r;
+	}
 
-inline vec3 operator*(double t, const vec3& v)
-{
-	return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
-}
+	friend vec3_t operator*(T t, const vec3_t& v)
+	{
+		vec3_t r;
+		vec3_simd::scale(v.e, t, r.e);
+		return r;
+	}
 
-inline vec3 operator*(const vec3& v, double t)
-{
-	return t * v;
-}
+	friend vec3_t operator*(const vec3_t& v, T t)
+	{
+		return t * v;
+	}
 
-inline vec3 operator/(vec3 v, double t)
-{
-	return (1 / t) * v;
-}
+	friend vec3_t operator/(const vec3_t& v, T t)
+	{
+		return (1 / t) * v;
+	}
 
-inline double dot(const vec3& u, const vec3& v)
-{
-	return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
-}
+	friend T dot(const vec3_t& u, const vec3_t& v)
+	{
+		return vec3_simd::dot(u.e, v.e);
+	}
 
-inline vec3 cross(const vec3& u, const vec3& v)
-{
-	return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-		u.e[2] * v.e[0] - u.e[0] * v.e[2],
-		u.e[0] * v.e[1] - u.e[1] * v.e[0]);
-}
+	friend vec3_t cross(const vec3_t& u, const vec3_t& v)
+	{
+		vec3_t r;
+		vec3_simd::cross(u.e, v.e, r.e);
+		return r;
+	}
 
-inline vec3 normalize(vec3 v)
-{
-	return v / v.length();
-}
+	friend vec3_t normalize(const vec3_t& v)
+	{
+		return v / v.length();
+	}
+};
+
+using vec3 = vec3_t<real>;
 
 inline vec3 random_in_unit_sphere()
 {
@@ -180,4 +304,4 @@ inline vec3 refract(const vec3& v, const vec3& n, double etai_over_etat)
 	return r_perp + r_parallel;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,297 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "utility.h"
+
+#include "camera.h"
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+#include "morton.h"
+#include "parallel.h"
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+// Breadth-first path tracer. Instead of following one path to the end like
+// camera::ray_color, a batch of paths is advanced one bounce at a time through
+// separate stages: generate, intersect, sort by material, shade each material in
+// bulk, compact. Each shading stage runs one material's code over many paths, so
+// the instruction cache stays warm; every stage is a parallel_for over the batch.
+class wavefront_integrator
+{
+public:
+	size_t batch_size = size_t(1) << 20; // Paths in flight, capped to one per pixel.
+
+	// Bit d set: sort the rays of bounce d by direction octant and origin Morton
+	// code before intersecting them. Primary rays are coherent in pixel order
+	// already, so by default only secondary bounces are reordered.
+	uint32_t reorder_depths = ~1u;
+
+	wavefront_integrator(camera& _cam) : cam(_cam) {}
+
+	template <typename World>
+	void render(const World& world)
+	{
+		cam.initialize();
+
+		int width = cam.image_width;
+		size_t pixels = static_cast<size_t>(width) * cam.image_height;
+		int spp = cam.sqrt_spp * cam.sqrt_spp;
+
+		std::vector<color> framebuffer(pixels, color(0, 0, 0));
+		for (auto& t : stage_ms)
+			t = 0;
+		intersect_ms.assign(cam.max_depth, 0);
+		scene_box = world.bounding_box();
+
+		// Work item g is sample g / pixels of pixel g % pixels. A batch never holds
+		// two samples of one pixel, so finished paths can add to the framebuffer
+		// without synchronisation.
+		size_t total = pixels * spp;
+		size_t batch = std::min(batch_size, pixels);
+
+		for (size_t first = 0; first < total; first += batch)
+		{
+			std::clog << "\rPaths remaining: " << (total - first) << ' ' << std::flush;
+
+			size_t n = std::min(batch, total - first);
+			timed(generate, [&] { generate_paths(first, n, pixels, width); });
+
+			for (int depth = 0; depth < cam.max_depth && !active.empty(); depth++)
+			{
+				if (depth < 32 && (reorder_depths >> depth) & 1)
+					timed(reorder, [&] { reorder_paths(); });
+
+				auto begin = std::chrono::steady_clock::now();
+				timed(intersect, [&] { intersect_paths(world); });
+				intersect_ms[depth] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+				timed(sort, [&] { sort_paths(); });
+				timed(shade, [&] { shade_paths(); });
+				timed(compact, [&] { compact_paths(framebuffer); });
+			}
+
+			// Paths that ran out of depth contribute what they gathered so far.
+			for (uint32_t k : active)
+				framebuffer[paths[k].pixel] += paths[k].radiance;
+			active.clear();
+		}
+
+		std::clog << "\rDone.                           \n";
+
+		cam.write_image(std::cout, framebuffer, 1.0 / spp);
+
+		report(std::clog);
+	}
+
+	void report(std::ostream& out) const
+	{
+		static const char* names[] = { "generate", "reorder", "intersect", "sort", "shade", "compact" };
+		for (int s = 0; s < stage_count; s++)
+			out << "  " << names[s] << ": " << stage_ms[s] << " ms\n";
+
+		out << "  intersect by depth:";
+		for (size_t d = 0; d < intersect_ms.size() && intersect_ms[d] > 0; d++)
+			out << ' ' << d << (d < 32 && (reorder_depths >> d) & 1 ? "*" : "") << '=' << intersect_ms[d];
+		out << " ms (* reordered)\n";
+	}
+
+private:
+	enum stage { generate, reorder, intersect, sort, shade, compact, stage_count };
+
+	// Shading queues, in the order they run.
+	enum queue { q_miss, q_lambertian, q_metal, q_dielectric, q_emissive, q_other, queue_count };
+
+	struct path
+	{
+		ray r;
+		color throughput;
+		color radiance;
+		uint32_t pixel;
+		bool alive;
+	};
+
+	camera& cam;
+	std::vector<path> paths;
+	std::vector<hit_record> hits;
+	std::vector<uint8_t> queue_of;
+	std::vector<uint32_t> active, sorted;
+	std::vector<size_t> queue_offsets;
+	std::vector<uint64_t> reorder_keys;
+	aabb scene_box;
+	double stage_ms[stage_count];
+	std::vector<double> intersect_ms;
+
+	template <typename F>
+	void timed(stage s, F&& f)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		f();
+		auto end = std::chrono::steady_clock::now();
+		stage_ms[s] += std::chrono::duration<double, std::milli>(end - begin).count();
+	}
+
+	void generate_paths(size_t first, size_t n, size_t pixels, int width)
+	{
+		paths.resize(n);
+		hits.resize(n);
+		queue_of.resize(n);
+		active.resize(n);
+
+		parallel_for(n, [&](size_t b, size_t e)
+			{
+				for (size_t k = b; k < e; k++)
+				{
+					size_t g = first + k;
+					int s = static_cast<int>(g / pixels);
+					size_t p = g % pixels;
+					int i = static_cast<int>(p % width), j = static_cast<int>(p / width);
+
+					ray r = cam.get_ray(i, j, s % cam.sqrt_spp, s / cam.sqrt_spp);
+					paths[k] = { r, color(1, 1, 1), color(0, 0, 0), static_cast<uint32_t>(p), true };
+					active[k] = static_cast<uint32_t>(k);
+				}
+			});
+	}
+
+	template <typename World>
+	void intersect_paths(const World& world)
+	{
+		parallel_for(active.size(), [&](size_t b, size_t e)
+			{
+				for (size_t a = b; a < e; a++)
+				{
+					uint32_t k = active[a];
+					if (!world.hit(paths[k].r, interval(ray_epsilon, infinity), hits[k]))
+					{
+						queue_of[k] = q_miss;
+						continue;
+					}
+
+					switch (hits[k].mat->kind())
+					{
+					case material_kind::lambertian: queue_of[k] = q_lambertian; break;
+					case material_kind::metal: queue_of[k] = q_metal; break;
+					case material_kind::dielectric: queue_of[k] = q_dielectric; break;
+					case material_kind::diffuse_light: queue_of[k] = q_emissive; break;
+					default: queue_of[k] = q_other; break;
+					}
+				}
+			});
+	}
+
+	void reorder_paths()
+	{
+		vec3 lo = scene_box.min();
+		vec3 extent = scene_box.max() - lo;
+
+		reorder_keys.resize(active.size());
+		parallel_for(active.size(), [&](size_t b, size_t e)
+			{
+				for (size_t a = b; a < e; a++)
+				{
+					const ray& r = paths[active[a]].r;
+
+					uint32_t q[3];
+					for (int axis = 0; axis < 3; axis++)
+					{
+						double t = extent[axis] > 0 ? (r.origin()[axis] - lo[axis]) / extent[axis] : 0;
+						q[axis] = static_cast<uint32_t>(std::clamp(t, 0.0, 1.0) * 1023);
+					}
+
+					uint64_t octant = (r.direction().x() < 0) | (r.direction().y() < 0) << 1 | (r.direction().z() < 0) << 2;
+					reorder_keys[a] = octant << 30 | morton_3d(q[0], q[1], q[2]);
+				}
+			});
+
+		parallel_radix_sort(reorder_keys, active, 33);
+	}
+
+	void sort_paths()
+	{
+		parallel_counting_sort(active, sorted, queue_offsets, queue_count,
+			[this](uint32_t k) { return queue_of[k]; });
+	}
+
+	void shade_paths()
+	{
+		parallel_for(queue_offsets[q_miss + 1] - queue_offsets[q_miss], [&](size_t b, size_t e)
+			{
+				for (size_t a = queue_offsets[q_miss] + b; a < queue_offsets[q_miss] + e; a++)
+				{
+					path& p = paths[sorted[a]];
+					p.radiance += p.throughput * cam.miss_color(p.r);
+					p.alive = false;
+				}
+			});
+
+		shade_queue<lambertian>(q_lambertian);
+		shade_queue<metal>(q_metal);
+		shade_queue<dielectric>(q_dielectric);
+		shade_queue<diffuse_light>(q_emissive);
+		shade_queue<material>(q_other);
+	}
+
+	// Same estimator as camera::shade, with the recursion unrolled into the
+	// path's throughput.
+	template <typename Material>
+	void shade_queue(int q)
+	{
+		size_t begin = queue_offsets[q];
+		parallel_for(queue_offsets[q + 1] - begin, [&](size_t b, size_t e)
+			{
+				for (size_t a = begin + b; a < begin + e; a++)
+				{
+					uint32_t k = sorted[a];
+					path& p = paths[k];
+					const hit_record& rec = hits[k];
+					const Material& mat = static_cast<const Material&>(*rec.mat);
+
+					p.radiance += p.throughput * mat.emitted(rec.u, rec.v, rec.pos);
+
+					ray scattered;
+					color attenuation;
+					if (!mat.scatter(p.r, rec, attenuation, scattered))
+					{
+						p.alive = false;
+						continue;
+					}
+
+					if (mat.is_specular())
+					{
+						p.throughput = p.throughput * attenuation;
+						p.r = ray(scattered.origin(), scattered.direction(), p.r.spread());
+						continue;
+					}
+
+					double weight = cam.sample_non_specular(mat, p.r, rec, scattered);
+					p.throughput = p.throughput * attenuation * weight;
+					p.r = scattered;
+					p.alive = weight > 0;
+				}
+			});
+	}
+
+	void compact_paths(std::vector<color>& framebuffer)
+	{
+		// Retire finished paths, then keep the survivors in material order.
+		parallel_for(sorted.size(), [&](size_t b, size_t e)
+			{
+				for (size_t a = b; a < e; a++)
+				{
+					const path& p = paths[sorted[a]];
+					if (!p.alive)
+						framebuffer[p.pixel] += p.radiance;
+				}
+			});
+
+		std::vector<size_t> offsets;
+		parallel_counting_sort(sorted, active, offsets, 2,
+			[this](uint32_t k) { return paths[k].alive ? 0 : 1; });
+		active.resize(offsets[1]);
+	}
+};
+
+#endif
@@ -0,0 +1,408 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "utility.h"
+
+#include "bvh.h"
+#include "hittable.h"
+#include "rayStats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Node of a wide_bvh: up to eight children, whose boxes are stored as 8-bit
+// coordinates on a per-axis grid of spacing 2^exponent anchored at origin, so
+// child box = origin + q * 2^exponent. Quantization rounds outwards, so the
+// boxes only ever grow. 104 bytes of data, aligned to two cache lines.
+struct alignas(64) wide_node
+{
+	float origin[3];
+	int8_t exponent[3];
+	uint8_t child_count;
+	uint32_t child[8];     // Interior child: node index. Leaf child: first primitive.
+	uint8_t leaf_size[8];  // Primitives of a leaf child, 0 for an interior child.
+	uint8_t lo[3][8];      // Per axis, per child. Unused slots have lo 255 and hi 0
+	uint8_t hi[3][8];      // so they can never be hit.
+};
+
+// 8-wide BVH made by collapsing a binary bvh: each node takes the binary node's
+// subtrees and keeps opening the largest interior one until it has eight. Nodes
+// are about a fifth as many and a third the size of bvh_node, and one ray tests
+// all children of a node at once with SIMD. Primitives are referenced, not
+// owned, so the scene has to outlive it.
+class wide_bvh final : public hittable
+{
+public:
+	wide_bvh(const bvh& tree)
+	{
+		prims.reserve(tree.prims.size());
+		for (const auto& p : tree.prims)
+			prims.push_back(p.get());
+
+		if (tree.nodes.empty())
+			return;
+
+		nodes.reserve(tree.nodes.size() / 4 + 1);
+		nodes.emplace_back();
+		collapse(tree, 0, 0);
+		bbox = tree.bounding_box();
+	}
+
+	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+	{
+		if (nodes.empty())
+			return false;
+
+		ray_data rd(r);
+		entry stack[stack_limit];
+		int stack_size = 0;
+		uint32_t current = 0;
+		bool hit_anything = false;
+		test_tally tests;
+
+		while (true)
+		{
+			float t_near[8];
+			uint32_t mask = intersect_children(nodes[current], rd, ray_t, t_near);
+			tests.add(nodes[current].child_count);
+
+			// Push the children hit far to near, so the nearest comes off first.
+			int first = stack_size;
+			while (mask)
+			{
+				int k = lowest_bit(mask);
+				mask &= mask - 1;
+
+				entry e = { nodes[current].child[k], nodes[current].leaf_size[k], t_near[k] };
+				int j = stack_size++;
+				for (; j > first && stack[j - 1].t < e.t; j--)
+					stack[j] = stack[j - 1];
+				stack[j] = e;
+			}
+
+			// Test leaves until the next interior node comes up.
+			while (true)
+			{
+				if (stack_size == 0)
+					return hit_anything;
+
+				entry e = stack[--stack_size];
+				if (e.t > ray_t.max)
+					continue;
+
+				if (e.leaf_size == 0)
+				{
+					current = e.index;
+					break;
+				}
+
+				tests.add(e.leaf_size);
+				for (uint32_t i = e.index; i < e.index + e.leaf_size; i++)
+				{
+					if (prims[i]->hit(r, ray_t, rec))
+					{
+						hit_anything = true;
+						ray_t.max = rec.t;
+					}
+				}
+			}
+		}
+	}
+
+	bool occluded(const ray& r, interval ray_t) const override
+	{
+		if (nodes.empty())
+			return false;
+
+		ray_data rd(r);
+		uint32_t stack[stack_limit];
+		int stack_size = 0;
+		uint32_t current = 0;
+		test_tally tests;
+
+		while (true)
+		{
+			const wide_node& node = nodes[current];
+			float t_near[8];
+			uint32_t mask = intersect_children(node, rd, ray_t, t_near);
+			tests.add(node.child_count);
+
+			while (mask)
+			{
+				int k = lowest_bit(mask);
+				mask &= mask - 1;
+
+				if (node.leaf_size[k] == 0)
+				{
+					stack[stack_size++] = node.child[k];
+					continue;
+				}
+
+				tests.add(node.leaf_size[k]);
+				for (uint32_t i = node.child[k]; i < node.child[k] + node.leaf_size[k]; i++)
+					if (prims[i]->occluded(r, ray_t))
+						return true;
+			}
+
+			if (stack_size == 0)
+				return false;
+			current = stack[--stack_size];
+		}
+	}
+
+	aabb bounding_box() const override { return bbox; }
+
+	size_t node_count() const { return nodes.size(); }
+	size_t primitive_count() const { return prims.size(); }
+	size_t memory_bytes() const { return nodes.size() * sizeof(wide_node) + prims.size() * sizeof(prims[0]); }
+
+private:
+	// Each node pushes at most 7 more entries than it pops.
+	static constexpr int stack_limit = 8 * 64;
+
+	struct entry
+	{
+		uint32_t index;
+		uint32_t leaf_size;
+		float t;
+	};
+
+	// Ray in the single precision the child test runs in. Zero direction
+	// components get a huge finite inverse, so q * inv_dir never makes 0 * inf.
+	struct ray_data
+	{
+		float origin[3], inv_dir[3];
+		bool negative[3];
+
+		ray_data(const ray& r)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				double d = r.direction()[a];
+				if (fabs(d) < 1e-30)
+					d = d < 0 ? -1e-30 : 1e-30;
+				origin[a] = static_cast<float>(r.origin()[a]);
+				inv_dir[a] = static_cast<float>(1 / d);
+				negative[a] = d < 0;
+			}
+		}
+	};
+
+	std::vector<wide_node> nodes;
+	std::vector<const hittable*> prims;
+	aabb bbox;
+
+	static int lowest_bit(uint32_t mask)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return static_cast<int>(index);
+#else
+		return __builtin_ctz(mask);
+#endif
+	}
+
+	static float exp2_int(int e)
+	{
+		uint32_t bits = static_cast<uint32_t>(e + 127) << 23;
+		float f;
+		std::memcpy(&f, &bits, sizeof(f));
+		return f;
+	}
+
+	// Slab test against all eight children. Per axis the plane distance is
+	// q * (2^e / d) + (origin - o) / d, one multiply-add per child and plane.
+	// Returns a bit per child hit and its entry distance in t_near. The exit
+	// distance is pushed out by a few ulps to make up for single precision.
+	static uint32_t intersect_children(const wide_node& node, const ray_data& rd, const interval& ray_t, float* t_near)
+	{
+		float mul[3], add[3];
+		const uint8_t* q_near[3];
+		const uint8_t* q_far[3];
+		for (int a = 0; a < 3; a++)
+		{
+			mul[a] = exp2_int(node.exponent[a]) * rd.inv_dir[a];
+			add[a] = (node.origin[a] - rd.origin[a]) * rd.inv_dir[a];
+			q_near[a] = rd.negative[a] ? node.hi[a] : node.lo[a];
+			q_far[a] = rd.negative[a] ? node.lo[a] : node.hi[a];
+		}
+
+		const float t_min = static_cast<float>(ray_t.min);
+		const float t_max = static_cast<float>(ray_t.max);
+		const float widen = 1 + 4 * std::numeric_limits<float>::epsilon();
+
+#if defined(__AVX2__)
+		__m256 tn = _mm256_set1_ps(t_min), tf = _mm256_set1_ps(t_max);
+		for (int a = 0; a < 3; a++)
+		{
+			__m256 m = _mm256_set1_ps(mul[a]), c = _mm256_set1_ps(add[a]);
+			tn = _mm256_max_ps(tn, _mm256_add_ps(_mm256_mul_ps(load8(q_near[a]), m), c));
+			tf = _mm256_min_ps(tf, _mm256_add_ps(_mm256_mul_ps(load8(q_far[a]), m), c));
+		}
+		tf = _mm256_mul_ps(tf, _mm256_set1_ps(widen));
+		_mm256_storeu_ps(t_near, tn);
+		return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ)));
+#elif defined(VEC3_SSE)
+		uint32_t mask = 0;
+		__m128 near_q[3][2], far_q[3][2];
+		for (int a = 0; a < 3; a++)
+		{
+			load8(q_near[a], near_q[a][0], near_q[a][1]);
+			load8(q_far[a], far_q[a][0], far_q[a][1]);
+		}
+
+		for (int h = 0; h < 2; h++)
+		{
+			__m128 tn = _mm_set1_ps(t_min), tf = _mm_set1_ps(t_max);
+			for (int a = 0; a < 3; a++)
+			{
+				__m128 m = _mm_set1_ps(mul[a]), c = _mm_set1_ps(add[a]);
+				tn = _mm_max_ps(tn, _mm_add_ps(_mm_mul_ps(near_q[a][h], m), c));
+				tf = _mm_min_ps(tf, _mm_add_ps(_mm_mul_ps(far_q[a][h], m), c));
+			}
+			tf = _mm_mul_ps(tf, _mm_set1_ps(widen));
+			_mm_storeu_ps(t_near + 4 * h, tn);
+			mask |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(tn, tf))) << (4 * h);
+		}
+		return mask;
+#else
+		uint32_t mask = 0;
+		for (int k = 0; k < 8; k++)
+		{
+			float tn = t_min, tf = t_max;
+			for (int a = 0; a < 3; a++)
+			{
+				tn = std::max(tn, q_near[a][k] * mul[a] + add[a]);
+				tf = std::min(tf, q_far[a][k] * mul[a] + add[a]);
+			}
+			t_near[k] = tn;
+			mask |= static_cast<uint32_t>(tn <= tf * widen) << k;
+		}
+		return mask;
+#endif
+	}
+
+#if defined(__AVX2__)
+	static __m256 load8(const uint8_t* q)
+	{
+		return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(q))));
+	}
+#elif defined(VEC3_SSE)
+	static void load8(const uint8_t* q, __m128& low, __m128& high)
+	{
+		__m128i zero = _mm_setzero_si128();
+		__m128i words = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(q)), zero);
+		low = _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+		high = _mm_cvtepi32_ps(_mm_unpackhi_epi16(words, zero));
+	}
+#endif
+
+	// Fills nodes[index] with the subtrees under binary node source and recurses
+	// into the interior ones, whose wide nodes are allocated next to each other.
+	void collapse(const bvh& tree, uint32_t source, uint32_t index)
+	{
+		uint32_t children[8];
+		int count = 0;
+
+		const bvh_node& root = tree.nodes[source];
+		if (root.count > 0)
+		{
+			children[count++] = source;
+		}
+		else
+		{
+			children[count++] = source + 1;
+			children[count++] = root.offset;
+		}
+
+		while (count < 8)
+		{
+			int widest = -1;
+			double widest_area = -1;
+			for (int k = 0; k < count; k++)
+			{
+				const bvh_node& n = tree.nodes[children[k]];
+				if (n.count == 0 && n.box.surface_area() > widest_area)
+				{
+					widest = k;
+					widest_area = n.box.surface_area();
+				}
+			}
+
+			if (widest < 0)
+				break;
+
+			uint32_t opened = children[widest];
+			children[widest] = opened + 1;
+			children[count++] = tree.nodes[opened].offset;
+		}
+
+		wide_node node = {};
+		node.child_count = static_cast<uint8_t>(count);
+		std::memset(node.lo, 255, sizeof(node.lo));
+
+		double scale[3];
+		for (int a = 0; a < 3; a++)
+		{
+			const interval& extent = root.box.axis(a);
+
+			// Largest float at or below the box, then the smallest power of two
+			// spacing that spans the box in 255 steps.
+			float origin = static_cast<float>(extent.min);
+			if (origin > extent.min)
+				origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+
+			double span = extent.max - origin;
+			int e = span > 0 ? static_cast<int>(std::ceil(std::log2(span / 255))) : -126;
+			e = std::clamp(e, -126, 127);
+			while (e < 127 && std::ldexp(255.0, e) < span)
+				e++;
+
+			node.origin[a] = origin;
+			node.exponent[a] = static_cast<int8_t>(e);
+			scale[a] = std::ldexp(1.0, e);
+		}
+
+		uint32_t first_child = static_cast<uint32_t>(nodes.size());
+		uint32_t interior = 0;
+		for (int k = 0; k < count; k++)
+		{
+			const bvh_node& n = tree.nodes[children[k]];
+			for (int a = 0; a < 3; a++)
+			{
+				double lo = std::floor((n.box.axis(a).min - node.origin[a]) / scale[a]);
+				double hi = std::ceil((n.box.axis(a).max - node.origin[a]) / scale[a]);
+				node.lo[a][k] = static_cast<uint8_t>(std::clamp(lo, 0.0, 255.0));
+				node.hi[a][k] = static_cast<uint8_t>(std::clamp(hi, 0.0, 255.0));
+			}
+
+			if (n.count > 0)
+			{
+				node.child[k] = n.offset;
+				node.leaf_size[k] = static_cast<uint8_t>(n.count);
+			}
+			else
+			{
+				node.child[k] = first_child + interior++;
+			}
+		}
+
+		nodes.resize(nodes.size() + interior);
+		nodes[index] = node;
+
+		for (int k = 0; k < count; k++)
+			if (node.leaf_size[k] == 0)
+				collapse(tree, children[k], node.child[k]);
+	}
+};
+
+#endif